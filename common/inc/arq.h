@@ -0,0 +1,143 @@
+/*
+ * Selective-repeat ARQ (automatic repeat request) for reliable
+ * packet delivery over a lossy link.
+ *
+ * Each direction of a link has an ArqSender on one end, and an
+ * ArqReceiver on the other.
+ *
+ * The sender numbers each packet, and keeps a copy until it's acked.
+ * Up to arqWindowSize packets may be unacked at once.
+ *
+ * The receiver delivers packets in order, holding any that arrive
+ * after a gap, and replies with an ArqAck packet describing
+ * everything it has so far:
+ *  - nextSeq: cumulative ack of all earlier packets
+ *  - selective: bitmask of later packets that arrived after a gap
+ *
+ * The sender resends a packet when either:
+ *  - something sent after it was acked. The links here don't
+ *    reorder packets, so it must have been lost.
+ *  - it's not acked within timeoutTicks, such as when the last
+ *    packet in a burst, or its ack, was lost.
+ *
+ * Acks are unsequenced and never resent, since each ack
+ * supersedes earlier ones.
+ *
+ * Either end may restart:
+ *  - A new receiver syncs to the first packet it gets. Anything
+ *    the sender had in flight before that isn't recovered.
+ *  - Each sender session numbers from a random starting point,
+ *    which marks that session. A running sender's packets are
+ *    always within a window of the receiver's position, so the
+ *    receiver resyncs on anything else. Acks from an earlier
+ *    session are likewise outside the sender's range, and ignored.
+ *    Sessions that start within a window of each other can't be
+ *    told apart, but that's a 1 in 2^27 chance per restart.
+ * Sequence numbers use all 32 bits, so arq isn't compatible with
+ * compact framing, which only carries the low 16.
+ *
+ * All storage is static. These classes don't depend on the RTOS,
+ * so they're also used by host apps and tests. Time is passed in
+ * as ticks of any unit, as long as it matches timeoutTicks.
+ */
+
+#pragma once
+
+#include "packets.h"
+
+// Max unacked packets per direction.
+// Must fit in ArqAck::selective, plus one for nextSeq.
+// To keep the link busy while recovering from a loss, this should
+// cover about two round trips worth of packets.
+const uint32_t arqWindowSize = 16;
+static_assert(arqWindowSize <= 33, "Window too large for selective ack bits");
+
+class ArqSender
+{
+public:
+  // Pass a random firstSeq on each start, so that receivers
+  // can tell this session apart from any earlier one.
+  ArqSender(uint32_t firstSeq = 1) { reset(firstSeq); }
+
+  // Whether window has room for another packet
+  bool canSend() const { return nextSeq - base < arqWindowSize; }
+
+  // Assigns next sequence number to packet, and keeps a copy until acked.
+  // Only call when canSend().
+  void send(Packet& packet, uint32_t now);
+
+  // Frees acked packets, and notes any that were skipped over as lost.
+  void processAck(const ArqAck& ack);
+
+  // Returns next packet to resend, or nullptr if none are due.
+  // Call until nullptr after each ack, and periodically for timeouts.
+  // Pointer is valid until next call to send().
+  const Packet* nextRetransmit(uint32_t now);
+
+  // Number of packets sent but not yet acked
+  uint32_t inFlight() const { return nextSeq - base; }
+
+  // Forget all packets and start a new session numbered from firstSeq
+  void reset(uint32_t firstSeq);
+
+  // Resend if not acked within this time
+  uint32_t timeoutTicks = 100;
+
+  // Total resent packets
+  uint32_t retransmits = 0;
+
+private:
+  struct Slot
+  {
+    Packet packet;
+    uint32_t sentTick;
+    uint32_t sendOrder; // counts every transmission, including resends
+    bool acked;
+    bool lost;
+  };
+
+  Slot& slot(uint32_t seq) { return slots[seq % arqWindowSize]; }
+
+  Slot slots[arqWindowSize];
+  uint32_t base;    // oldest unacked sequence number
+  uint32_t nextSeq; // next sequence number to assign
+  uint32_t sendCount = 0;
+};
+
+class ArqReceiver
+{
+public:
+  // Stores packet if it's new and within window.
+  // Returns false if dropped as a duplicate or out of window.
+  // Either way, an ack should be sent afterwards, since the sender
+  // may have missed the previous one.
+  bool receive(const Packet& packet);
+
+  // Returns next packet in sequence, or nullptr if it hasn't arrived yet.
+  // Call until nullptr after each receive().
+  // Pointer is valid until next call to receive().
+  const Packet* nextInOrder();
+
+  // Describes everything received so far
+  ArqAck ack() const;
+
+  // Forget all packets, and sync to whatever arrives next
+  void reset();
+
+  // Total dropped packets
+  uint32_t duplicates = 0;
+
+private:
+  struct Slot
+  {
+    Packet packet;
+    bool received;
+  };
+
+  Slot& slot(uint32_t seq) { return slots[seq % arqWindowSize]; }
+  const Slot& slot(uint32_t seq) const { return slots[seq % arqWindowSize]; }
+
+  Slot slots[arqWindowSize];
+  uint32_t nextSeq = 1; // next sequence number to deliver
+  bool synced = false;  // whether we've seen the sender's numbering
+};
@@ -0,0 +1,178 @@
+/*
+ * Deferred binary logging.
+ *
+ * Instead of formatting log messages on the target, a compact
+ * record is sent holding the address of the format string and
+ * the raw argument values. Formatting is done on the host, which
+ * looks up the format string in the firmware ELF.
+ *
+ * A record is a sequence of 32-bit words:
+ *   header word:
+ *     bits 0-23  offset of format string from binLogFlashBase
+ *     bits 24-29 number of argument words that follow
+ *     bit 31     append newline (from logln)
+ *   argument words, in order:
+ *     integers 32 bits or smaller - 1 word
+ *     64-bit integers and floating point (as double) - 2 words, low word first
+ *     other pointers (%p) - 1 word
+ *     strings (%s):
+ *       if in flash - 1 word with string address, looked up by host
+ *       otherwise - 1 word with byte count, then bytes padded to a word
+ *
+ * Arguments are encoded by their C++ type, and decoded according to
+ * the format string, so these must agree like they would for printf.
+ *
+ * The decoder also supports a %P conversion, which is a packet sent
+ * inline like a string, and formatted with snprintPacket().
+ *
+ * Records are sent by ItmLogger when binaryLog is set. See host_apps/binlog
+ * for decoding.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+// Strings in flash are identified by address, or by offset from start of flash
+const uint32_t binLogFlashBase = 0x08000000;
+const uint32_t binLogMaxFlashOffset = 1 << 24;
+
+const uint32_t binLogMaxArgWords = 63;
+const uint32_t binLogNewlineFlag = 1u << 31;
+
+inline uint32_t binLogHeader(uint32_t fmtOffset, uint32_t argWords, bool newline)
+{
+  return (newline ? binLogNewlineFlag : 0) | (argWords << 24) | fmtOffset;
+}
+
+inline uint32_t binLogFormatOffset(uint32_t header)
+{
+  return header & (binLogMaxFlashOffset - 1);
+}
+
+inline uint32_t binLogArgWords(uint32_t header)
+{
+  return (header >> 24) & binLogMaxArgWords;
+}
+
+// Total bytes in record, including header
+inline uint32_t binLogRecordLength(uint32_t header)
+{
+  return 4 * (1 + binLogArgWords(header));
+}
+
+// Gets offset of string from start of flash.
+// Returns false if string is not in flash, such as when built at
+// runtime, or when running on host. These must be sent inline.
+inline bool binLogFlashOffset(const char* str, uint32_t& offset)
+{
+#if defined(__arm__)
+  offset = reinterpret_cast<uint32_t>(str) - binLogFlashBase;
+  return offset < binLogMaxFlashOffset;
+#else
+  (void)str;
+  (void)offset;
+  return false;
+#endif
+}
+
+/*
+ * Builds a single record in the provided buffer.
+ * Arguments that don't fit are dropped, and inline
+ * strings are truncated.
+ *
+ *   BinLogWriter writer(msg.buf, sizeof(msg.buf));
+ *   writer.arg(value);
+ *   msg.len = writer.finish(fmtOffset, newline);
+ */
+class BinLogWriter
+{
+public:
+  BinLogWriter(void* buf, uint32_t len)
+    : buf{ static_cast<uint8_t*>(buf) }
+    , capacity{ len / 4 < binLogMaxArgWords + 1 ? len / 4 : binLogMaxArgWords + 1 }
+  {}
+
+  void word(uint32_t value)
+  {
+    if (pos < capacity) {
+      memcpy(buf + 4 * pos++, &value, 4);
+    }
+  }
+
+  // Byte count, then bytes padded to a word
+  void bytes(const void* data, uint32_t len)
+  {
+    if (pos >= capacity) {
+      return;
+    }
+    uint32_t space = 4 * (capacity - pos - 1);
+    len = len < space ? len : space;
+    word(len);
+    memcpy(buf + 4 * pos, data, len);
+    memset(buf + 4 * pos + len, 0, (4 - len % 4) % 4);
+    pos += (len + 3) / 4;
+  }
+
+  template<typename T>
+  typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type arg(T value)
+  {
+    if (sizeof(T) > 4) {
+      uint64_t wide = static_cast<uint64_t>(value);
+      word(wide);
+      word(wide >> 32);
+    } else {
+      word(static_cast<uint32_t>(value));
+    }
+  }
+
+  // Floats are promoted to double, as for printf
+  void arg(double value)
+  {
+    uint64_t wide;
+    memcpy(&wide, &value, sizeof(wide));
+    word(wide);
+    word(wide >> 32);
+  }
+
+  void arg(const char* str)
+  {
+    uint32_t offset;
+    if (binLogFlashOffset(str, offset)) {
+      word(binLogFlashBase + offset);
+    } else {
+      bytes(str, strlen(str));
+    }
+  }
+
+  template<typename T>
+  void arg(const T* ptr)
+  {
+    word(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(ptr)));
+  }
+
+  // Writes header.
+  // Returns record length in bytes.
+  uint32_t finish(uint32_t fmtOffset, bool newline)
+  {
+    uint32_t header = binLogHeader(fmtOffset, pos - 1, newline);
+    memcpy(buf, &header, 4);
+    return 4 * pos;
+  }
+
+private:
+  uint8_t* buf;
+  uint32_t capacity; // in words
+  uint32_t pos = 1;  // in words, after header
+};
+
+// Looks up a null-terminated string in the firmware image by address.
+// Returns nullptr if not found.
+typedef const char* (*BinLogLookup)(uint32_t address);
+
+// Formats a single record into buf.
+// Record may be incomplete, in which case missing arguments are noted.
+// Returns number of characters written, not including null terminator.
+uint32_t binLogFormat(char* buf, uint32_t bufLen, const void* record, uint32_t recordLen, BinLogLookup lookup);
@@ -0,0 +1,54 @@
+/*
+ * Consistent Overhead Byte Stuffing (COBS).
+ *
+ * Encodes data so it contains no zero bytes, then appends a single
+ * zero byte as a frame delimiter. A receiver can always resync by
+ * scanning for the next zero, so a corrupted frame costs just that frame.
+ *
+ * Overhead is one byte per 254 bytes of data, plus one code byte and
+ * the delimiter. For packets, that's a fixed 2 bytes.
+ *
+ * https://en.wikipedia.org/wiki/Consistent_Overhead_Byte_Stuffing
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// How a link separates packets on the wire
+enum class LinkFraming
+{
+  Raw,  // Packets back-to-back. Receiver resyncs by searching for startWord.
+  Cobs, // Each write() is a COBS frame, terminated by a zero delimiter.
+};
+
+const uint8_t cobsDelimiter = 0;
+
+// Worst-case bytes added when encoding `len` bytes, including delimiter
+constexpr uint32_t cobsOverhead(uint32_t len)
+{
+  return len / 254 + 2;
+}
+
+// Worst-case encoded frame length, including delimiter
+constexpr uint32_t cobsMaxFrameLength(uint32_t len)
+{
+  return len + cobsOverhead(len);
+}
+
+/*
+ * Encodes `len` bytes from src into dst, followed by the delimiter.
+ * Returns frame length, which is at most cobsMaxFrameLength(len).
+ *
+ * Can encode in place, if src starts at least cobsOverhead(len)
+ * bytes after dst. This lets data be read into the end of a
+ * transmit buffer and encoded without another buffer.
+ */
+uint32_t cobsEncode(void* dst, const void* src, uint32_t len);
+
+/*
+ * Decodes a single frame of `len` bytes, not including the delimiter.
+ * Returns decoded length, or 0 if the frame is empty or malformed.
+ * Can decode in place (dst == src).
+ */
+uint32_t cobsDecode(void* dst, const void* src, uint32_t len);
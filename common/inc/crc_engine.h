@@ -0,0 +1,88 @@
+/*
+ * CRC-32 engine used for packet wrappers.
+ *
+ * Returns the same IEEE CRC-32 as crc32() in software_crc.h,
+ * but may offload the work to the STM32 hardware CRC unit.
+ *
+ * Backend is selected at compile time:
+ *   - Hardware: Default for STM32 builds.
+ *     Requires MX_CRC_Init() and initCrcEngine() to be called during
+ *     startup, before the scheduler starts.
+ *   - Software: Default for host apps and unit tests.
+ *     May also be forced on target by defining CRC_ENGINE_SOFTWARE.
+ *
+ * Use the shared instance via crcEngine().
+ */
+
+#pragma once
+
+#include "software_crc.h"
+#include <stdint.h>
+
+#if !defined(CRC_ENGINE_SOFTWARE) && !defined(CRC_ENGINE_HARDWARE)
+#if defined(USE_FULL_LL_DRIVER)
+#define CRC_ENGINE_HARDWARE
+#else
+#define CRC_ENGINE_SOFTWARE
+#endif
+#endif
+
+// Table-driven software CRC. Usable anywhere.
+class SoftwareCrcEngine
+{
+public:
+  uint32_t crc32(const void* data, uint32_t length) { return ::crc32(data, length); }
+};
+
+#if defined(CRC_ENGINE_HARDWARE)
+
+#include "static_rtos.h"
+
+/*
+ * Hardware CRC unit.
+ *
+ * The STM32F4 unit only supports the non-reflected CRC-32 polynomial,
+ * no output inversion, and whole 32-bit words. This wrapper bit-reverses
+ * input words and the result to match the reflected IEEE CRC-32,
+ * and finishes any trailing bytes in software.
+ *
+ * The unit is a single shared resource, so access is arbitrated with
+ * a mutex. Rather than waiting on another task, a caller that finds
+ * the unit busy just falls back to the software calculation.
+ * So this is safe to call from any task, but not from ISRs.
+ */
+class HardwareCrcEngine
+{
+public:
+  uint32_t crc32(const void* data, uint32_t length);
+
+private:
+  StaticMutex mutex;
+};
+
+using CrcEngine = HardwareCrcEngine;
+
+// Builds the shared instance. Call from main() before starting the
+// scheduler, since the compiler's guard for function-local statics
+// isn't RTOS-aware, so tasks racing on the first call could construct
+// the mutex twice.
+void initCrcEngine();
+
+// Shared instance. Defined in crc_engine.cpp
+CrcEngine& crcEngine();
+
+#else
+
+using CrcEngine = SoftwareCrcEngine;
+
+// Nothing to build for software engine
+inline void initCrcEngine() {}
+
+// Shared instance. Software engine is stateless, so nothing to arbitrate.
+inline CrcEngine& crcEngine()
+{
+  static CrcEngine engine;
+  return engine;
+}
+
+#endif
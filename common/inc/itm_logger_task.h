@@ -3,9 +3,15 @@
  * Handles waiting for ITM bus to be free so other tasks
  * are unblocked to do other stuff.
  * Write logs to this by calling "log()".
- * Calls to log() may eventually be made faster by caching
- * printf args for formatting later. This improvement won't
- * require any changes from users.
+ *
+ * Setting binaryLog skips formatting on the target. log() and logln()
+ * then send compact records holding the format string address and raw
+ * args, which are formatted on the host. See binary_log.h.
+ * Text from other calls, such as send(), is wrapped in a record.
+ *
+ * Logs go to ITM, and can also be forwarded as LogMessage packets
+ * with forwardTo().
+ *
  * Some additional ideas for improvements:
  * - Macro for capturing file, function name, and line number.
  * - Log levels and filtering by severity.
@@ -13,13 +19,16 @@
 
 #pragma once
 
+#include "binary_log.h"
 #include "catch_errors.h"
 #include "itm_logging.h"
+#include "packets.h"
 #include "static_rtos.h"
 #include "watchdog_task.h"
 
 // forward declarations to work-around circular dependencies
 class Watchdog;
+class PacketOutput;
 
 // A Message Buffer seems to be strictly better,
 // but allowing easy revert to Queue for performance experiments.
@@ -34,8 +43,18 @@ public:
     UBaseType_t priority = osPriorityLow // task priority. Contains ITM busy loop
   );
 
-  size_t log(LogMsg& msg, const char* fmt, ...);
-  size_t logln(LogMsg& msg, const char* fmt, ...);
+  template<typename... Args>
+  size_t log(LogMsg& msg, const char* fmt, Args... args)
+  {
+    return binaryLog ? logBinary(msg, false, fmt, args...) : logText(msg, false, fmt, args...);
+  }
+
+  template<typename... Args>
+  size_t logln(LogMsg& msg, const char* fmt, Args... args)
+  {
+    return binaryLog ? logBinary(msg, true, fmt, args...) : logText(msg, true, fmt, args...);
+  }
+
   // warnln is identical to logln, but allows easier breakpoint
   // detection of non-critical warnings
   template<typename... Args>
@@ -46,15 +65,58 @@ public:
   }
   size_t logHex(LogMsg& msg);
   size_t send(LogMsg& msg);
+  // Sends a record built with BinLogWriter. Only for binaryLog mode.
+  size_t sendRecord(LogMsg& msg);
+  // Whether there's anywhere to send logs
+  bool enabled();
   // rtos looping function for task
   void func();
 
+  // Send binary records instead of text.
+  // Only change this before the scheduler starts.
+  bool binaryLog = false;
+
+  // Also forward logs as LogMessage packets.
+  // Can't be set in constructor due to circular dependency.
+  // Turns off verboseIO on output, since each logged packet
+  // would otherwise generate another packet.
+  // Only call this before the scheduler starts.
+  void forwardTo(PacketOutput& output);
+
 private:
   static void funcWrapper(ItmLogger* p) { p->func(); }
+
+  size_t logText(LogMsg& msg, bool newline, const char* fmt, ...);
+
+  // Encodes args into a record, without formatting.
+  // Falls back to text if format string isn't in flash.
+  template<typename... Args>
+  size_t logBinary(LogMsg& msg, bool newline, const char* fmt, Args... args)
+  {
+    // Skip logging if disabled
+    if (!enabled()) {
+      return 1;
+    }
+
+    uint32_t fmtOffset;
+    if (!binLogFlashOffset(fmt, fmtOffset)) {
+      return logText(msg, newline, fmt, args...);
+    }
+
+    BinLogWriter writer(msg.buf, sizeof(msg.buf));
+    // Expands args in order (no fold expressions in C++14)
+    int expand[] = { 0, (writer.arg(args), 0)... };
+    (void)expand;
+    msg.len = writer.finish(fmtOffset, newline);
+    return sendRecord(msg);
+  }
+
   StaticTask<ItmLogger> task;
   // For receiving message from buffer
   LogMsg msg_;
   Watchdog& watchdog;
+  PacketOutput* packetOutput = nullptr; // where to forward logs, if set
+  Packet packet_;                       // for forwarding to packetOutput
 
 #if defined(USE_QUEUE_FOR_LOGGER)
 
@@ -23,6 +23,16 @@ enum class ItmPort : uint32_t
   PacketsInSequence,
   PacketsOutCount,
   PacketsOutSequence,
+  BinaryLog, // records from ItmLogger in binaryLog mode
+  // Packets queued in each PacketOutput lane, in PacketLane order
+  ControlLaneDepth,
+  TelemetryLaneDepth,
+  BulkLaneDepth,
+  // Packets dropped from each PacketOutput lane, in PacketLane order
+  ControlLaneDrops,
+  TelemetryLaneDrops,
+  BulkLaneDrops,
+  UsbTransfersOut, // IN transfers started by UsbTask
   // Last bit used as workaround for this issue:
   // https://community.st.com/s/question/0D53W00000Hx6dxSAB/bug-itm-active-port-ter-defaults-to-port-0-enabled-when-tracing-is-disabled
   Enabled = 31,
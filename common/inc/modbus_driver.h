@@ -17,7 +17,7 @@
 class ModbusDriver
 {
 public:
-  ModbusDriver(UartTasks& uart,          // where to send and receive modbus data
+  ModbusDriver(UartPort& uart,           // where to send and receive modbus data
                uint32_t responseDelayMs, // how long to wait for a response
                Writable& target,         // where to send resulting packets
                Packet& packet,           // for above - reuses parent's
@@ -34,7 +34,7 @@ private:
   void flushInput();
   uint32_t readMinBytesWithTimeout(size_t targetLen, uint32_t startTick, uint32_t maxTicks);
 
-  UartTasks& uart;
+  UartPort& uart;
 
   // How long to wait for modbus server to prepare a response.
   uint32_t responseDelayMs;
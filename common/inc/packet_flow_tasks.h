@@ -4,19 +4,32 @@
 
 #pragma once
 
+#include "arq.h"
 #include "interfaces.h"
+#include "packet_pool.h"
 #include "packet_utils.h"
 #include "task_utilities.h"
 
+class PacketOutput;
+
+/*
+ * Parses packets from a data stream.
+ *
+ * Each packet is copied once into a pool slot, and its handle is
+ * queued until read. Readers may take the handle, or a copy of the
+ * packet via the Readable interface.
+ */
 class PacketIntake
   : public CanProcessPacket
-  , public Readable
+  , public PacketReadable
 {
 public:
-  PacketIntake(const char* name,                       // task name
-               Readable& target,                       // supplies unparsed data stream
-               TaskUtilitiesArg& utilArg,              // common utilities
-               UBaseType_t priority = osPriorityNormal // task priority
+  PacketIntake(const char* name,                         // task name
+               Readable& target,                         // supplies unparsed data stream
+               PacketPool& pool,                         // where to store parsed packets
+               TaskUtilitiesArg& utilArg,                // common utilities
+               LinkFraming framing = LinkFraming::Raw,   // must match sender's framing
+               UBaseType_t priority = osPriorityNormal   // task priority
   );
 
   // rtos looping function
@@ -26,30 +39,71 @@ public:
   // Describes what to do with parsed packets.
   void processPacket(const Packet& packet);
 
+  // Optional CanProcessPacket batch callback.
+  // Stashes all packets from one parsing pass with a single reader wakeup.
+  void processPackets(const PacketSpan& packets);
+
   // Required by Readable interface.
-  // Describes how to get packets from this object.
+  // Describes how to get copies of packets from this object.
   size_t read(void* buf, size_t len, TickType_t ticks);
 
+  // Required by PacketReadable interface.
+  // Describes how to get packets from this object without copying.
+  bool readHandle(PacketHandle& handle, TickType_t ticks);
+
+  // Optional reliable delivery. See arq.h.
+  // Incoming packets are put back in order before being stashed,
+  // and acks are sent through arqOutput, which must also be set.
+  // Incoming acks are passed along to arqOutput's ArqSender.
+  ArqReceiver* arq = nullptr;
+  PacketOutput* arqOutput = nullptr;
+
+  // Log contents of each incoming packet
+  bool verboseIO = true;
+
 private:
   static void funcWrapper(PacketIntake* p) { p->func(); }
+  void notePacket(const Packet& packet);
+  void stash(const Packet& packet);
+  void receiveReliable(const Packet& packet);
+  void sendAck();
   Readable& target;
+  PacketPool& pool;
+  alignas(Packet) uint8_t batch[sizeof(Packet) * 2]; // parsed packets waiting to be stashed
   PacketParser parser;
   TaskUtilities util;
   StaticTask<PacketIntake> task;
 
-  uint8_t buf[maxWrappedPacketLength * 2]; // storage for parsing
-  size_t len = 0;                          // number of bytes in buffer
-  uint32_t packetsInCount = 0;             // number of good packets received
+  StaticParserRing<maxWrappedPacketLength * 2> ring; // storage for parsing
+  uint32_t packetsInCount = 0;                       // number of good packets received
+  bool ackNeeded = false;                            // whether arq received anything since last ack
 
   // Where to stash parsed packets until they are ready to be read.
-  StaticMessageBuffer<sizeof(Packet) * 12> msgbuf;
+  StaticQueue<PacketHandle, 12> handles;
 };
 
-class PacketOutput : public Writable
+/*
+ * Wraps and sends packets written by other tasks.
+ *
+ * Packets are queued in separate lanes by PacketLane, so control
+ * packets don't wait behind a backlog of telemetry or logs.
+ * By default, lanes are drained in strict priority order. With
+ * weightedDraining, each waiting lane instead gets a share of
+ * every round according to laneWeights, so bulk traffic can't
+ * be starved indefinitely.
+ *
+ * Each lane's depth and drops are reported via ITM.
+ *
+ * Packets are queued as pool handles. Those written by copy are first
+ * copied into the pool. Packets are edited in place before sending,
+ * so writers shouldn't keep references to read afterwards.
+ */
+class PacketOutput : public PacketWritable
 {
 public:
   PacketOutput(const char* name,                       // task name
                Writable& target,                       // where to send wrapped packets
+               PacketPool& pool,                       // where copied packets are stored
                TaskUtilitiesArg& utilArg,              // common utilities
                UBaseType_t priority = osPriorityNormal // task priority
   );
@@ -58,27 +112,87 @@ public:
   void func();
 
   // Required by Writable interface.
-  // Describes how to give packets to this object.
+  // Describes how to give copies of packets to this object.
   size_t write(const void* buf, size_t len, TickType_t ticks);
 
+  // Required by PacketWritable interface.
+  // Describes how to give packets to this object without copying.
+  bool writeHandle(PacketHandle handle, TickType_t ticks);
+
+  // Send compact (v2) frames instead of wrapped packets.
+  // Only enable if the receiver's parser has acceptCompact set.
+  bool compactFraming = false;
+
+  // When several packets are waiting, send them together as a single
+  // Aggregate packet, which shares one wrapper and crc.
+  // The parser unpacks these automatically.
+  bool aggregatePackets = false;
+
+  // Optional reliable delivery. See arq.h.
+  // Packets are kept until acked, and resent if lost.
+  // Writers block while the window is full.
+  // Aggregation is skipped, since each packet is acked separately.
+  ArqSender* arq = nullptr;
+
+  // How often to check for acks and retransmit timeouts
+  TickType_t arqPollTicks = 5;
+
+  // Passes an ack from the receiving side of the link to arq.
+  // Called by PacketIntake.
+  void receiveAck(const ArqAck& ack);
+
+  // Share lanes in proportion to laneWeights, rather than strict priority.
+  // Weights are packets per round, in PacketLane order.
+  bool weightedDraining = false;
+  uint32_t laneWeights[numPacketLanes] = { 8, 4, 1 };
+
+  // Packets waiting in lane
+  size_t laneDepth(PacketLane lane);
+
+  // Failed writes to each lane, either because the lane stayed full
+  // until the write timed-out (writers may retry), or because the
+  // packet was malformed.
+  uint32_t laneDrops[numPacketLanes] = {};
+
+  // Log contents of each outgoing packet.
+  // Cleared by ItmLogger::forwardTo(), since each logged packet would
+  // otherwise generate another packet.
+  bool verboseIO = true;
+
 private:
   static void funcWrapper(PacketOutput* p) { p->func(); }
+  bool nextLane(PacketLane& lane);
+  bool readNext(PacketHandle& handle, TickType_t ticks);
+  void takeFromLane(PacketLane lane, PacketHandle& handle);
+  bool peekNext(PacketHandle& handle);
+  void noteDrop(PacketLane lane);
+  bool preparePacket(Packet& packet);
+  void serviceArq();
+  bool aggregateFits(const Packet& packet);
+  void sendAggregate(PacketHandle first);
+  void sendPacket(WrappedPacket& out);
   Writable& target;
+  PacketPool& pool;
   TaskUtilities util;
   StaticTask<PacketOutput> task;
-  WrappedPacket wrap;
+  WrappedPacket aggWrap; // for building aggregate packets, or resending arq packets
+  uint8_t frame[maxCompactFrameLength]; // encoded compact frame
 
   uint32_t packetsOutCount = 0; // number of packets sent
 
-  // For rewrapping packets with correct outgoing sequence number
+  // For applying correct outgoing sequence number
   PacketSequencer sequencer;
 
-  // Where to stash incoming packets until we are ready to
-  // wrap and transmit.
-  StaticMessageBuffer<sizeof(Packet) * 12> msgbuf;
+  // Latest ack from receiveAck(), waiting for our task
+  ArqAck pendingAck;
+  bool ackPending = false;
+
+  // Where to queue incoming packets until we are ready to
+  // wrap and transmit. One per PacketLane.
+  StaticQueue<PacketHandle, 4> lanes[numPacketLanes];
 
-  // Mutex allows multiple writers to this object's Message Buffer
-  StaticMutex writeMutex;
+  // Packets remaining in this round for each lane, when weightedDraining
+  uint32_t laneCredits[numPacketLanes] = {};
 };
 
 class Coupling
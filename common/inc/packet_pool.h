@@ -0,0 +1,93 @@
+/*
+ * Statically allocated pool of packets, shared between tasks.
+ *
+ * Rather than copying packets into and out of each task's message
+ * buffer, a packet is written once into a pool slot, and a handle
+ * to that slot is passed through queues. Each slot is a WrappedPacket,
+ * so the wrapper can be filled-in and sent in place.
+ *
+ * Each slot has a single owner. Whoever holds a handle owns the slot,
+ * and must either pass it on or release it:
+ *
+ *   PacketHandle handle = util.alloc(pool);
+ *   initializePacket(handle->packet, PacketID::VfdStatus);
+ *   ...
+ *   util.writeHandle(packetOutput, handle); // now owned by packetOutput
+ *
+ * Slots aren't shared, since owners such as PacketOutput edit packets
+ * in place. Copy the packet to keep it after passing the handle on.
+ */
+
+#pragma once
+
+#include "interfaces.h"
+#include "packets.h"
+#include "static_rtos.h"
+
+typedef WrappedPacket* PacketHandle;
+
+class PacketPool
+{
+public:
+  // Takes a free slot.
+  // Returns nullptr if none are free before timeout.
+  PacketHandle alloc(TickType_t ticks);
+
+  // Returns slot to the pool
+  void release(PacketHandle handle);
+
+  // Number of free slots
+  uint32_t available();
+
+protected:
+  PacketPool(WrappedPacket* slots, bool* allocated, uint32_t numSlots)
+    : slots{ slots }
+    , allocated{ allocated }
+    , numSlots{ numSlots }
+  {}
+
+  // Adds all slots to free list
+  void init(QueueHandle_t freeList);
+
+private:
+  uint32_t index(PacketHandle handle);
+
+  WrappedPacket* slots;
+  bool* allocated; // for catching double release
+  uint32_t numSlots;
+  QueueHandle_t freeList;
+};
+
+template<size_t TSlots>
+class StaticPacketPool : public PacketPool
+{
+public:
+  StaticPacketPool()
+    : PacketPool(slots, allocated, TSlots)
+  {
+    init(freeList.handle);
+  }
+
+private:
+  WrappedPacket slots[TSlots];
+  bool allocated[TSlots] = {};
+  StaticQueue<PacketHandle, TSlots> freeList;
+};
+
+// Accepts packets either by copy (Writable), or by handle
+class PacketWritable : public Writable
+{
+public:
+  // Passes caller's handle to this object.
+  // Returns false on timeout, in which case caller still owns the handle.
+  virtual bool writeHandle(PacketHandle handle, TickType_t ticks) = 0;
+};
+
+// Supplies packets either by copy (Readable), or by handle
+class PacketReadable : public Readable
+{
+public:
+  // Passes a handle to caller, who must release it or pass it on.
+  // Returns false on timeout.
+  virtual bool readHandle(PacketHandle& handle, TickType_t ticks) = 0;
+};
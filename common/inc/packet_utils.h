@@ -1,12 +1,25 @@
 #pragma once
 
+#include "cobs.h"
+#include "crc_engine.h"
 #include "packets.h"
 #include <stdio.h>
+#include <string.h> // memmove, memcpy
 
 void initializePacket(Packet& packet, PacketID id);
 
 void setPacketIdAndLength(Packet& packet, PacketID id);
 
+// Sets variable-length body contents, and packet length to match
+void setLogMessage(Packet& packet, const char* msg, uint32_t len);
+void setDummyPayload(Packet& packet, const void* payload, uint32_t len);
+
+uint32_t dummyPayloadLength(const Packet& packet);
+
+// Adds packet to an aggregate packet. Start with initializePacket(aggregate, PacketID::Aggregate).
+// Returns false if there's not enough room.
+bool appendToAggregate(Packet& aggregate, const Packet& packet);
+
 WrappedPacket& setPacketWrapper(WrappedPacket& wrap);
 
 void fillFreqPacket(WrappedPacket& wrap, uint32_t seq, uint32_t node, uint32_t freq);
@@ -32,11 +45,254 @@ uint32_t copyWrapped(void* buf, WrappedPacket& wrap);
 // Writes just the inner unwrapped packet to a buffer
 uint32_t copyInner(void* buf, WrappedPacket& wrap);
 
+// Encodes packet as a compact (v2) frame.
+// buf must have room for maxCompactFrameLength bytes.
+// Returns frame length.
+uint32_t encodeCompact(void* buf, const Packet& packet);
+
+// Decodes a single compact (v2) frame into packet.
+// Only the low 16 bits of sequence number are restored.
+// Returns frame length, or 0 if the frame is incomplete or invalid.
+uint32_t decodeCompact(Packet& packet, const void* buf, uint32_t len);
+
+// Extends a 16-bit sequence number to the 32-bit value nearest to `last`
+inline uint32_t unwrapSequence(uint32_t last, uint16_t sequenceNum)
+{
+  return last + (int16_t)(uint16_t)(sequenceNum - (uint16_t)last);
+}
+
+// Returns offset of the first startWord in buf between start (inclusive)
+// and end (exclusive), or end if not found.
+// Up to 3 bytes past end are read.
+uint32_t findStartWord(const void* buf, uint32_t start, uint32_t end);
+
+// Same as above, but for the low `width` bytes (2 or 4) of `word`.
+uint32_t findSyncWord(const void* buf, uint32_t start, uint32_t end, uint32_t word, uint32_t width);
+
+// Packets are stored at 4-byte aligned offsets in a PacketSpan
+inline uint32_t alignedPacketLength(uint32_t length)
+{
+  return (length + 3) & ~3u;
+}
+
+inline uint32_t alignedPacketLength(const Packet& packet)
+{
+  return alignedPacketLength(packet.length);
+}
+
+/*
+ * A group of packets stored back-to-back in a buffer.
+ * Each packet starts on a 4-byte boundary.
+ *
+ *   for (const Packet& packet : span) { ... }
+ */
+class PacketSpan
+{
+public:
+  PacketSpan(const uint8_t* data, uint32_t len, uint32_t count)
+    : data{ data }
+    , len{ len }
+    , count{ count }
+  {}
+
+  class Iterator
+  {
+  public:
+    Iterator(const uint8_t* p)
+      : p{ p }
+    {}
+    const Packet& operator*() const { return *(const Packet*)p; }
+    const Packet* operator->() const { return (const Packet*)p; }
+    Iterator& operator++()
+    {
+      p += alignedPacketLength(**this);
+      return *this;
+    }
+    bool operator!=(const Iterator& other) const { return p != other.p; }
+
+  private:
+    const uint8_t* p;
+  };
+
+  Iterator begin() const { return Iterator(data); }
+  Iterator end() const { return Iterator(data + len); }
+
+  const uint8_t* const data; // First packet
+  const uint32_t len;        // Total bytes, including alignment padding
+  const uint32_t count;      // Number of packets
+};
+
 // Interface for objects that have a packet parsing callback
 class CanProcessPacket
 {
 public:
   virtual void processPacket(const Packet&) = 0;
+
+  // Optional batch callback, used when the parser is given batch storage.
+  // Receives all packets (and parsing errors) from one extractPackets() call,
+  // in order. May be called more than once per extractPackets() if the
+  // batch storage fills up.
+  // Default just passes each packet to processPacket().
+  virtual void processPackets(const PacketSpan& packets)
+  {
+    for (const Packet& packet : packets) {
+      processPacket(packet);
+    }
+  }
+};
+
+// Index of byte `at` positions after `start` in a ring of `size` bytes.
+inline uint32_t ringIndex(uint32_t size, uint32_t start, uint32_t at)
+{
+  uint32_t idx = start + at;
+  return idx >= size ? idx - size : idx;
+}
+
+/*
+ * Circular buffer of unparsed bytes, for feeding PacketParser
+ * without shifting leftover bytes after each parse.
+ *
+ *   ring.commitWrite(read(ring.writePtr(), ring.writeSpace()));
+ *   parser.extractPackets(ring);
+ *
+ * Use StaticParserRing to also allocate storage.
+ */
+class ParserRing
+{
+public:
+  ParserRing(uint8_t* buf, uint32_t size)
+    : buf{ buf }
+    , size{ size }
+  {}
+
+  // Where to write new data
+  uint8_t* writePtr() { return buf + ringIndex(size, readIdx, len); }
+
+  // Contiguous free space at writePtr().
+  // There may be more free space at the start of the ring after filling this.
+  uint32_t writeSpace() const
+  {
+    uint32_t writeIdx = ringIndex(size, readIdx, len);
+    if (len == size) {
+      return 0;
+    }
+    return writeIdx >= readIdx ? size - writeIdx : readIdx - writeIdx;
+  }
+
+  // Call after writing n bytes to writePtr()
+  void commitWrite(uint32_t n) { len += n; }
+
+  // Releases n parsed bytes from the front of the ring
+  void consume(uint32_t n)
+  {
+    readIdx = ringIndex(size, readIdx, n);
+    len -= n;
+    // Maximize contiguous write space when empty
+    if (!len) {
+      readIdx = 0;
+    }
+  }
+
+  uint8_t* const buf;
+  const uint32_t size;
+  uint32_t readIdx = 0; // Index of oldest unparsed byte
+  uint32_t len = 0;     // Number of unparsed bytes
+};
+
+/*
+ * Returns pointer to `n` bytes at offset `at` from `start` in the ring,
+ * or nullptr if those bytes wrap around the end.
+ */
+inline const uint8_t* ringContiguous(const uint8_t* ring, uint32_t size, uint32_t start, uint32_t at, uint32_t n)
+{
+  uint32_t idx = ringIndex(size, start, at);
+  return idx + n <= size ? ring + idx : nullptr;
+}
+
+// Copies `n` bytes at offset `at` from `start` in the ring, handling wrap-around.
+void ringCopy(void* dst, const uint8_t* ring, uint32_t size, uint32_t start, uint32_t at, uint32_t n);
+
+// Ring version of findSyncWord(). Offsets are relative to `start`.
+uint32_t ringFindSyncWord(const uint8_t* ring, uint32_t size, uint32_t start, uint32_t from, uint32_t end, uint32_t word, uint32_t width);
+
+// Ring version of memchr(). Returns `end` if not found.
+uint32_t ringFindByte(const uint8_t* ring, uint32_t size, uint32_t start, uint32_t from, uint32_t end, uint8_t byte);
+
+template<uint32_t TSize>
+class StaticParserRing : public ParserRing
+{
+public:
+  StaticParserRing()
+    : ParserRing(storage, TSize)
+  {}
+
+private:
+  uint8_t storage[TSize];
+};
+
+/*
+ * Parsing logic shared by PacketParser and TypedPacketParser.
+ *
+ * Parsed packets are passed to a "sink" which provides:
+ *   void deliver(const Packet&);  // Called for each packet and parsing error
+ *   void flush();                 // Called at the end of each parsing pass
+ *   bool accepts(PacketID);       // Packets with other IDs are skipped before the crc check
+ */
+class PacketParserCore
+{
+public:
+  // 0 used for internal messages,
+  // so external seq num should start at 1.
+  // todo - convert to using `internal` origin
+  uint32_t lastSeqNum = 0;
+
+  // Set to also accept compact (v2) frames, alongside wrapped packets.
+  // Note that this also lets trailing garbage shorter than a wrapped
+  // packet be reported as dropped.
+  bool acceptCompact = false;
+
+  // Set to LinkFraming::Cobs if the sender COBS-encodes each packet.
+  // Each frame may hold either a wrapped packet or a compact frame.
+  LinkFraming framing = LinkFraming::Raw;
+
+  // Clear when a reliable delivery layer (see arq.h) handles ordering,
+  // since resent packets would otherwise be reported as out of sequence.
+  bool checkSequence = true;
+
+protected:
+  template<typename TSink>
+  uint32_t extractLinear(TSink& sink, void* bufArg, uint32_t len);
+
+  template<typename TSink>
+  uint32_t extractRing(TSink& sink, ParserRing& ring);
+
+  template<typename TSink>
+  uint32_t parse(TSink& sink, const uint8_t* ring, uint32_t size, uint32_t start, uint32_t len);
+
+  template<typename TSink>
+  uint32_t parseCobs(TSink& sink, const uint8_t* ring, uint32_t size, uint32_t start, uint32_t len);
+
+  // Checks a single decoded COBS frame. Returns false if invalid.
+  template<typename TSink>
+  bool deliverFrame(TSink& sink, uint32_t frameLength, uint32_t& skippedBytes);
+
+  // Reports skipped bytes and sequence errors, then delivers a valid packet.
+  // Aggregate packets are unpacked.
+  template<typename TSink>
+  void deliverValid(TSink& sink, const Packet& packet, uint32_t& skippedBytes);
+
+  // Reports sequence errors, then delivers a single packet
+  template<typename TSink>
+  void deliverSequenced(TSink& sink, const Packet& packet);
+
+  // Allocated space for any new packets we need to generate
+  // for reporting parsing errors.
+  // Zeroed, since sequenceNum is never set for these.
+  Packet errorPacket{};
+  // For packets that wrap around the end of a ring buffer
+  WrappedPacket scratch;
+  // For decoding COBS frames. Aligned so wrapped packets can be used in place.
+  alignas(WrappedPacket) uint8_t cobsFrame[cobsMaxFrameLength(maxWrappedPacketLength)];
 };
 
 /*
@@ -45,12 +301,15 @@ public:
  * Create an instance by providing another object which implements
  * the CanProcessPacket interface (requires a processPacket() callback).
  *
- * Feed data into this parser via extractPackets().
+ * Feed data into this parser via extractPackets(), either as
+ * a linear buffer, or as a ParserRing.
  *
  * When complete packets (or parsing errors) are encountered,
  * they are sent to the processPacket() callback.
+ *
+ * See TypedPacketParser for a version without virtual calls.
  */
-class PacketParser
+class PacketParser : public PacketParserCore
 {
 public:
   // Constructor for parser object that takes a callback function of
@@ -59,23 +318,617 @@ public:
     : processer{ processer }
   {}
 
+  // Same as above, but collects packets in `batch` and delivers them
+  // together through processPackets().
+  // `batch` should be declared alignas(Packet).
+  template<uint32_t TSize>
+  PacketParser(CanProcessPacket& processer, uint8_t (&batch)[TSize])
+    : batchBuf{ batch }
+    , batchSize{ TSize }
+    , processer{ processer }
+  {
+    static_assert(TSize >= sizeof(Packet), "Batch storage must fit the largest packet");
+  }
+
   // Feed new data for parsing into this function.
   // See .cpp comments for more details.
   uint32_t extractPackets(void* bufArg, uint32_t len);
 
-  // 0 used for internal messages,
-  // so external seq num should start at 1.
-  // todo - convert to using `internal` origin
-  uint32_t lastSeqNum = 0;
+  // Parses data in a ring buffer, without moving any bytes.
+  // Returns number of leftover unparsed bytes.
+  uint32_t extractPackets(ParserRing& ring);
 
 private:
-  // Allocated space for any new packets we need to generate
-  // for reporting parsing errors.
-  Packet errorPacket;
+  friend class PacketParserCore;
+
+  // Sends packet to processPacket(), or appends it to the batch
+  void deliver(const Packet& packet);
+  // Sends any batched packets to processPackets()
+  void flush();
+  // All IDs are passed through
+  bool accepts(PacketID) { return true; }
+
+  // Optional storage for batched delivery
+  uint8_t* const batchBuf = nullptr;
+  const uint32_t batchSize = 0;
+  uint32_t batchLen = 0;   // Bytes used in batchBuf
+  uint32_t batchCount = 0; // Packets in batchBuf
+
   // Contains callback for what to do with parsed packet
   CanProcessPacket& processer;
 };
 
+// Bitmask of PacketIDs
+constexpr uint32_t packetIdMask()
+{
+  return 0;
+}
+
+template<typename... T>
+constexpr uint32_t packetIdMask(PacketID id, T... rest)
+{
+  return (1u << static_cast<uint32_t>(id)) | packetIdMask(rest...);
+}
+
+static_assert(static_cast<uint32_t>(PacketID::NumIDs) <= 32, "packetIdMask needs a wider type");
+
+/*
+ * Same as PacketParser, but calls TProcessor::processPacket() directly,
+ * so there's no virtual call per packet, and it can be inlined.
+ * TProcessor just needs a processPacket(const Packet&) method. If it also
+ * implements CanProcessPacket, mark the class `final` so the compiler
+ * can devirtualize the call.
+ *
+ * Optionally list the PacketIDs that the processor handles:
+ *
+ *   TypedPacketParser<MyProcessor, PacketID::VfdStatus, PacketID::ModbusError> parser(processor);
+ *
+ * Packets with any other ID are skipped without checking their crc,
+ * and are not delivered. Parsing errors are always delivered.
+ * Skipping trusts the unverified length field, so a corrupted
+ * header may cause the following packet to be dropped too.
+ */
+template<typename TProcessor, PacketID... TAccepted>
+class TypedPacketParser : public PacketParserCore
+{
+public:
+  TypedPacketParser(TProcessor& processor)
+    : processor{ processor }
+  {}
+
+  // Same as PacketParser::extractPackets()
+  uint32_t extractPackets(void* buf, uint32_t len) { return extractLinear(*this, buf, len); }
+  uint32_t extractPackets(ParserRing& ring) { return extractRing(*this, ring); }
+
+private:
+  friend class PacketParserCore;
+
+  static constexpr uint32_t acceptMask = sizeof...(TAccepted) ? packetIdMask(TAccepted...) : ~0u;
+
+  void deliver(const Packet& packet) { processor.processPacket(packet); }
+  void flush() {}
+  // Aggregates are always unpacked, and their inner packets filtered individually
+  bool accepts(PacketID id) { return id == PacketID::Aggregate || (acceptMask & (1u << static_cast<uint32_t>(id))); }
+
+  TProcessor& processor;
+};
+
+// ------- PacketParserCore implementation -------
+
+/*
+ * Parses a linear buffer.
+ * Moves remaining unprocessed bytes to beginning of buf.
+ * Returns number of leftover bytes.
+ */
+template<typename TSink>
+uint32_t PacketParserCore::extractLinear(TSink& sink, void* bufArg, uint32_t len)
+{
+  uint8_t* buf = (uint8_t*)bufArg;
+
+  // A full buffer is a ring that hasn't wrapped yet
+  uint32_t offset = parse(sink, buf, len, 0, len);
+
+  // Shift out any consumed bytes
+  if (offset) {
+    len -= offset;
+    // Move leftover bytes to beginning of buffer
+    memmove(buf, buf + offset, len);
+  }
+
+  // Return number of leftover bytes
+  return len;
+}
+
+/*
+ * Parses data in a ring buffer.
+ * Consumed bytes are released from the ring, and nothing is moved.
+ * Returns number of leftover bytes in the ring.
+ */
+template<typename TSink>
+uint32_t PacketParserCore::extractRing(TSink& sink, ParserRing& ring)
+{
+  ring.consume(parse(sink, ring.buf, ring.size, ring.readIdx, ring.len));
+  return ring.len;
+}
+
+/*
+ * Parses `len` bytes of data starting at index `start` of a
+ * circular buffer of `size` bytes.
+ * Returns the number of bytes consumed.
+ *
+ * Packets that wrap around the end of the ring are copied to
+ * a scratch packet, since the crc and callback need them contiguous.
+ * Compact frames are decoded into that scratch packet too.
+ *
+ *  Todos to think about:
+ *  	Additional error packet allocated locally.
+ *  	If we made a packetExtractor object, could statically allocate
+ *  	the errorPacket.
+ *  	Could have sequence number history too, to enable that error message.
+ *  	There will likely need to be more than one of these extractors, so
+ *  	can't just do non-object static.
+ */
+template<typename TSink>
+uint32_t PacketParserCore::parse(TSink& sink, const uint8_t* ring, uint32_t size, uint32_t start, uint32_t len)
+{
+  if (framing == LinkFraming::Cobs) {
+    return parseCobs(sink, ring, size, start, len);
+  }
+
+  uint32_t offset = 0;
+  uint32_t skippedBytes = 0;
+
+  // Smallest complete frame we're looking for
+  const uint32_t minFrameLength = acceptCompact ? compactHeaderLength : minWrappedPacketLength;
+
+  // Keep checking while there are still enough bytes to read
+  while (len >= offset + minFrameLength) {
+    // Check if this is a valid packet
+
+    uint32_t magic;
+    auto magicPtr = ringContiguous(ring, size, start, offset, sizeof(magic));
+    if (magicPtr) {
+      memcpy(&magic, magicPtr, sizeof(magic));
+    } else {
+      ringCopy(&magic, ring, size, start, offset, sizeof(magic));
+    }
+
+    // Check for compact frame
+    if (acceptCompact && (magic & 0xFFFFFF) == (compactSyncWord | compactVersion << 16)) {
+      CompactHeader header;
+      ringCopy(&header, ring, size, start, offset, compactHeaderLength);
+
+      // Check if length is reasonable
+      uint32_t packetLength = minPacketLength + header.bodyLength;
+      if (packetLength > sizeof(Packet)) {
+        initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+        errorPacket.body.parsingError.invalidLength = packetLength;
+        sink.deliver(errorPacket);
+        offset++;
+        skippedBytes++;
+        continue;
+      }
+
+      // Check if id is reasonable
+      if (header.id >= static_cast<uint8_t>(PacketID::NumIDs)) {
+        initializePacket(errorPacket, PacketID::ParsingErrorInvalidID);
+        errorPacket.body.parsingError.invalidID = header.id;
+        sink.deliver(errorPacket);
+        offset++;
+        skippedBytes++;
+        continue;
+      }
+
+      // Check if length is allowed for this id
+      if (!packetLengthValid(static_cast<PacketID>(header.id), packetLength)) {
+        initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+        errorPacket.body.parsingError.invalidLength = packetLength;
+        sink.deliver(errorPacket);
+        offset++;
+        skippedBytes++;
+        continue;
+      }
+
+      // Wait for rest of frame
+      uint32_t frameLength = compactHeaderLength + header.bodyLength;
+      if (len < offset + frameLength) {
+        break;
+      }
+
+      uint32_t sequenceNum = unwrapSequence(lastSeqNum, header.sequenceNum);
+
+      // Skip packets the consumer never handles (see below)
+      if (!sink.accepts(static_cast<PacketID>(header.id))) {
+        lastSeqNum = sequenceNum;
+        offset += frameLength;
+        continue;
+      }
+
+      // Make sure entire frame is contiguous
+      auto frame = ringContiguous(ring, size, start, offset, frameLength);
+      if (!frame) {
+        ringCopy(&scratch, ring, size, start, offset, frameLength);
+        frame = (const uint8_t*)&scratch;
+      }
+
+      // Check crc
+      uint32_t calculatedCRC = crcEngine().crc32(frame + compactCrcOffset, frameLength - compactCrcOffset);
+      if (calculatedCRC != header.crc) {
+        initializePacket(errorPacket, PacketID::ParsingErrorInvalidCRC);
+        errorPacket.body.parsingError.invalidCRC.provided = header.crc;
+        errorPacket.body.parsingError.invalidCRC.calculated = calculatedCRC;
+        sink.deliver(errorPacket);
+        offset++;
+        skippedBytes++;
+        continue;
+      }
+
+      // Decode. Body may overlap if frame was copied to scratch.
+      Packet& packet = scratch.packet;
+      memmove(&packet.body, frame + compactHeaderLength, header.bodyLength);
+      packet.length = packetLength;
+      packet.sequenceNum = sequenceNum;
+      packet.origin = static_cast<PacketOrigin>(header.origin);
+      packet.id = static_cast<PacketID>(header.id);
+
+      deliverValid(sink, packet, skippedBytes);
+
+      offset += frameLength;
+      continue;
+    }
+
+    // Check for start word
+    if (magic != startWord) {
+      // Mismatch, skip ahead to next possible start word.
+      // Same result as trying each following byte.
+      uint32_t next = acceptCompact ? ringFindSyncWord(ring, size, start, offset + 1, len - compactHeaderLength + 1, compactSyncWord, sizeof(compactSyncWord))
+                                    : ringFindSyncWord(ring, size, start, offset + 1, len - minWrappedPacketLength + 1, startWord, sizeof(startWord));
+      skippedBytes += next - offset;
+      offset = next;
+      continue;
+    }
+
+    // Compact frames are smaller, so may not have a whole wrapper yet
+    if (len < offset + minWrappedPacketLength) {
+      break;
+    }
+
+    auto wrap = (const WrappedPacket*)ringContiguous(ring, size, start, offset, minWrappedPacketLength);
+    if (!wrap) {
+      // Header wraps around end of ring
+      ringCopy(&scratch, ring, size, start, offset, minWrappedPacketLength);
+      wrap = &scratch;
+    }
+
+    // Check if length is reasonable
+    if (wrap->packet.length < minPacketLength || //
+        wrap->packet.length > sizeof(Packet)) {
+      // Report length mismatch
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+      errorPacket.body.parsingError.invalidLength = wrap->packet.length;
+      sink.deliver(errorPacket);
+
+      // Mismatch, try next byte
+      offset++;
+      skippedBytes++;
+      continue;
+    }
+
+    // Check if id is reasonable
+    if (wrap->packet.id >= PacketID::NumIDs) {
+      // Report id mismatch
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidID);
+      errorPacket.body.parsingError.invalidID = static_cast<uint32_t>(wrap->packet.id);
+      sink.deliver(errorPacket);
+
+      // Mismatch, try next byte
+      offset++;
+      skippedBytes++;
+      continue;
+    }
+
+    // Check if length is allowed for this id.
+    // Variable-length bodies may be anywhere in a range.
+    if (!packetLengthValid(wrap->packet.id, wrap->packet.length)) {
+      // Report length mismatch
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+      errorPacket.body.parsingError.invalidLength = wrap->packet.length;
+      sink.deliver(errorPacket);
+
+      // Mismatch, try next byte
+      offset++;
+      skippedBytes++;
+      continue;
+    }
+
+    // Check if we have enough bytes of data for this packet
+    uint32_t wrappedLength = wrapperLength + wrap->packet.length;
+    if (len < offset + wrappedLength) {
+      // This is just an informative print, rather than an error.
+      // println("Waiting for remaining bytes of packet. Have %d, need %d.",
+      //   len, offset + wrappedLength);
+
+      // We likely have an incomplete packet.
+      // Need more data to be sure, so done with parsing for now.
+      // Should hopefully receive the rest of the packet on next parsing call.
+      break;
+    }
+
+    // Skip packets the consumer never handles, without checking crc.
+    // Sequence number is adopted so the next packet isn't reported
+    // as out of order.
+    if (!sink.accepts(wrap->packet.id)) {
+      lastSeqNum = wrap->packet.sequenceNum;
+      offset += wrappedLength;
+      continue;
+    }
+
+    // Make sure entire packet is contiguous
+    if (!ringContiguous(ring, size, start, offset, wrappedLength)) {
+      ringCopy(&scratch, ring, size, start, offset, wrappedLength);
+      wrap = &scratch;
+    }
+    const Packet& packet = wrap->packet;
+
+    // Check crc
+    uint32_t calculatedCRC = crcEngine().crc32(reinterpret_cast<const uint8_t*>(&packet), packet.length);
+    if (calculatedCRC != wrap->crc) {
+      // Report crc mismatch
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidCRC);
+      errorPacket.body.parsingError.invalidCRC.provided = wrap->crc;
+      errorPacket.body.parsingError.invalidCRC.calculated = calculatedCRC;
+      sink.deliver(errorPacket);
+
+      // Mismatch, try next byte
+      offset++;
+      skippedBytes++;
+      continue;
+    }
+
+    // We have a valid packet
+    deliverValid(sink, packet, skippedBytes);
+
+    // Adjust offset
+    offset += wrappedLength;
+  }
+
+  // Do a final reporting of skipped bytes
+  if (skippedBytes) {
+    // Report skipped bytes
+    initializePacket(errorPacket, PacketID::ParsingErrorDroppedBytes);
+    errorPacket.body.parsingError.droppedBytes = skippedBytes;
+    sink.deliver(errorPacket);
+  }
+
+  sink.flush();
+
+  return offset;
+}
+
+/*
+ * COBS version of parse().
+ * Resyncing is just a scan for the next delimiter, so each byte is
+ * only looked at once, and a corrupted frame produces a single error.
+ */
+template<typename TSink>
+uint32_t PacketParserCore::parseCobs(TSink& sink, const uint8_t* ring, uint32_t size, uint32_t start, uint32_t len)
+{
+  uint32_t offset = 0;
+  uint32_t skippedBytes = 0;
+
+  while (offset < len) {
+    uint32_t end = ringFindByte(ring, size, start, offset, len, cobsDelimiter);
+    uint32_t encodedLength = end - offset;
+
+    if (end == len) {
+      // No delimiter yet. Wait for the rest of the frame, unless it
+      // is already too long to be valid.
+      if (encodedLength >= sizeof(cobsFrame)) {
+        skippedBytes += encodedLength;
+        offset = len;
+      }
+      break;
+    }
+
+    // Empty frames are allowed, and used as filler
+    if (encodedLength <= 1) {
+      offset = end + 1;
+      continue;
+    }
+
+    if (encodedLength >= sizeof(cobsFrame)) {
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+      errorPacket.body.parsingError.invalidLength = encodedLength;
+      sink.deliver(errorPacket);
+      skippedBytes += encodedLength + 1;
+      offset = end + 1;
+      continue;
+    }
+
+    // Decode into cobsFrame. Frame is copied there first if it wraps.
+    auto frame = ringContiguous(ring, size, start, offset, encodedLength);
+    if (!frame) {
+      ringCopy(cobsFrame, ring, size, start, offset, encodedLength);
+      frame = cobsFrame;
+    }
+    uint32_t frameLength = cobsDecode(cobsFrame, frame, encodedLength);
+
+    if (!deliverFrame(sink, frameLength, skippedBytes)) {
+      skippedBytes += encodedLength + 1;
+    }
+    offset = end + 1;
+  }
+
+  // Do a final reporting of skipped bytes
+  if (skippedBytes) {
+    initializePacket(errorPacket, PacketID::ParsingErrorDroppedBytes);
+    errorPacket.body.parsingError.droppedBytes = skippedBytes;
+    sink.deliver(errorPacket);
+  }
+
+  sink.flush();
+
+  return offset;
+}
+
+/*
+ * Validates a decoded COBS frame of `frameLength` bytes in cobsFrame,
+ * which may be a wrapped packet or compact frame, then delivers it.
+ * Frame length must match exactly, so there's no searching within a frame.
+ */
+template<typename TSink>
+bool PacketParserCore::deliverFrame(TSink& sink, uint32_t frameLength, uint32_t& skippedBytes)
+{
+  const uint8_t* frame = cobsFrame;
+  auto wrap = (const WrappedPacket*)cobsFrame;
+  CompactHeader header;
+  memcpy(&header, frame, compactHeaderLength);
+
+  bool compact = frameLength >= compactHeaderLength && //
+                 header.sync == compactSyncWord &&     //
+                 header.version == compactVersion;
+  bool wrapped = frameLength >= minWrappedPacketLength && wrap->magicStart == startWord;
+
+  // Check if length is reasonable
+  uint32_t packetLength = compact ? minPacketLength + header.bodyLength : wrap->packet.length;
+  uint32_t expectedLength = compact ? compactHeaderLength + header.bodyLength : wrapperLength + packetLength;
+  if ((!compact && !wrapped) || packetLength > sizeof(Packet) || expectedLength != frameLength) {
+    initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+    errorPacket.body.parsingError.invalidLength = frameLength;
+    sink.deliver(errorPacket);
+    return false;
+  }
+
+  // Check if id is reasonable
+  uint32_t id = compact ? header.id : static_cast<uint32_t>(wrap->packet.id);
+  if (id >= static_cast<uint32_t>(PacketID::NumIDs)) {
+    initializePacket(errorPacket, PacketID::ParsingErrorInvalidID);
+    errorPacket.body.parsingError.invalidID = id;
+    sink.deliver(errorPacket);
+    return false;
+  }
+
+  // Check if length is allowed for this id
+  if (!packetLengthValid(static_cast<PacketID>(id), packetLength)) {
+    initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+    errorPacket.body.parsingError.invalidLength = packetLength;
+    sink.deliver(errorPacket);
+    return false;
+  }
+
+  uint32_t sequenceNum = compact ? unwrapSequence(lastSeqNum, header.sequenceNum) : wrap->packet.sequenceNum;
+
+  // Skip packets the consumer never handles, see parse()
+  if (!sink.accepts(static_cast<PacketID>(id))) {
+    lastSeqNum = sequenceNum;
+    return true;
+  }
+
+  // Check crc
+  uint32_t providedCRC = compact ? header.crc : wrap->crc;
+  uint32_t calculatedCRC = compact ? crcEngine().crc32(frame + compactCrcOffset, frameLength - compactCrcOffset)
+                                   : crcEngine().crc32(reinterpret_cast<const uint8_t*>(&wrap->packet), packetLength);
+  if (calculatedCRC != providedCRC) {
+    initializePacket(errorPacket, PacketID::ParsingErrorInvalidCRC);
+    errorPacket.body.parsingError.invalidCRC.provided = providedCRC;
+    errorPacket.body.parsingError.invalidCRC.calculated = calculatedCRC;
+    sink.deliver(errorPacket);
+    return false;
+  }
+
+  if (!compact) {
+    deliverValid(sink, wrap->packet, skippedBytes);
+    return true;
+  }
+
+  // Convert compact frame to packet
+  Packet& packet = scratch.packet;
+  memcpy(&packet.body, frame + compactHeaderLength, header.bodyLength);
+  packet.length = packetLength;
+  packet.sequenceNum = sequenceNum;
+  packet.origin = static_cast<PacketOrigin>(header.origin);
+  packet.id = static_cast<PacketID>(header.id);
+
+  deliverValid(sink, packet, skippedBytes);
+  return true;
+}
+
+template<typename TSink>
+void PacketParserCore::deliverValid(TSink& sink, const Packet& packet, uint32_t& skippedBytes)
+{
+  // First, report how many bytes we had to skip (if any)
+  if (skippedBytes) {
+    // Report skipped bytes
+    initializePacket(errorPacket, PacketID::ParsingErrorDroppedBytes);
+    errorPacket.body.parsingError.droppedBytes = skippedBytes;
+    sink.deliver(errorPacket);
+
+    // Reset skipped bytes
+    skippedBytes = 0;
+  }
+
+  if (packet.id != PacketID::Aggregate) {
+    deliverSequenced(sink, packet);
+    return;
+  }
+
+  // Unpack aggregate.
+  // Inner packets are already covered by the outer crc, so a bad
+  // length or id here means the sender is broken. The rest are dropped.
+  const uint8_t* inner = packet.body.aggregate;
+  const uint8_t* end = reinterpret_cast<const uint8_t*>(&packet) + packet.length;
+  while (inner + minPacketLength <= end) {
+    const Packet& innerPacket = *reinterpret_cast<const Packet*>(inner);
+
+    if (innerPacket.id >= PacketID::NumIDs || innerPacket.id == PacketID::Aggregate) {
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidID);
+      errorPacket.body.parsingError.invalidID = static_cast<uint32_t>(innerPacket.id);
+      sink.deliver(errorPacket);
+      return;
+    }
+
+    if (!packetLengthValid(innerPacket.id, innerPacket.length) || inner + innerPacket.length > end) {
+      initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
+      errorPacket.body.parsingError.invalidLength = innerPacket.length;
+      sink.deliver(errorPacket);
+      return;
+    }
+
+    // Same filtering as for standalone packets
+    if (sink.accepts(innerPacket.id)) {
+      deliverSequenced(sink, innerPacket);
+    } else {
+      lastSeqNum = innerPacket.sequenceNum;
+    }
+
+    inner += alignedPacketLength(innerPacket);
+  }
+}
+
+template<typename TSink>
+void PacketParserCore::deliverSequenced(TSink& sink, const Packet& packet)
+{
+  // Acks are unsequenced, and arq links do their own ordering
+  if (packet.id == PacketID::ArqAck || !checkSequence) {
+    sink.deliver(packet);
+    return;
+  }
+
+  // Check if sequence number is out of order
+  if (packet.sequenceNum != lastSeqNum + 1) {
+    // Report unexpected sequence number
+    initializePacket(errorPacket, PacketID::ParsingErrorInvalidSequence);
+    errorPacket.body.parsingError.invalidSequence.provided = packet.sequenceNum;
+    errorPacket.body.parsingError.invalidSequence.expected = lastSeqNum + 1;
+    sink.deliver(errorPacket);
+  }
+
+  lastSeqNum = packet.sequenceNum;
+
+  // Send valid packet to callback
+  sink.deliver(packet);
+}
+
 /*
  * Tracks latest sequence number to apply to outgoing packets.
  * Call `rewrap` to apply next number to packet.
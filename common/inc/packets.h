@@ -2,7 +2,7 @@
 
 #include "basic.h"
 #include "modbus_common.h"
-#include <stddef.h> // size_t
+#include <stddef.h> // size_t, offsetof
 #include <stdint.h>
 
 const uint32_t startWord = 0xFEEDABBE;
@@ -21,6 +21,8 @@ enum class PacketID : uint32_t
   VfdStatus,
   ModbusError,
   DummyPacket,
+  ArqAck,
+  Aggregate,
   NumIDs,
 };
 
@@ -40,12 +42,18 @@ enum class PacketOrigin : uint32_t
 
 const uint32_t maxLogMsgLength = 256;
 
+// Variable length. Packet only includes the first `length` characters of msg,
+// which are not null-terminated.
 struct LogMessage
 {
   uint32_t length;
   char msg[maxLogMsgLength];
 };
 
+// Set in LogMessage::length when msg holds binary log records
+// rather than text. See binary_log.h.
+const uint32_t binaryLogFlag = 1u << 31;
+
 // ----------
 
 union ParsingError
@@ -127,13 +135,22 @@ struct __attribute__((__packed__)) VfdStatus
   uint8_t nodeAddress;
 };
 
-// Dummy packet for testing
+// Dummy packet for testing.
+// Variable length. Payload size is implied by packet length.
 struct DummyPacket
 {
   uint32_t outId;
   uint8_t payload[64];
 };
 
+// Acknowledges packets for reliable delivery. See arq.h.
+// Acks are unsequenced, and never acked or resent themselves.
+struct ArqAck
+{
+  uint32_t nextSeq;   // All packets before this were received
+  uint32_t selective; // Bit i is set if packet nextSeq + 1 + i was received
+};
+
 enum class ModbusErrorID : uint16_t
 {
   BadEchoNotEnoughBytes,
@@ -180,13 +197,17 @@ struct Packet
     VfdStatus vfdStatus;
     ModbusError modbusError;
     DummyPacket dummy;
+    ArqAck arqAck;
+    // Several inner packets, back-to-back, each padded to a 4-byte boundary.
+    // See appendToAggregate().
+    uint8_t aggregate[sizeof(LogMessage)];
   } body;
   // Would be nicer to omit 'body' so this could be an anonymous union
   // which makes it a bit more convenient to use, but then can't calculate
   // minimum packet sizes.
 };
 
-// Todo - reduce field sizes and convert to architecture-independent packed struct
+// See CompactHeader below for a smaller, architecture-independent alternative
 struct WrappedPacket
 {
   uint32_t magicStart; // Helps with faster re-syncing than re-calculating full crc at each new offset.
@@ -201,7 +222,8 @@ const uint32_t wrapperLength = sizeof(WrappedPacket) - sizeof(WrappedPacket::pac
 
 // --------
 
-// Size of just the unique packet body
+// Size of just the unique packet body.
+// This is the maximum size for variable-length bodies.
 constexpr uint32_t packetBodySizeFromID(PacketID id)
 {
   switch (id) {
@@ -243,6 +265,12 @@ constexpr uint32_t packetBodySizeFromID(PacketID id)
     case PacketID::DummyPacket: {
       return sizeof(Packet::body.dummy);
     }
+    case PacketID::ArqAck: {
+      return sizeof(Packet::body.arqAck);
+    }
+    case PacketID::Aggregate: {
+      return sizeof(Packet::body.aggregate); // maximum size
+    }
     case PacketID::NumIDs: // This should not be called
     {
       return -1;
@@ -253,13 +281,83 @@ constexpr uint32_t packetBodySizeFromID(PacketID id)
   return -1;
 }
 
-// Size of packet body plus common packet field, but excluding wrapper fields
+// Smallest body size. Only differs from above for variable-length bodies.
+constexpr uint32_t minPacketBodySizeFromID(PacketID id)
+{
+  switch (id) {
+    case PacketID::LogMessage: {
+      return offsetof(LogMessage, msg); // empty message
+    }
+    case PacketID::DummyPacket: {
+      return offsetof(DummyPacket, payload); // empty payload
+    }
+    case PacketID::Aggregate: {
+      return 0; // no inner packets
+    }
+    default: {
+      return packetBodySizeFromID(id);
+    }
+  }
+}
+
+// Size of packet body plus common packet field, but excluding wrapper fields.
+// This is the maximum size for variable-length bodies.
 constexpr uint32_t packetSizeFromID(PacketID id)
 {
   return minPacketLength + packetBodySizeFromID(id);
 }
 
-// Size of the entire wrapped packet
+// Smallest packet size, excluding wrapper fields
+constexpr uint32_t minPacketSizeFromID(PacketID id)
+{
+  return minPacketLength + minPacketBodySizeFromID(id);
+}
+
+// Checks if packet length field is in the allowed range for this ID
+constexpr bool packetLengthValid(PacketID id, uint32_t length)
+{
+  return id < PacketID::NumIDs &&             //
+         length >= minPacketSizeFromID(id) && //
+         length <= packetSizeFromID(id);
+}
+
+// Outgoing traffic classes, in priority order.
+// See PacketOutput for how these are drained.
+enum class PacketLane : uint32_t
+{
+  Control,   // small and latency-sensitive, such as errors and commands
+  Telemetry, // periodic status
+  Bulk,      // logs and anything large
+  NumLanes,
+};
+
+const uint32_t numPacketLanes = static_cast<uint32_t>(PacketLane::NumLanes);
+
+constexpr PacketLane packetLaneFromID(PacketID id)
+{
+  switch (id) {
+    case PacketID::Heartbeat:
+    case PacketID::ParsingErrorInvalidLength:
+    case PacketID::ParsingErrorInvalidCRC:
+    case PacketID::ParsingErrorInvalidID:
+    case PacketID::ParsingErrorInvalidSequence:
+    case PacketID::ParsingErrorDroppedBytes:
+    case PacketID::WatchdogTimeout:
+    case PacketID::VfdSetFrequency:
+    case PacketID::ModbusError:
+    case PacketID::ArqAck: {
+      return PacketLane::Control;
+    }
+    case PacketID::VfdStatus: {
+      return PacketLane::Telemetry;
+    }
+    default: {
+      return PacketLane::Bulk;
+    }
+  }
+}
+
+// Size of the entire wrapped packet. Maximum for variable-length bodies.
 constexpr uint32_t wrappedPacketSizeFromID(PacketID id)
 {
   return minWrappedPacketLength + packetBodySizeFromID(id);
@@ -271,6 +369,51 @@ inline uint32_t wrappedPacketSize(WrappedPacket& wrap)
   return wrapperLength + wrap.packet.length;
 }
 
+// -------- Compact framing (v2) --------
+
+/*
+ * Smaller wire format for the same packets.
+ * 13 byte header, rather than 24 bytes of wrapper and packet header.
+ *
+ *   sync | version | crc | id | origin | bodyLength | sequenceNum | body
+ *
+ * Header fields are packed and little-endian, so layout doesn't depend on
+ * compiler padding. Body is sent as-is, trimmed to the packet length.
+ *
+ * Sync word is the first half of startWord, so a single scan finds both
+ * formats, and the version byte tells them apart (wrapped packets have 0xED there).
+ * Crc covers everything from id to the end of the body.
+ * Only the low 16 bits of sequence number are sent. The parser extends these
+ * back to 32 bits based on the last sequence number received.
+ */
+const uint16_t compactSyncWord = startWord & 0xFFFF;
+const uint8_t compactVersion = 2;
+
+struct __attribute__((__packed__)) CompactHeader
+{
+  uint16_t sync;   // compactSyncWord
+  uint8_t version; // compactVersion
+  uint32_t crc;
+  uint8_t id;     // PacketID
+  uint8_t origin; // PacketOrigin
+  uint16_t bodyLength;
+  uint16_t sequenceNum; // Low 16 bits
+};
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "Compact header fields are little-endian");
+static_assert(((startWord >> 16) & 0xFF) != compactVersion, "Version byte must differ from startWord");
+static_assert(static_cast<uint32_t>(PacketID::NumIDs) <= 0xFF, "PacketID must fit in compact header");
+
+const uint32_t compactHeaderLength = sizeof(CompactHeader);
+const uint32_t compactCrcOffset = offsetof(CompactHeader, id);
+const uint32_t maxCompactFrameLength = compactHeaderLength + sizeof(Packet::body);
+
+// Size of the entire compact frame. Maximum for variable-length bodies.
+constexpr uint32_t compactFrameSizeFromID(PacketID id)
+{
+  return compactHeaderLength + packetBodySizeFromID(id);
+}
+
 constexpr const char* packetIdToString(PacketID id)
 {
   switch (id) {
@@ -286,6 +429,8 @@ constexpr const char* packetIdToString(PacketID id)
     ENUM_STRING(PacketID, VfdStatus)
     ENUM_STRING(PacketID, ModbusError)
     ENUM_STRING(PacketID, DummyPacket)
+    ENUM_STRING(PacketID, ArqAck)
+    ENUM_STRING(PacketID, Aggregate)
     ENUM_STRING(PacketID, NumIDs)
   }
   return "InvalidID";
@@ -306,6 +451,17 @@ constexpr const char* packetOriginToString(PacketOrigin origin)
   return "InvalidOrigin";
 }
 
+constexpr const char* packetLaneToString(PacketLane lane)
+{
+  switch (lane) {
+    ENUM_STRING(PacketLane, Control)
+    ENUM_STRING(PacketLane, Telemetry)
+    ENUM_STRING(PacketLane, Bulk)
+    ENUM_STRING(PacketLane, NumLanes)
+  }
+  return "InvalidLane";
+}
+
 constexpr const char* modbusErrorIdToString(ModbusErrorID id)
 {
   switch (id) {
@@ -2,6 +2,101 @@
 
 #include <stdint.h>
 
+/*
+ * Selects which table-driven CRC-32 variant is used by crc32().
+ * Larger tables are faster, but cost more flash:
+ *   1 - byte lookup,  1 KB table
+ *   4 - slice-by-4,   4 KB table
+ *   8 - slice-by-8,   8 KB table
+ * Can be overridden from the build flags, e.g. -DCRC32_SLICES=8
+ * Tables of unused variants are discarded by the linker (--gc-sections).
+ */
+#ifndef CRC32_SLICES
+#define CRC32_SLICES 4
+#endif
+
+/*
+ * Same as above, but for crc16(). Tables are half the size:
+ *   1 - byte lookup,  512 B table
+ *   4 - slice-by-4,   2 KB table
+ */
+#ifndef CRC16_SLICES
+#define CRC16_SLICES 4
+#endif
+
+/*
+ * x86-64 hosts can also use carry-less multiply (PCLMULQDQ) folding for CRC-32.
+ * This is selected at runtime if the CPU supports it, and is used automatically
+ * by crc32() and crc32Update() for larger buffers.
+ * Define CRC32_NO_PCLMUL to disable.
+ */
+#if defined(__x86_64__) && !defined(CRC32_NO_PCLMUL)
+#define CRC32_PCLMUL
+#endif
+
 uint16_t crc16(const void* data, uint32_t length);
 
 uint32_t crc32(const void* data, uint32_t length);
+
+// Initial CRC register values
+const uint16_t crc16Init = 0xFFFF;
+const uint32_t crc32Init = 0xFFFFFFFF;
+
+// Lower-level functions for continuing a CRC over another chunk of data.
+// These take and return the raw CRC register.
+// CRC-16/Modbus has no xorout step, but CRC-32 must be inverted when done.
+// The streaming classes below are usually more convenient.
+uint16_t crc16Update(uint16_t reg, const void* data, uint32_t length);
+uint32_t crc32Update(uint32_t reg, const void* data, uint32_t length);
+
+/*
+ * Streaming CRC calculation, for when data arrives in chunks.
+ * Chunks may be split at any point.
+ * Result is identical to calling crc16() or crc32() once on all the data.
+ *
+ *   Crc32Stream crc;
+ *   crc.update(header, headerLen);
+ *   crc.update(body, bodyLen);
+ *   uint32_t result = crc.finalize();
+ *
+ * Call init() to reuse an instance for a new calculation.
+ */
+class Crc16Stream
+{
+public:
+  void init() { reg = crc16Init; }
+  void update(const void* data, uint32_t length);
+  uint16_t finalize() const { return reg; }
+
+private:
+  uint16_t reg = crc16Init;
+};
+
+class Crc32Stream
+{
+public:
+  void init() { reg = crc32Init; }
+  void update(const void* data, uint32_t length);
+  uint32_t finalize() const { return ~reg; }
+
+private:
+  uint32_t reg = crc32Init;
+};
+
+// Individual CRC-32 variants.
+// These all return identical results, and are exposed for testing and benchmarking.
+// Prefer calling crc32(), which uses the variant selected by CRC32_SLICES.
+uint32_t crc32Bitwise(const void* data, uint32_t length); // Reference version, no table
+uint32_t crc32Bytewise(const void* data, uint32_t length);
+uint32_t crc32Slice4(const void* data, uint32_t length);
+uint32_t crc32Slice8(const void* data, uint32_t length);
+#if defined(CRC32_PCLMUL)
+// Falls back to table version if CPU lacks PCLMULQDQ support, or for small buffers
+uint32_t crc32Pclmul(const void* data, uint32_t length);
+bool crc32PclmulSupported();
+#endif
+
+// Individual CRC-16 variants. Prefer crc16().
+uint16_t crc16Bitwise(const void* data, uint32_t length); // Reference version, no table
+uint16_t crc16Bytewise(const void* data, uint32_t length);
+uint16_t crc16Slice4(const void* data, uint32_t length);
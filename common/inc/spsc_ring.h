@@ -0,0 +1,115 @@
+/*
+ * Lock-free ring buffer of bytes, for exactly one producer
+ * and one consumer.
+ *
+ * The producer only advances `head`, and the consumer only
+ * advances `tail`, so neither side needs a critical section.
+ * Either side may run in an ISR.
+ *
+ * Indices run freely and wrap at 2^32, so size must be a power
+ * of two. All TSize bytes are usable.
+ *
+ * write() and read() also report when the other side may be
+ * waiting, so it only needs to be woken on those transitions:
+ *  - wasEmpty: consumer had read everything before this write
+ *  - wasFull: producer had filled the ring before this read
+ * These may be reported when the other side isn't actually
+ * waiting yet, but never missed when it is. This relies on each
+ * side publishing its own index before loading the other's, so
+ * those accesses are sequentially consistent.
+ *
+ * This doesn't depend on the RTOS, so it's also used by host
+ * tests. See SpscStreamBuffer in static_rtos.h for a blocking
+ * version with Readable and Writable interfaces.
+ */
+
+#pragma once
+
+#include "basic.h"
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+template<size_t TSize = 1024>
+class SpscRing
+{
+  static_assert(TSize && !(TSize & (TSize - 1)), "Ring size must be a power of two");
+  static_assert(TSize <= (1u << 31), "Ring size must fit free-running indices");
+
+public:
+  // ------- Producer side -------
+
+  // Bytes that may be written without overwriting unread data
+  size_t writeSpace() const //
+  {
+    return TSize - (head.load(std::memory_order_relaxed) - tail.load());
+  }
+
+  // Copies in as many of len bytes as fit.
+  // Returns number of bytes written.
+  size_t write(const void* buf, size_t len, bool& wasEmpty)
+  {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    size_t n = min<size_t>(len, TSize - (h - tail.load()));
+    wasEmpty = false;
+    if (!n) {
+      return 0;
+    }
+
+    size_t offset = h & (TSize - 1);
+    size_t first = min<size_t>(n, TSize - offset);
+    memcpy(storage + offset, buf, first);
+    memcpy(storage, (const uint8_t*)buf + first, n - first);
+
+    head.store(h + n);
+    wasEmpty = tail.load() == h;
+    return n;
+  }
+
+  size_t write(const void* buf, size_t len)
+  {
+    bool wasEmpty;
+    return write(buf, len, wasEmpty);
+  }
+
+  // ------- Consumer side -------
+
+  // Bytes waiting to be read
+  size_t readAvailable() const //
+  {
+    return head.load() - tail.load(std::memory_order_relaxed);
+  }
+
+  // Copies out up to len bytes.
+  // Returns number of bytes read.
+  size_t read(void* buf, size_t len, bool& wasFull)
+  {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    size_t n = min<size_t>(len, head.load() - t);
+    wasFull = false;
+    if (!n) {
+      return 0;
+    }
+
+    size_t offset = t & (TSize - 1);
+    size_t first = min<size_t>(n, TSize - offset);
+    memcpy(buf, storage + offset, first);
+    memcpy((uint8_t*)buf + first, storage, n - first);
+
+    tail.store(t + n);
+    wasFull = head.load() - t == TSize;
+    return n;
+  }
+
+  size_t read(void* buf, size_t len)
+  {
+    bool wasFull;
+    return read(buf, len, wasFull);
+  }
+
+private:
+  std::atomic<uint32_t> head{ 0 }; // next byte to write. Only changed by producer.
+  std::atomic<uint32_t> tail{ 0 }; // next byte to read. Only changed by consumer.
+  uint8_t storage[TSize];
+};
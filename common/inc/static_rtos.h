@@ -15,6 +15,7 @@
 #include "message_buffer.h"
 #include "queue.h"
 #include "semphr.h"
+#include "spsc_ring.h"
 #include "stream_buffer.h"
 #include "task.h"
 
@@ -151,19 +152,31 @@ private:
 
 // ------- Chapter 8: Stream Buffer -----------
 
+/*
+ * Trigger level is how many bytes must be available before a blocked
+ * reader is woken. The default of 1 wakes it as soon as anything arrives.
+ * Higher levels mean fewer wakeups, but a read then waits for that many
+ * bytes, or until its ticks expire, before returning what's there.
+ * So the ticks passed to read() bound the added latency.
+ */
 template<size_t TSize = 1024>
 class StaticStreamBuffer
   : public Readable
   , public Writable
 {
 public:
-  StaticStreamBuffer()
-    : handle{ xStreamBufferCreateStatic(TSize,
-                                        1, // trigger level. Unblock as soon as any bytes are available
-                                        mbStorage,
-                                        &staticMb) }
+  StaticStreamBuffer(size_t triggerLevel = 1)
+    : handle{ xStreamBufferCreateStatic(TSize, triggerLevel, mbStorage, &staticMb) }
   {} // No body in constructor
 
+  // May be changed at runtime to tune wakeups vs latency
+  void setTriggerLevel(size_t triggerLevel)
+  {
+    if (xStreamBufferSetTriggerLevel(handle, triggerLevel) != pdPASS) {
+      critical(); // larger than buffer
+    }
+  }
+
   size_t write(const void* buf, size_t len, TickType_t ticks) //
   {
     return xStreamBufferSend(handle, buf, len, ticks);
@@ -181,18 +194,117 @@ private:
   StaticStreamBuffer_t staticMb; // static storage for bookkeeping data
 };
 
-// ------- Chapter 9: Message Buffer -----------
-
+/*
+ * Alternative to StaticStreamBuffer for exactly one writer and one reader,
+ * such as ISR to task. Wraps the lock-free SpscRing, so there are no
+ * critical sections, and the other side is only notified when it may be
+ * waiting.
+ *
+ * Blocking uses the direct task notification of the reader and writer
+ * tasks. Stray notifications from elsewhere just cause a recheck, but
+ * these tasks shouldn't rely on notification counts for anything else.
+ *
+ * Size must be a power of two.
+ */
 template<size_t TSize = 1024>
-class StaticMessageBuffer
+class SpscStreamBuffer
   : public Readable
   , public Writable
 {
 public:
-  StaticMessageBuffer()
-    : handle{ xMessageBufferCreateStatic(TSize, mbStorage, &staticMb) }
-  {} // No body in constructor
+  // Blocks until all len bytes are written, or ticks expire.
+  // Returns how many bytes were written.
+  size_t write(const void* buf, size_t len, TickType_t ticks)
+  {
+    if (ticks) {
+      writer = xTaskGetCurrentTaskHandle();
+    }
+
+    TimeOut_t timeOut;
+    vTaskSetTimeOutState(&timeOut);
+
+    size_t written = 0;
+    while (1) {
+      bool wasEmpty;
+      written += ring.write((const uint8_t*)buf + written, len - written, wasEmpty);
+      if (wasEmpty) {
+        notify(reader);
+      }
+      if (written == len || xTaskCheckForTimeOut(&timeOut, &ticks)) {
+        return written;
+      }
+      // Wait for reader to make space
+      ulTaskNotifyTake(pdTRUE, ticks);
+    }
+  }
+
+  // Blocks until some bytes are available, or ticks expire.
+  // Returns how many bytes were read, up to len.
+  size_t read(void* buf, size_t len, TickType_t ticks)
+  {
+    if (ticks) {
+      reader = xTaskGetCurrentTaskHandle();
+    }
+
+    TimeOut_t timeOut;
+    vTaskSetTimeOutState(&timeOut);
+
+    while (1) {
+      bool wasFull;
+      size_t numRead = ring.read(buf, len, wasFull);
+      if (wasFull) {
+        notify(writer);
+      }
+      if (numRead || xTaskCheckForTimeOut(&timeOut, &ticks)) {
+        return numRead;
+      }
+      // Wait for writer to add data
+      ulTaskNotifyTake(pdTRUE, ticks);
+    }
+  }
+
+  // Non-blocking write for ISRs.
+  // Returns how many bytes were written.
+  size_t writeFromIsr(const void* buf, size_t len)
+  {
+    bool wasEmpty;
+    size_t written = ring.write(buf, len, wasEmpty);
+    TaskHandle_t task = reader;
+    if (wasEmpty && task) {
+      BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+      vTaskNotifyGiveFromISR(task, &xHigherPriorityTaskWoken);
+      portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+    }
+    return written;
+  }
 
+  size_t bytesAvailable() const { return ring.readAvailable(); }
+
+private:
+  static void notify(TaskHandle_t task)
+  {
+    if (task) {
+      xTaskNotifyGive(task);
+    }
+  }
+
+  SpscRing<TSize> ring;
+
+  // Tasks to wake. Each is recorded before its first blocking call,
+  // so it's visible to the other side before any wait.
+  std::atomic<TaskHandle_t> reader{ nullptr };
+  std::atomic<TaskHandle_t> writer{ nullptr };
+};
+
+// ------- Chapter 9: Message Buffer -----------
+
+// Size-independent part of StaticMessageBuffer, so that functions
+// and classes can accept message buffers of any size.
+class MessageBuffer
+  : public Readable
+  , public Writable
+{
+public:
   size_t write(const void* buf, size_t len, TickType_t ticks) //
   {
     return xMessageBufferSend(handle, buf, len, ticks);
@@ -218,8 +330,29 @@ public:
     return xMessageBufferNextLengthBytes(handle);
   }
 
+  // Whether a message of len bytes can be written without blocking.
+  // Each message also stores its length.
+  bool hasSpaceFor(size_t len) //
+  {
+    return xMessageBufferSpacesAvailable(handle) >= len + sizeof(size_t);
+  }
+
   const MessageBufferHandle_t handle; // the message buffer handle
 
+protected:
+  MessageBuffer(MessageBufferHandle_t handle)
+    : handle{ handle }
+  {}
+};
+
+template<size_t TSize = 1024>
+class StaticMessageBuffer : public MessageBuffer
+{
+public:
+  StaticMessageBuffer()
+    : MessageBuffer{ xMessageBufferCreateStatic(TSize, mbStorage, &staticMb) }
+  {} // No body in constructor
+
 private:
   uint8_t mbStorage[TSize + 1];   // storage for message buffer, must contain an additional byte
   StaticMessageBuffer_t staticMb; // static storage for bookkeeping data
@@ -13,8 +13,10 @@ to this wrapper.
 
 #pragma once
 
+#include "cobs.h"
 #include "interfaces.h"
 #include "packet_logger.h"
+#include "packet_pool.h"
 #include "watchdog_task.h"
 
 struct TaskUtilitiesArg
@@ -128,35 +130,64 @@ struct TaskUtilities
   // Note that read() on MessageBuffer would otherwise just return a single message,
   // and read() on a StreamBuffer always attempts to fill the provided receipt buffer
   // with as many bytes as possible.
-  template<size_t TSize>
-  size_t readAll(StaticMessageBuffer<TSize>& msgbuf, void* buf, size_t bufLen)
+  size_t readAll(MessageBuffer& msgbuf, void* buf, size_t bufLen)
   {
-
     // Wait until new data is available.
     // This just grabs the first message.
     size_t consumedLen = read(msgbuf, buf, bufLen);
 
     // Keep attempting to pack more messages into buffer
+    return appendAllFramed(msgbuf, buf, consumedLen, bufLen, LinkFraming::Raw);
+  }
+
+  // Same as readAll(), but each message becomes a separate frame
+  // according to `framing`.
+  // COBS frames are encoded in place, so buf can be a DMA buffer: each
+  // message is read past the worst-case encoding overhead, then encoded
+  // back toward the start of its slot.
+  size_t readAllFramed(MessageBuffer& msgbuf, void* buf, size_t bufLen, LinkFraming framing)
+  {
+    if (framing == LinkFraming::Raw) {
+      return readAll(msgbuf, buf, bufLen);
+    }
+
+    uint8_t* out = (uint8_t*)buf;
+
+    // Wait until new data is available.
+    // This just grabs the first message.
+    size_t offset = cobsOverhead(bufLen);
+    size_t consumedLen = cobsEncode(out, out + offset, read(msgbuf, out + offset, bufLen - offset));
+
+    // Keep attempting to pack more frames into buffer
+    return appendAllFramed(msgbuf, buf, consumedLen, bufLen, framing);
+  }
+
+  // Non-blocking part of readAllFramed().
+  // Packs any waiting messages after the len bytes already in buf.
+  // Returns new length of buf contents.
+  size_t appendAllFramed(MessageBuffer& msgbuf, void* buf, size_t len, size_t bufLen, LinkFraming framing)
+  {
+    bool cobs = framing == LinkFraming::Cobs;
+
     while (1) {
       // Check for additional messages to read
       size_t nextAvailableLen = msgbuf.nextLengthBytes();
-      // If there's another message to read and we have space for it
-      if (nextAvailableLen && consumedLen + nextAvailableLen <= bufLen) {
-        // Grab next message with no timeout
-        size_t nextReceivedLen = msgbuf.read((uint8_t*)buf + consumedLen, bufLen - consumedLen, 0);
-        // Sanity check that we read the expected number of bytes
-        if (nextReceivedLen != nextAvailableLen) {
-          critical();
-        }
-        // Note consumed bytes
-        consumedLen += nextReceivedLen;
-      } else {
-        // Either no more messages, or no more space
-        break;
+      size_t nextFramedLen = cobs ? cobsMaxFrameLength(nextAvailableLen) : nextAvailableLen;
+      // Either no more messages, or no more space
+      if (!nextAvailableLen || len + nextFramedLen > bufLen) {
+        return len;
       }
-    }
 
-    return consumedLen;
+      uint8_t* dst = (uint8_t*)buf + len;
+      uint8_t* src = cobs ? dst + cobsOverhead(nextAvailableLen) : dst;
+      // Grab next message with no timeout
+      size_t nextReceivedLen = msgbuf.read(src, nextAvailableLen, 0);
+      // Sanity check that we read the expected number of bytes
+      if (nextReceivedLen != nextAvailableLen) {
+        critical();
+      }
+      len += cobs ? cobsEncode(dst, src, nextReceivedLen) : nextReceivedLen;
+    }
   }
 
   // ------- ulTaskNotifyTake -------
@@ -176,6 +207,63 @@ struct TaskUtilities
     return retval;
   }
 
+  // ------- xTaskNotifyWait -------
+
+  // Blocks forever while waiting for any notification bits.
+  // Returns and clears all bits that were set.
+  // Calls watchdogKick after each ticks delay.
+  uint32_t taskNotifyWait()
+  {
+    uint32_t bits = 0;
+    while (xTaskNotifyWait(0, 0xFFFFFFFF, &bits, suggestedTimeoutTicks) != pdTRUE) {
+      watchdogKick();
+      // Nothing happening is perfectly normal
+      benignTimeout();
+    }
+    watchdogKick();
+    return bits;
+  }
+
+  // ------- Packet Pool Wrappers -------
+
+  // Watchdog-friendly blocking allocation from pool
+  PacketHandle alloc(PacketPool& pool)
+  {
+    PacketHandle handle;
+    while (!(handle = pool.alloc(suggestedTimeoutTicks))) {
+      watchdogKick();
+      // An empty pool means packets are backing up somewhere
+      timeout();
+    }
+    watchdogKick();
+    return handle;
+  }
+
+  // Watchdog-friendly blocking handle write.
+  // Passes caller's handle to target.
+  void writeHandle(PacketWritable& target, PacketHandle handle)
+  {
+    while (!target.writeHandle(handle, suggestedTimeoutTicks)) {
+      watchdogKick();
+      timeout();
+    }
+    watchdogKick();
+  }
+
+  // Watchdog-friendly blocking handle read.
+  // Caller must release the returned handle or pass it on.
+  PacketHandle readHandle(PacketReadable& target)
+  {
+    PacketHandle handle;
+    while (!target.readHandle(handle, suggestedTimeoutTicks)) {
+      watchdogKick();
+      // No new packets is perfectly normal
+      benignTimeout();
+    }
+    watchdogKick();
+    return handle;
+  }
+
   // -------
 
   LogMsg msg;
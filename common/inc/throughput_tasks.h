@@ -54,9 +54,8 @@ private:
   TaskUtilities util;
   StaticTask<Consumer> task;
 
-  uint8_t buf[maxWrappedPacketLength * 2]; // storage for parsing
-  size_t len = 0;                          // number of bytes in buffer
-  uint32_t pktCt = 0;                      // number of good packets received
+  StaticParserRing<maxWrappedPacketLength * 2> ring; // storage for parsing
+  uint32_t pktCt = 0;                                // number of good packets received
 };
 
 class ProducerUsb
@@ -98,3 +97,56 @@ private:
   uint32_t byteCt = 0; // how many bytes we got so far
   LogMsg hexMsg;       // for hex logging
 };
+
+/*
+ * Producer and Consumer pair for measuring raw throughput of a
+ * byte stream between two tasks, such as StaticStreamBuffer or
+ * SpscStreamBuffer. Data is a counting sequence written in small
+ * chunks, which stresses per-call overhead.
+ * The consumer checks the sequence and periodically logs throughput.
+ */
+class StreamProducer
+{
+public:
+  StreamProducer(const char* name,                       // task name
+                 Writable& target,                       // where to send data
+                 TaskUtilitiesArg& utilArg,              // common utilities
+                 UBaseType_t priority = osPriorityNormal // task priority
+  );
+
+  // rtos looping function
+  void func();
+
+  static constexpr size_t chunkLen = 32; // bytes per write
+
+private:
+  static void funcWrapper(StreamProducer* p) { p->func(); }
+  Writable& target;
+  TaskUtilities util;
+  StaticTask<StreamProducer> task;
+  uint8_t chunk[chunkLen];
+};
+
+class StreamConsumer
+{
+public:
+  StreamConsumer(const char* name,                       // task name
+                 Readable& target,                       // where to get data
+                 TaskUtilitiesArg& utilArg,              // common utilities
+                 UBaseType_t priority = osPriorityNormal // task priority
+  );
+
+  // rtos looping function
+  void func();
+
+  static constexpr uint32_t reportBytes = 1 << 20; // log after this many bytes
+
+private:
+  static void funcWrapper(StreamConsumer* p) { p->func(); }
+  Readable& target;
+  TaskUtilities util;
+  StaticTask<StreamConsumer> task;
+  uint8_t buf[256];
+  uint8_t expected = 0;    // next byte in counting sequence
+  uint32_t mismatches = 0; // bytes not matching sequence
+};
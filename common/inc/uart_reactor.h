@@ -0,0 +1,54 @@
+/*
+ * Drives tx for several UartPorts from a single task, as an
+ * alternative to a StaticUartTasks tx task per port.
+ *
+ * Each port gets one bit in the reactor task's notification value.
+ * Writes to the port and its tx-complete interrupt set that bit,
+ * and the reactor then services every port whose bit was set.
+ * Readers are unaffected, since rx is already read straight from
+ * each port's DMA buffer by whichever task calls read().
+ *
+ * This saves a task stack, TCB, and watchdog slot per port, plus
+ * the context switches between tx tasks when several ports are
+ * busy. The tradeoff is that a busy port's framing work delays
+ * servicing the others, so give the reactor a priority at least
+ * as high as the tx tasks it replaces.
+ *
+ * Usage:
+ *   static UartReactor reactor("uartReactor", utilities);
+ *   static StaticUartPort<> uart4Port("uart4", uartInfo4, utilities);
+ *   reactor.add(uart4Port);
+ * All ports must be added before the scheduler starts.
+ */
+
+#pragma once
+
+#include "static_rtos.h"
+#include "task_utilities.h"
+#include "uart_tasks.h"
+
+// One notification bit per port
+const uint32_t uartReactorMaxPorts = 32;
+
+class UartReactor
+{
+public:
+  UartReactor(const char* name,
+              TaskUtilitiesArg& utilArg,
+              UBaseType_t priority = osPriorityAboveNormal // same as StaticUartTasks tx tasks
+  );
+
+  // Hands port's tx over to this reactor
+  void add(UartPort& port);
+
+  // Looping task function
+  // Needs to be public for C-wrapper compatibility
+  void func();
+
+private:
+  StaticTask<UartReactor> task;
+  TaskUtilities util;
+
+  UartPort* ports[uartReactorMaxPorts];
+  uint32_t numPorts = 0;
+};
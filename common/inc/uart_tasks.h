@@ -3,7 +3,9 @@
 Wrapper for a UART instance.
 Provides read() and write() interfaces.
 Handles DMA coordination.
-Statically allocates two tasks and two stream buffers.
+Statically allocates a tx message buffer, DMA buffers, and
+either its own tx task or a slot in a shared UartReactor.
+Buffer sizes are chosen per instance via template parameters.
 
 HW config checklist:
 
@@ -44,8 +46,10 @@ In stm32f4xx_it.h:
 
 #pragma once
 
+#include "cobs.h"
 #include "interfaces.h"
 #include "isr_callbacks.h"
+#include "packets.h"
 #include "static_rtos.h"
 #include "stm32f4xx_ll_gpio.h"
 #include "task_utilities.h"
@@ -53,7 +57,7 @@ In stm32f4xx_it.h:
 
 /*
  * Pass one of these HalfDuplexCallbacks objects to
- * UartTasks constructor to enable half-duplex mode.
+ * StaticUartTasks or StaticUartPort constructor to enable half-duplex mode.
  * Sets pin high for transmit, and low for receive.
  */
 struct HalfDuplexCallbacks
@@ -90,80 +94,280 @@ HalfDuplexCallbacks uart7halfDuplexCallbacks
 */
 
 /*
- * Note that it's possible to improve efficiency by creating
- * a custom StreamBuffer that's more tightly coupled with
- * DMA and could share memory directly.
- * We'll cross that optimization bridge later if necessary.
+ * Rx wakeup coalescing for UartPort.
+ * The reader is woken once minBytes are waiting, or maxDelayUs after
+ * the first of those bytes arrived, whichever comes first.
+ * Fewer wakeups per packet, at the cost of up to maxDelayUs latency.
+ * Delay resolution is one RTOS tick, rounded up.
+ * minBytes is capped at half of the rx DMA buffer, since that's
+ * how often DMA interrupts check on it.
+ * Defaults wake the reader on every rx interrupt.
  */
-class UartTasks
+struct UartRxCoalescing
+{
+  size_t minBytes = 1;
+  uint32_t maxDelayUs = 0;
+};
+
+// Smallest tx or rx buffer size.
+// Leaves room to fill one half while the other is in use.
+const size_t uartMinBufSize = 2 * maxWrappedPacketLength;
+
+// Buffers used by a UartPort, which may be of any size
+struct UartStorage
+{
+  MessageBuffer& txMsgBuf;
+  uint8_t* txDmaBufs[2];
+  size_t txSize; // of each tx DMA buffer
+  uint8_t* rxDmaBuf;
+  size_t rxSize;
+};
+
+/*
+ * Static storage for StaticUartPort and StaticUartTasks.
+ * These inherit from this before UartPort, so the buffers
+ * are constructed before the port that uses them.
+ */
+template<size_t TTxSize, size_t TRxSize>
+class UartBuffers
+{
+  static_assert(TTxSize >= uartMinBufSize, "Uart tx buffer must fit at least 2 packets");
+  static_assert(TRxSize >= uartMinBufSize, "Uart rx buffer must fit at least 2 packets");
+  static_assert(TTxSize <= 0xFFFF && TRxSize <= 0xFFFF, "DMA transfer length is limited to 16 bits");
+
+protected:
+  UartStorage storage() //
+  {
+    return { txMsgBuf, { txDmaBufs[0], txDmaBufs[1] }, TTxSize, rxDmaBuf, TRxSize };
+  }
+
+private:
+  // Buffer for write interface
+  StaticMessageBuffer<TTxSize> txMsgBuf;
+
+  // The "memory" buffers for DMA.
+  // Tx alternates between two, rx is circular.
+  uint8_t txDmaBufs[2][TTxSize];
+  uint8_t rxDmaBuf[TRxSize];
+};
+
+/*
+ * A UART's DMA coordination, and Readable / Writable interfaces,
+ * without any task of its own.
+ * Create with StaticUartPort or StaticUartTasks, which provide the buffers.
+ *
+ * Rx data is read directly from the circular DMA buffer, so there's
+ * no rx task or intermediate stream buffer. Only one task may read.
+ * The reader is woken by DMA half-transfer, transfer-complete, and
+ * UART idle-line interrupts, via its direct task notification.
+ * These may be coalesced, see UartRxCoalescing.
+ *
+ * Tx alternates between two DMA buffers, so the next batch is framed
+ * while the previous one is still being sent. Tx is driven either by
+ * the dedicated task of StaticUartTasks, or by a UartReactor shared
+ * with other ports.
+ */
+class UartPort
   : public Writable
   , public Readable
 {
 public:
-  UartTasks(const char* name, // base name of both threads - not sure this can be passed through statically
-            const UartInfo ui,
-            TaskUtilitiesArg& utilArg,                       // common utilities
-            HalfDuplexCallbacks* halfDuplexCallbacks = NULL, // Full duplex by default
-            UBaseType_t txPriority = osPriorityAboveNormal,  // tx task priority
-            UBaseType_t rxPriority = osPriorityNormal        // rx task priority
-  );
-
-  // Blocking reads and writes. Simple wrapper on xStreamBuffer API.
-  // Reads are from uart rx.
-  // Writes are to uart tx.
+  // Blocking reads and writes.
+  // Reads are from uart rx, directly out of the DMA buffer.
+  // Writes are to uart tx. Each write is a separate frame when using COBS framing.
   size_t read(void* buf, size_t len, TickType_t ticks);
   size_t write(const void* buf, size_t len, TickType_t ticks);
 
-  // Hold off on the protected versions
-  // These are just for situation with multiple readers / writers
-  // protectedRead
-  // protectedWrite
   // Not supporting read / write from ISR
 
+  // Routes tx events to a reactor task.
+  // Writes and tx completion set bit in task's notification value.
+  // Must be called before the scheduler starts.
+  void attachReactor(TaskHandle_t task, uint32_t bit);
+
+  // Reactor's tx step. Doesn't block.
+  // Finishes any completed transfer, frames waiting messages,
+  // and starts the next transfer if the previous one is done.
+  void serviceTx();
+
+  // Tx DMA setup, done by whichever task drives tx
+  void setupTx();
+
   // The following functions need to be public for C-wrapper compatibility
 
-  // Looping task functions
+  // Looping function for a dedicated tx task
   void txFunc();
-  void rxFunc();
 
   // Callbacks
   void dmaRxCallback();
   void dmaTxCallback();
   void uartCallback();
 
+  // Number of times rx DMA overwrote data before it was read
+  uint32_t rxOverruns = 0;
+
+  // Times the reader woke to check for data, for tuning coalescing.
+  // Rate is updated at most once per second, as the reader wakes.
+  uint32_t rxWakeups = 0;
+  uint32_t rxWakeupsPerSec = 0;
+
+protected:
+  UartPort(const char* name, // base name, for logging
+           const UartInfo ui,
+           TaskUtilitiesArg& utilArg,                // common utilities
+           HalfDuplexCallbacks* halfDuplexCallbacks, // NULL for full duplex
+           LinkFraming framing,                      // how each write() is framed on the wire
+           UartRxCoalescing coalescing,              // when to wake reader
+           UartStorage storage                       // buffers
+  );
+
+  // Task and notification bits for tx completion
+  TaskHandle_t txNotifyTask = nullptr;
+  uint32_t txNotifyBits = 0;
+
 private:
-  // The tasks that manage reading and writing to the uart device
-  StaticTask<UartTasks> txTask;
-  StaticTask<UartTasks> rxTask;
+  // Starts circular rx DMA
+  void startRx();
 
-  // Task names. Necessary to reserve space here for concatenating prefix.
-  char txName[configMAX_TASK_NAME_LEN];
-  char rxName[configMAX_TASK_NAME_LEN];
+  // Starts DMA transfer of len bytes from buf
+  void startTx(uint8_t* buf, size_t len);
 
-  // Size of tx and rx buffers.
-  // Should be at least 2x size of largest packet.
-  // Had issues with template strategy, so just hardcoding size here instead.
-  static constexpr size_t TSize = 1024;
+  // Frames waiting messages into txDmaBufs[txNext], without blocking
+  void stageTx();
 
-  // Buffer for read/write interface
-  StaticMessageBuffer<TSize> txMsgBuf;
-  StaticStreamBuffer<TSize> rxStreamBuf;
+  // Copies up to len bytes out of rx DMA buffer without blocking.
+  size_t readDma(void* buf, size_t len);
 
-  // The "memory" buffers for DMA
-  uint8_t txDmaBuf[TSize];
-  uint8_t rxDmaBuf[TSize];
+  // Bytes written by rx DMA since our read position, which exceeds
+  // buffer size if we were lapped. Also returns DMA position.
+  size_t rxDmaPending(uint32_t& laps, uint32_t& idx);
 
-  // These are optional, to support multiple readers / writers.
-  StaticMutex txMutex;
-  StaticMutex rxMutex;
+  // Wakes reader from ISR, unless it's coalescing and not enough data is pending
+  void notifyReader();
 
-  // UART and DMA peripheral info
-  const UartInfo ui;
+  // Counts reader wakeups and updates rxWakeupsPerSec
+  void countRxWakeup();
+
+  // Base name, for logging
+  const char* name;
 
-  // Common utilities for each task
+  // Buffer for write interface
+  MessageBuffer& txMsgBuf;
+
+  // The "memory" buffers for DMA.
+  // Tx alternates between two, rx is circular.
+  uint8_t* const txDmaBufs[2];
+  const size_t txDmaSize;
+  uint8_t* const rxDmaBuf;
+  const size_t rxDmaSize;
+
+  // Common utilities for tx and reader
   TaskUtilities txUtil;
   TaskUtilities rxUtil;
 
   // Contains callbacks for changing tx/rx mode for half-duplex operation
   HalfDuplexCallbacks* halfDuplexCallbacks;
+
+  // With COBS framing, each write() is encoded into a tx DMA buffer as a frame.
+  // Rx data is passed through as-is, so the reader's parser must match.
+  const LinkFraming framing;
+
+  // UART and DMA peripheral info
+  const UartInfo ui;
+
+  // Reactor tx state
+  bool txViaReactor = false;    // whether attachReactor() was called
+  volatile bool txDone = false; // set by tx complete interrupt
+  bool txInFlight = false;      // transfer started and not yet finished
+  uint32_t txNext = 0;          // which of txDmaBufs is being filled
+  size_t txStagedLen = 0;       // bytes framed into txDmaBufs[txNext]
+
+  // Rx read position
+  uint32_t rxReadIdx = 0;  // index of next byte to read from rxDmaBuf
+  uint32_t rxReadLaps = 0; // times read position wrapped around rxDmaBuf
+
+  // Times rx DMA wrapped around rxDmaBuf. Incremented by TC interrupt.
+  volatile uint32_t rxDmaLaps = 0;
+
+  // Task to notify of new rx data. Set by read().
+  volatile TaskHandle_t rxReader = nullptr;
+
+  // Set by reader when nothing is pending, so the first
+  // rx interrupt wakes it to start the delay.
+  volatile bool rxAwaitingFirst = true;
+
+  // Whether unread data is being held back, and since when
+  bool rxHolding = false;
+  TickType_t rxFirstTick = 0;
+
+  // Start of current rxWakeupsPerSec sample
+  TickType_t rxWakeupsSampleTick = 0;
+  uint32_t rxWakeupsSampleCount = 0;
+
+  // Rx coalescing thresholds
+  const size_t rxMinBytes;
+  const TickType_t rxMaxDelayTicks;
+};
+
+/*
+ * A UartPort for use with a UartReactor.
+ * Tx and rx buffer sizes are in bytes. Tx uses three buffers
+ * of this size, and rx uses one.
+ * A low-rate link, such as modbus, can use uartMinBufSize
+ * for both to save RAM.
+ */
+template<size_t TTxSize = 1024, size_t TRxSize = 1024>
+class StaticUartPort
+  : private UartBuffers<TTxSize, TRxSize>
+  , public UartPort
+{
+public:
+  StaticUartPort(const char* name, // base name, for logging
+                 const UartInfo ui,
+                 TaskUtilitiesArg& utilArg,                       // common utilities
+                 HalfDuplexCallbacks* halfDuplexCallbacks = NULL, // Full duplex by default
+                 LinkFraming framing = LinkFraming::Raw,          // how each write() is framed on the wire
+                 UartRxCoalescing coalescing = {}                 // when to wake reader
+                 )
+    : UartPort{ name, ui, utilArg, halfDuplexCallbacks, framing, coalescing, this->storage() }
+  {}
+};
+
+// C-style wrapper to enable launching UartPort::txFunc as a task entry point
+void uartTxFuncWrapper(UartPort* p);
+
+/*
+ * A UartPort with its own tx task.
+ * Simplest option when there are only a few ports.
+ * See UartReactor for sharing one task between many ports.
+ * Buffer sizes are the same as StaticUartPort.
+ */
+template<size_t TTxSize = 1024, size_t TRxSize = 1024>
+class StaticUartTasks
+  : private UartBuffers<TTxSize, TRxSize>
+  , public UartPort
+{
+public:
+  StaticUartTasks(const char* name, // base name of tx thread - not sure this can be passed through statically
+                  const UartInfo ui,
+                  TaskUtilitiesArg& utilArg,                       // common utilities
+                  HalfDuplexCallbacks* halfDuplexCallbacks = NULL, // Full duplex by default
+                  LinkFraming framing = LinkFraming::Raw,          // how each write() is framed on the wire
+                  UartRxCoalescing coalescing = {},                // when to wake reader
+                  UBaseType_t txPriority = osPriorityAboveNormal   // tx task priority
+                  )
+    : UartPort{ name, ui, utilArg, halfDuplexCallbacks, framing, coalescing, this->storage() }
+    , txTask{ concat(txName, name, "_tx", sizeof(txName)), uartTxFuncWrapper, this, txPriority }
+  {
+    // The particular bits set for tx completion are insignificant
+    txNotifyTask = txTask.handle;
+    txNotifyBits = 1;
+  }
+
+private:
+  // The task that manages writing to the uart device
+  StaticTask<UartPort> txTask;
+
+  // Task name. Necessary to reserve space here for concatenating prefix.
+  char txName[configMAX_TASK_NAME_LEN];
 };
@@ -1,31 +1,49 @@
 /*
  * Wrapper for a USB instance.
  * Provides read() and write() interfaces.
- * Statically allocates two tasks and two stream buffers.
+ * Statically allocates a tx task, a tx message buffer, and a pool
+ * of rx endpoint buffers.
  */
 #pragma once
 
+#include "cobs.h"
 #include "interfaces.h"
 #include "task_utilities.h"
 #include "usbd_cdc.h"
 #include "usbd_def.h"
+#include <atomic>
+
+// Number of OUT endpoint buffers for rx.
+// Enough to cover reader latency at full USB speed.
+const uint32_t usbRxSlots = 16;
+
+// Full-speed bulk max packet size
+const uint32_t usbTxPacketSize = CDC_DATA_FS_MAX_PACKET_SIZE;
 
 /*
- * Note that it's possible to improve efficiency by creating
- * a custom StreamBuffer that's more tightly coupled with
- * DMA and could share memory directly.
- * We'll cross that optimization bridge later if necessary.
+ * Rx uses a pool of endpoint-sized buffers (slots). The USB driver
+ * receives each OUT packet directly into the next free slot, and the
+ * reader copies out of it, so nothing is copied in the ISR.
+ * The next OUT packet is only requested once a slot is free.
+ * Until then, the host is NAKed, so a slow reader applies
+ * backpressure instead of losing data.
+ *
+ * Tx alternates between two buffers. While one is being sent, new
+ * writes keep being staged into the other, so the next transfer can
+ * start as soon as the current one completes.
  */
 class UsbTask
   : public Writable
   , public Readable
 {
 public:
-  UsbTask(TaskUtilitiesArg& utilArg, UBaseType_t priority = osPriorityNormal);
+  UsbTask(TaskUtilitiesArg& utilArg,
+          LinkFraming framing = LinkFraming::Raw, // how each write() is framed on the wire
+          UBaseType_t priority = osPriorityNormal);
 
-  // Blocking reads and writes. Simple wrapper on xStreamBuffer API.
-  // Reads are from uart rx.
-  // Writes are to uart tx.
+  // Blocking reads and writes.
+  // Reads are from usb rx slots. Only one task may read.
+  // Writes are to usb tx.
   size_t read(void* buf, size_t len, TickType_t ticks);
   size_t write(const void* buf, size_t len, TickType_t ticks);
 
@@ -47,26 +65,65 @@ public:
   int8_t receiveCb(uint8_t* buf, uint32_t* len);
   int8_t transmitCpltCb(uint8_t* buf, uint32_t* len, uint8_t epnum);
 
+  // Number of times the host was NAKed because all rx slots were full
+  uint32_t rxStalls = 0;
+
 private:
+  // Points driver at next free slot, and requests next OUT packet.
+  // If there are no free slots, notes that rx is stalled instead.
+  // Call from USB ISR or with it masked.
+  void armRx();
+
+  // Copies out of filled slots without blocking, freeing each emptied slot.
+  size_t readSlots(void* buf, size_t len);
+
+  // Starts an IN transfer of len bytes from buf
+  void startTransmit(uint8_t* buf, size_t len);
+
+  // Waits for IN transfer to complete. Meanwhile, if buf is provided,
+  // keeps packing new messages after the len bytes already staged there.
+  // Returns new staged length.
+  size_t waitTransmit(uint8_t* buf, size_t len);
+
   // The tasks that manage reading and writing to the uart device
   StaticTask<UsbTask> txTask;
 
   // A struct of callbacks that are reached via usb ISRs
   USBD_CDC_ItfTypeDef callbacks;
 
+  // Length of transfer in flight
   size_t txLen = 0;
 
+  // With COBS framing, each write() is encoded into a tx buffer as a frame.
+  // Rx data is passed through as-is, so the reader's parser must match.
+  const LinkFraming framing;
+
   // Size of tx and rx buffers.
   // Should be at least 2x size of largest packet.
   static constexpr size_t TSize = 2048;
 
-  // Buffer for read/write interface.
+  // Buffer for write interface.
   StaticMessageBuffer<TSize> txMsgBuf;
-  StaticStreamBuffer<TSize> rxMsgBuf;
 
   // Buffers for the USB driver
-  uint8_t txBuf[TSize];
-  uint8_t rxBuf[TSize];
+  uint8_t txBufs[2][TSize];
+  static_assert(TSize % usbTxPacketSize == 0, "Tx buffers should hold whole packets");
+  uint8_t rxSlots[usbRxSlots][CDC_DATA_FS_MAX_PACKET_SIZE];
+  volatile uint32_t rxLens[usbRxSlots]; // bytes received in each slot
+
+  // Slots are filled and read in order.
+  // These count slots, and wrap at 2^32.
+  std::atomic<uint32_t> rxFilled{ 0 };   // incremented by ISR
+  std::atomic<uint32_t> rxConsumed{ 0 }; // incremented by reader
+  size_t rxSlotOffset = 0;               // bytes already read from oldest filled slot
+  bool rxStalled = false;                // endpoint left unarmed while all slots are full
+
+  // Received into if driver re-initializes while all slots are full.
+  // Contents are dropped.
+  uint8_t rxSpare[CDC_DATA_FS_MAX_PACKET_SIZE];
+
+  // Task to notify of new rx data. Set by read().
+  volatile TaskHandle_t rxReader = nullptr;
 
   USBD_HandleTypeDef usbDeviceHandle;
 
@@ -87,4 +144,5 @@ private:
   uint32_t rxReceivedTotal = 0;
   size_t txPendingTotal = 0;
   uint32_t txTransmittedTotal = 0;
+  uint32_t txTransfersTotal = 0;
 };
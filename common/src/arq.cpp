@@ -0,0 +1,138 @@
+/*
+ * See header for notes.
+ */
+
+#include "arq.h"
+#include <string.h>
+
+// ------- ArqSender -------
+
+void ArqSender::send(Packet& packet, uint32_t now)
+{
+  packet.sequenceNum = nextSeq;
+  Slot& s = slot(nextSeq++);
+  memcpy(&s.packet, &packet, packet.length);
+  s.sentTick = now;
+  s.sendOrder = ++sendCount;
+  s.acked = false;
+  s.lost = false;
+}
+
+void ArqSender::processAck(const ArqAck& ack)
+{
+  // Ignore stale acks, and acks for packets we haven't sent
+  // (such as from before a restart).
+  if (ack.nextSeq - base > nextSeq - base) {
+    return;
+  }
+
+  // Latest transmission known to have arrived
+  uint32_t latestOrder = 0;
+
+  // Cumulative ack frees slots
+  for (; base != ack.nextSeq; base++) {
+    latestOrder = slot(base).sendOrder;
+  }
+
+  // Selective ack marks slots past the gap
+  for (uint32_t i = 0; i < 32; i++) {
+    uint32_t seq = ack.nextSeq + 1 + i;
+    if (seq - base >= nextSeq - base) {
+      break;
+    }
+    if (ack.selective & (1u << i)) {
+      Slot& s = slot(seq);
+      s.acked = true;
+      if (s.sendOrder > latestOrder) {
+        latestOrder = s.sendOrder;
+      }
+    }
+  }
+
+  // Anything sent before that, but still unacked, was lost
+  for (uint32_t seq = base; seq != nextSeq; seq++) {
+    Slot& s = slot(seq);
+    if (!s.acked && s.sendOrder < latestOrder) {
+      s.lost = true;
+    }
+  }
+}
+
+const Packet* ArqSender::nextRetransmit(uint32_t now)
+{
+  for (uint32_t seq = base; seq != nextSeq; seq++) {
+    Slot& s = slot(seq);
+    if (!s.acked && (s.lost || now - s.sentTick >= timeoutTicks)) {
+      s.lost = false;
+      s.sentTick = now;
+      s.sendOrder = ++sendCount;
+      retransmits++;
+      return &s.packet;
+    }
+  }
+  return nullptr;
+}
+
+void ArqSender::reset(uint32_t firstSeq)
+{
+  base = firstSeq;
+  nextSeq = firstSeq;
+}
+
+// ------- ArqReceiver -------
+
+bool ArqReceiver::receive(const Packet& packet)
+{
+  uint32_t seq = packet.sequenceNum;
+
+  // Sync to new or restarted sender.
+  // The running sender's packets are all within
+  // [nextSeq - arqWindowSize, nextSeq + arqWindowSize).
+  if (!synced || seq - (nextSeq - arqWindowSize) >= 2 * arqWindowSize) {
+    reset();
+    nextSeq = seq;
+    synced = true;
+  }
+
+  // Drop anything already delivered
+  Slot& s = slot(seq);
+  if (seq - nextSeq >= arqWindowSize || s.received) {
+    duplicates++;
+    return false;
+  }
+
+  memcpy(&s.packet, &packet, packet.length);
+  s.received = true;
+  return true;
+}
+
+const Packet* ArqReceiver::nextInOrder()
+{
+  Slot& s = slot(nextSeq);
+  if (!synced || !s.received) {
+    return nullptr;
+  }
+  s.received = false;
+  nextSeq++;
+  return &s.packet;
+}
+
+ArqAck ArqReceiver::ack() const
+{
+  ArqAck ack{ nextSeq, 0 };
+  for (uint32_t i = 0; i + 1 < arqWindowSize; i++) {
+    if (slot(nextSeq + 1 + i).received) {
+      ack.selective |= 1u << i;
+    }
+  }
+  return ack;
+}
+
+void ArqReceiver::reset()
+{
+  for (auto& s : slots) {
+    s.received = false;
+  }
+  nextSeq = 1;
+  synced = false;
+}
@@ -0,0 +1,302 @@
+/*
+ * See header for notes.
+ *
+ * Only the decoder lives here. It runs on the host, but builds
+ * anywhere, and is discarded from firmware if unused.
+ */
+
+#include "binary_log.h"
+#include "basic.h"
+#include "packet_utils.h"
+#include <stdarg.h>
+#include <stdio.h>
+
+// Reads argument words from a record
+class BinLogReader
+{
+public:
+  BinLogReader(const uint8_t* data, uint32_t words)
+    : data{ data }
+    , words{ words }
+  {}
+
+  bool word(uint32_t& value)
+  {
+    if (pos >= words) {
+      return false;
+    }
+    memcpy(&value, data + 4 * pos++, 4);
+    return true;
+  }
+
+  bool wide(uint64_t& value)
+  {
+    uint32_t lo, hi;
+    if (!word(lo) || !word(hi)) {
+      return false;
+    }
+    value = (uint64_t)hi << 32 | lo;
+    return true;
+  }
+
+  // Reads inline bytes. Returns pointer to them, or nullptr if truncated.
+  const uint8_t* bytes(uint32_t len)
+  {
+    uint32_t padded = (len + 3) / 4;
+    if (padded > words - pos) {
+      return nullptr;
+    }
+    const uint8_t* ptr = data + 4 * pos;
+    pos += padded;
+    return ptr;
+  }
+
+private:
+  const uint8_t* data;
+  uint32_t words;
+  uint32_t pos = 0;
+};
+
+// Appends to buf, clamping to buffer length
+class BinLogOutput
+{
+public:
+  BinLogOutput(char* buf, uint32_t len)
+    : buf{ buf }
+    , len{ len }
+  {
+    if (len) {
+      buf[0] = '\0';
+    }
+  }
+
+  void printf(const char* fmt, ...)
+  {
+    if (n + 1 >= len) {
+      return;
+    }
+    va_list va;
+    va_start(va, fmt);
+    int written = vsnprintf(buf + n, len - n, fmt, va);
+    va_end(va);
+    if (written > 0) {
+      n = min(n + written, len - 1);
+    }
+  }
+
+  uint32_t n = 0;
+
+private:
+  char* buf;
+  uint32_t len;
+};
+
+/*
+ * Formats a single conversion, consuming its argument words.
+ * `spec` is the conversion spec without length modifiers,
+ * and `length` holds those modifiers.
+ * Returns false if out of argument words.
+ */
+static bool formatConversion(BinLogOutput& out, BinLogReader& args, char* spec, const char* length, BinLogLookup lookup)
+{
+  char conv = spec[strlen(spec) - 1];
+  bool isWide = !strcmp(length, "ll") || !strcmp(length, "j");
+  uint32_t value;
+  uint64_t wideValue;
+
+  switch (conv) {
+    case 'd':
+    case 'i':
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X': {
+      // Reformat with 64-bit length on host
+      char hostSpec[32];
+      snprintf(hostSpec, sizeof(hostSpec), "%.*sll%c", (int)strlen(spec) - 1, spec, conv);
+      bool isSigned = conv == 'd' || conv == 'i';
+      if (isWide) {
+        if (!args.wide(wideValue)) {
+          return false;
+        }
+      } else {
+        if (!args.word(value)) {
+          return false;
+        }
+        // Apply narrowing of target's int and smaller types
+        if (!strcmp(length, "hh")) {
+          wideValue = isSigned ? (uint64_t)(int8_t)value : (uint8_t)value;
+        } else if (!strcmp(length, "h")) {
+          wideValue = isSigned ? (uint64_t)(int16_t)value : (uint16_t)value;
+        } else {
+          wideValue = isSigned ? (uint64_t)(int32_t)value : value;
+        }
+      }
+      out.printf(hostSpec, wideValue);
+      return true;
+    }
+    case 'c': {
+      if (!args.word(value)) {
+        return false;
+      }
+      out.printf(spec, (int)value);
+      return true;
+    }
+    case 'p': {
+      if (!args.word(value)) {
+        return false;
+      }
+      out.printf("0x%x", value);
+      return true;
+    }
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A': {
+      if (!args.wide(wideValue)) {
+        return false;
+      }
+      double d;
+      memcpy(&d, &wideValue, sizeof(d));
+      out.printf(spec, d);
+      return true;
+    }
+    case 's': {
+      if (!args.word(value)) {
+        return false;
+      }
+      if (value >= binLogFlashBase) {
+        const char* str = lookup(value);
+        out.printf(spec, str ? str : "<unknown string>");
+        return true;
+      }
+      const uint8_t* bytes = args.bytes(value);
+      if (!bytes) {
+        return false;
+      }
+      // Add null terminator
+      char str[256];
+      uint32_t strLen = min(value, (uint32_t)sizeof(str) - 1);
+      memcpy(str, bytes, strLen);
+      str[strLen] = '\0';
+      out.printf(spec, str);
+      return true;
+    }
+    case 'P': {
+      if (!args.word(value)) {
+        return false;
+      }
+      const uint8_t* bytes = args.bytes(value);
+      if (!bytes) {
+        return false;
+      }
+      // Packet may have been truncated to fit in record
+      Packet packet{};
+      uint32_t packetLen = min(value, (uint32_t)sizeof(packet));
+      memcpy(&packet, bytes, packetLen);
+      if (packetLen < minPacketLength || packet.length > packetLen) {
+        out.printf("<%u bytes of truncated packet>", packetLen);
+        return true;
+      }
+      char str[512];
+      snprintPacket(str, sizeof(str), packet);
+      out.printf("%s", str);
+      return true;
+    }
+    default: {
+      // Unsupported conversion, such as %n
+      out.printf("%s", spec);
+      return true;
+    }
+  }
+}
+
+uint32_t binLogFormat(char* buf, uint32_t bufLen, const void* record, uint32_t recordLen, BinLogLookup lookup)
+{
+  BinLogOutput out(buf, bufLen);
+
+  uint32_t header;
+  if (recordLen < 4) {
+    out.printf("<truncated record>");
+    return out.n;
+  }
+  memcpy(&header, record, 4);
+
+  uint32_t argWords = min(binLogArgWords(header), recordLen / 4 - 1);
+  BinLogReader args((const uint8_t*)record + 4, argWords);
+
+  const char* fmt = lookup(binLogFlashBase + binLogFormatOffset(header));
+  if (!fmt) {
+    out.printf("<unknown format 0x%08x>", binLogFlashBase + binLogFormatOffset(header));
+    uint32_t value;
+    while (args.word(value)) {
+      out.printf(" %08x", value);
+    }
+  }
+
+  while (fmt && *fmt) {
+    if (*fmt != '%') {
+      // Copy run of plain characters
+      const char* next = strchr(fmt, '%');
+      uint32_t run = next ? next - fmt : strlen(fmt);
+      out.printf("%.*s", (int)run, fmt);
+      fmt += run;
+      continue;
+    }
+
+    if (fmt[1] == '%') {
+      out.printf("%%");
+      fmt += 2;
+      continue;
+    }
+
+    // Split conversion into spec (flags, width, precision, conversion)
+    // and length modifiers. Star width and precision take an argument.
+    char spec[32];
+    char length[4] = "";
+    uint32_t specLen = 0;
+    const char* p = fmt + 1;
+    spec[specLen++] = '%';
+    while (*p && strchr("-+ #0123456789.*", *p) && specLen < sizeof(spec) - 2) {
+      if (*p == '*') {
+        uint32_t value;
+        if (!args.word(value)) {
+          out.printf("<missing>");
+          return out.n;
+        }
+        specLen += snprintf(spec + specLen, sizeof(spec) - 1 - specLen, "%d", (int32_t)value);
+        specLen = min(specLen, (uint32_t)sizeof(spec) - 2);
+      } else {
+        spec[specLen++] = *p;
+      }
+      p++;
+    }
+    uint32_t lengthLen = 0;
+    while (*p && strchr("hljztL", *p) && lengthLen < sizeof(length) - 1) {
+      length[lengthLen++] = *p++;
+    }
+    length[lengthLen] = '\0';
+    if (!*p) {
+      // Incomplete conversion at end of format string
+      out.printf("%s", fmt);
+      break;
+    }
+    spec[specLen++] = *p++;
+    spec[specLen] = '\0';
+    fmt = p;
+
+    if (!formatConversion(out, args, spec, length, lookup)) {
+      out.printf("<missing>");
+      break;
+    }
+  }
+
+  if (header & binLogNewlineFlag) {
+    out.printf("\n");
+  }
+  return out.n;
+}
@@ -0,0 +1,71 @@
+/*
+ * See header for notes.
+ *
+ * Runs of non-zero bytes are found with memchr and moved with memmove,
+ * rather than byte-at-a-time, since newlib and glibc both have
+ * word-at-a-time versions of these.
+ */
+
+#include "cobs.h"
+#include <string.h> // memchr, memmove
+
+// Longest run of data bytes following a code byte
+static const uint32_t maxRun = 254;
+
+uint32_t cobsEncode(void* dst, const void* src, uint32_t len)
+{
+  uint8_t* out = (uint8_t*)dst;
+  const uint8_t* in = (const uint8_t*)src;
+  const uint8_t* end = in + len;
+
+  while (1) {
+    uint32_t limit = end - in < maxRun ? end - in : maxRun;
+    const uint8_t* zero = (const uint8_t*)memchr(in, 0, limit);
+    uint32_t run = zero ? zero - in : limit;
+
+    // Data is moved before writing the code byte, in case of in-place encoding
+    memmove(out + 1, in, run);
+    *out = run + 1;
+    out += run + 1;
+    in += run;
+
+    if (zero) {
+      // Zero is implied by the code byte, and is always followed by another block
+      in++;
+    } else if (in == end) {
+      break;
+    }
+    // Otherwise, a full run with more data to come
+  }
+
+  *out++ = cobsDelimiter;
+  return out - (uint8_t*)dst;
+}
+
+uint32_t cobsDecode(void* dst, const void* src, uint32_t len)
+{
+  uint8_t* out = (uint8_t*)dst;
+  const uint8_t* in = (const uint8_t*)src;
+  const uint8_t* end = in + len;
+
+  while (in < end) {
+    uint32_t code = *in++;
+    uint32_t run = code - 1;
+
+    // Delimiter in frame, or run past end of frame
+    if (code == cobsDelimiter || run > (uint32_t)(end - in)) {
+      return 0;
+    }
+
+    memmove(out, in, run);
+    out += run;
+    in += run;
+
+    // Implied zero, unless this was a full run or the last block
+    if (code != maxRun + 1 && in < end) {
+      *out++ = 0;
+    }
+  }
+
+  return out - (uint8_t*)dst;
+}
@@ -0,0 +1,67 @@
+/*
+ * See header for notes
+ */
+
+#include "crc_engine.h"
+
+#if defined(CRC_ENGINE_HARDWARE)
+
+#include "catch_errors.h"
+#include "stm32f4xx.h"
+#include <string.h> // memcpy
+
+// Set by initCrcEngine()
+static CrcEngine* engine = nullptr;
+
+void initCrcEngine()
+{
+  // Tasks might already be racing on crcEngine()
+  if (xTaskGetSchedulerState() != taskSCHEDULER_NOT_STARTED) {
+    critical();
+  }
+  static CrcEngine instance;
+  engine = &instance;
+}
+
+CrcEngine& crcEngine()
+{
+  if (!engine) {
+    // initCrcEngine() wasn't called
+    critical();
+  }
+  return *engine;
+}
+
+uint32_t HardwareCrcEngine::crc32(const void* dataArg, uint32_t length)
+{
+  // Don't wait if another task is using the CRC unit
+  ScopedLock locked(mutex, 0);
+  if (!locked.gotLock()) {
+    return ::crc32(dataArg, length);
+  }
+
+  const uint8_t* data = (const uint8_t*)dataArg;
+
+  // Resets data register to initial value of 0xFFFFFFFF
+  CRC->CR = CRC_CR_RESET;
+
+  // Feed whole words.
+  // Bit-reversing each input word emulates the reflected input of IEEE CRC-32.
+  for (uint32_t words = length / 4; words; words--) {
+    uint32_t word;
+    memcpy(&word, data, sizeof(word)); // may be unaligned
+    CRC->DR = __RBIT(word);
+    data += 4;
+  }
+
+  // Hardware register is bit-reversed relative to the software register
+  uint32_t reg = __RBIT(CRC->DR);
+
+  // Hardware only accepts whole words, so finish any leftover bytes in software.
+  reg = crc32Update(reg, data, length % 4);
+
+  // Final xorout step
+  return ~reg;
+}
+
+#endif
@@ -3,6 +3,9 @@
  */
 
 #include "itm_logger_task.h"
+#include "basic.h"
+#include "packet_flow_tasks.h"
+#include "packet_utils.h"
 #include "stdio.h"
 
 ItmLogger::ItmLogger( //
@@ -47,14 +50,47 @@ void ItmLogger::func()
       itmSendStringln("Nothing to log");
     } else {
       // We got a message. Log it.
-      while (!itmSendBuf(msg_.buf, msg_.len)) {
-        watchdog.kick(watchdogId);
-        timeout();
+      if (binaryLog) {
+        // Send record words. Host splits these by the lengths in record headers.
+        for (size_t i = 0; i + 4 <= msg_.len; i += 4) {
+          uint32_t word;
+          memcpy(&word, msg_.buf + i, 4);
+          itmSendValue(ItmPort::BinaryLog, word);
+        }
+      } else {
+        while (!itmSendBuf(msg_.buf, msg_.len)) {
+          watchdog.kick(watchdogId);
+          timeout();
+        }
+      }
+
+      if (packetOutput) {
+        initializePacket(packet_, PacketID::LogMessage);
+        setLogMessage(packet_, msg_.buf, msg_.len);
+        if (binaryLog) {
+          packet_.body.logMessage.length |= binaryLogFlag;
+        }
+        // Drop message rather than stall logging if output is backed-up
+        if (!packetOutput->write(&packet_, packet_.length, suggestedTimeoutTicks)) {
+          timeout();
+        }
       }
     }
   }
 }
 
+void ItmLogger::forwardTo(PacketOutput& output)
+{
+  output.verboseIO = false;
+  packetOutput = &output;
+}
+
+// Whether there's anywhere to send logs
+bool ItmLogger::enabled()
+{
+  return itmEnabled(binaryLog ? ItmPort::BinaryLog : ItmPort::Print) || packetOutput;
+}
+
 // Writes log messages to logging task queue/buffer.
 // Returns msg.len if written, 0 if full.
 // Note that calling task needs to pass in a msg struct for temporary storage.
@@ -62,31 +98,13 @@ void ItmLogger::func()
 // but that bumps stack size requirements.
 // Todo, also log originating task.
 // Todo, make a macro version of this.
-// A further optimization is to just copy the args directly to the
-// stack to defer the printf, but printf to fixed-size buffer is not that slow.
-// https://stackoverflow.com/a/1565162
-size_t ItmLogger::log(LogMsg& msg, const char* fmt, ...)
-{
-  // Skip logging if disabled
-  if (!itmEnabled(ItmPort::Print)) {
-    return msg.len;
-  }
-
-  // Write printf string with expanded arguments into message buf
-  va_list va;
-  va_start(va, fmt);
-  vmsgPrintf(msg, fmt, va);
-  va_end(va);
-
-  return send(msg);
-}
-
-// A tad slower than a macro approach or
+// Setting binaryLog defers the printf to the host. See logBinary().
+// Adding newline is a tad slower than a macro approach or
 // manually including "\n" in the format string
-size_t ItmLogger::logln(LogMsg& msg, const char* fmt, ...)
+size_t ItmLogger::logText(LogMsg& msg, bool newline, const char* fmt, ...)
 {
   // Skip logging if disabled
-  if (!itmEnabled(ItmPort::Print)) {
+  if (!enabled()) {
     return msg.len;
   }
 
@@ -96,8 +114,10 @@ size_t ItmLogger::logln(LogMsg& msg, const char* fmt, ...)
   vmsgPrintf(msg, fmt, va);
   va_end(va);
 
-  // Add newline character
-  addLinebreak(msg);
+  if (newline) {
+    // Add newline character
+    addLinebreak(msg);
+  }
 
   return send(msg);
 }
@@ -108,7 +128,7 @@ size_t ItmLogger::logln(LogMsg& msg, const char* fmt, ...)
 size_t ItmLogger::logHex(LogMsg& msg)
 {
   // Skip logging if disabled
-  if (!itmEnabled(ItmPort::Print)) {
+  if (!enabled()) {
     return msg.len;
   }
 
@@ -127,10 +147,30 @@ size_t ItmLogger::logHex(LogMsg& msg)
 size_t ItmLogger::send(LogMsg& msg)
 {
   // Skip logging if disabled
-  if (!itmEnabled(ItmPort::Print)) {
+  if (!enabled()) {
     return msg.len;
   }
 
+  uint32_t fmtOffset;
+  if (binaryLog && binLogFlashOffset("%s", fmtOffset)) {
+    // Wrap text in a record, so the logger task only sees records.
+    // Last few chars may be lost to make room for record header and string length.
+    size_t textLen = min(msg.len, sizeof(msg.buf) - 8);
+    size_t paddedLen = (textLen + 3) & ~3u;
+    memmove(msg.buf + 8, msg.buf, textLen);
+    memset(msg.buf + 8 + textLen, 0, paddedLen - textLen);
+    uint32_t words[2] = { binLogHeader(fmtOffset, 1 + paddedLen / 4, false), textLen };
+    memcpy(msg.buf, words, sizeof(words));
+    msg.len = sizeof(words) + paddedLen;
+  }
+
+  return sendRecord(msg);
+}
+
+// Writes message to logging queue / buffer without any conversion.
+// Same return values as send().
+size_t ItmLogger::sendRecord(LogMsg& msg)
+{
 #if defined(USE_QUEUE_FOR_LOGGER)
 
   return xQueueSendToBack(queue.handle, &msg, suggestedTimeoutTicks);
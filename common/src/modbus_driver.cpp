@@ -10,7 +10,7 @@
 #include "string.h" // memcmp
 
 ModbusDriver::ModbusDriver( //
-  UartTasks& uart,
+  UartPort& uart,
   uint32_t responseDelayMs,
   Writable& target,
   Packet& packet,
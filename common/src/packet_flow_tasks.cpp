@@ -5,40 +5,124 @@
 #include "packet_flow_tasks.h"
 #include "catch_errors.h"
 
-// Set to true to enable more verbose ITM printing of incoming and outgoing packets.
-const bool verboseIO = true;
-
 // ------------ PacketIntake ----------
 
 PacketIntake::PacketIntake( //
   const char* name,
   Readable& target,
+  PacketPool& pool,
   TaskUtilitiesArg& utilArg,
+  LinkFraming framing,
   UBaseType_t priority)
   : target{ target }
-  , parser{ *this }
+  , pool{ pool }
+  , parser{ *this, batch }
   , util{ utilArg }
   , task{ name, funcWrapper, this, priority }
-{}
+{
+  // Accept both framing formats while senders migrate to compact framing
+  parser.acceptCompact = true;
+  parser.framing = framing;
+}
 
 void PacketIntake::func()
 {
   util.watchdogRegisterTask();
 
+  // Arq does its own ordering, so gaps aren't errors
+  parser.checkSequence = !arq;
+
   while (1) {
     util.watchdogKick();
 
     // Attempt to fill buffer
-    len += util.read(target, buf + len, sizeof(buf) - len);
+    ring.commitWrite(util.read(target, ring.writePtr(), ring.writeSpace()));
 
     // Attempt to parse packets
-    len = parser.extractPackets(buf, len);
+    parser.extractPackets(ring);
   }
 }
 
 // Required by CanProcessPacket interface.
 // Describes what to do with incoming packets.
 void PacketIntake::processPacket(const Packet& packet)
+{
+  notePacket(packet);
+
+  if (arq) {
+    receiveReliable(packet);
+    sendAck();
+    return;
+  }
+
+  // Stash parsed packet (or packet parsing error) until another task reads from intake.
+  stash(packet);
+}
+
+/*
+ * Batched version of processPacket.
+ * Queueing each handle would wake the reader once per packet.
+ * Instead, the scheduler is suspended while stashing everything
+ * that fits without blocking, so the reader wakes just once.
+ */
+void PacketIntake::processPackets(const PacketSpan& packets)
+{
+  // Logging may block, so do this first
+  for (const Packet& packet : packets) {
+    notePacket(packet);
+  }
+
+  if (arq) {
+    // Pass along acks first, since stashing may block until
+    // our output has room, which may be waiting on these acks.
+    for (const Packet& packet : packets) {
+      if (packet.id == PacketID::ArqAck) {
+        arqOutput->receiveAck(packet.body.arqAck);
+      }
+    }
+    // Reordering is rarely needed, so skip batching
+    for (const Packet& packet : packets) {
+      if (packet.id != PacketID::ArqAck) {
+        receiveReliable(packet);
+      }
+    }
+    // One ack covers the whole batch
+    sendAck();
+    return;
+  }
+
+  auto it = packets.begin();
+
+  vTaskSuspendAll();
+  for (; it != packets.end() && uxQueueSpacesAvailable(handles.handle); ++it) {
+    PacketHandle handle = pool.alloc(0);
+    if (!handle) {
+      break;
+    }
+    memcpy(&handle->packet, &*it, it->length);
+    xQueueSendToBack(handles.handle, &handle, 0);
+  }
+  xTaskResumeAll();
+
+  // Block for anything that didn't fit
+  for (; it != packets.end(); ++it) {
+    stash(*it);
+  }
+}
+
+// Copies packet into pool, and queues it for readers
+void PacketIntake::stash(const Packet& packet)
+{
+  PacketHandle handle = util.alloc(pool);
+  memcpy(&handle->packet, &packet, packet.length);
+  while (xQueueSendToBack(handles.handle, &handle, suggestedTimeoutTicks) != pdPASS) {
+    util.watchdogKick();
+    timeout();
+  }
+}
+
+// Counters and logging for each incoming packet
+void PacketIntake::notePacket(const Packet& packet)
 {
   // If not a parsing error
   if (packet.origin != PacketOrigin::Internal) {
@@ -56,96 +140,424 @@ void PacketIntake::processPacket(const Packet& packet)
   } else {
     util.logPacket(pcTaskGetName(task.handle), " receive error: ", packet);
   }
+}
 
-  // Stash parsed packet (or packet parsing error) until another task reads from intake.
-  util.write(msgbuf, &packet, packet.length);
+// Passes packet through arq, and stashes any that are now in order
+void PacketIntake::receiveReliable(const Packet& packet)
+{
+  if (packet.id == PacketID::ArqAck) {
+    arqOutput->receiveAck(packet.body.arqAck);
+    return;
+  }
+
+  // Parsing errors aren't sequenced
+  if (packet.origin == PacketOrigin::Internal) {
+    stash(packet);
+    return;
+  }
+
+  // Ack even if dropped, since the sender may have missed the last ack
+  ackNeeded = true;
+  arq->receive(packet);
+
+  const Packet* next;
+  while ((next = arq->nextInOrder())) {
+    stash(*next);
+  }
 }
 
+/*
+ * Sends ack if anything was received since the last one.
+ * Doesn't block, since our output may be waiting for acks that we
+ * haven't parsed yet. If there's no room, the sender will resend
+ * something eventually, and we'll try again then.
+ */
+void PacketIntake::sendAck()
+{
+  if (!ackNeeded) {
+    return;
+  }
+
+  PacketHandle handle = pool.alloc(0);
+  if (!handle) {
+    return;
+  }
+
+  Packet& ack = handle->packet;
+  initializePacket(ack, PacketID::ArqAck);
+  ack.origin = PacketOrigin::TargetToHost;
+  ack.body.arqAck = arq->ack();
+  if (arqOutput->writeHandle(handle, 0)) {
+    ackNeeded = false;
+  } else {
+    pool.release(handle);
+  }
+}
+
+// Copies next packet out of pool
 size_t PacketIntake::read(void* buf, size_t len, TickType_t ticks)
 {
-  return msgbuf.read(buf, len, ticks);
+  PacketHandle handle;
+  if (!readHandle(handle, ticks)) {
+    return 0;
+  }
+
+  size_t packetLen = handle->packet.length;
+  if (len < packetLen) {
+    // Same as reading a message buffer with too small a buffer
+    critical();
+  }
+  memcpy(buf, &handle->packet, packetLen);
+  pool.release(handle);
+  return packetLen;
+}
+
+bool PacketIntake::readHandle(PacketHandle& handle, TickType_t ticks)
+{
+  return xQueueReceive(handles.handle, &handle, ticks) == pdPASS;
 }
 
 // ------ PacketOutput ---------
 
+// ITM port for a lane, given the port of the control lane
+static constexpr ItmPort lanePort(ItmPort controlPort, uint32_t lane)
+{
+  return static_cast<ItmPort>(static_cast<uint32_t>(controlPort) + lane);
+}
+
+static_assert(lanePort(ItmPort::ControlLaneDepth, numPacketLanes - 1) == ItmPort::BulkLaneDepth, "Lane ports out of order");
+static_assert(lanePort(ItmPort::ControlLaneDrops, numPacketLanes - 1) == ItmPort::BulkLaneDrops, "Lane ports out of order");
+
 PacketOutput::PacketOutput( //
   const char* name,
   Writable& target,
+  PacketPool& pool,
   TaskUtilitiesArg& utilArg,
   UBaseType_t priority)
   : target{ target }
+  , pool{ pool }
   , util{ utilArg }
   , task{ name, funcWrapper, this, priority }
 {}
 
 void PacketOutput::func()
 {
+  // Compact headers truncate arq sequence numbers
+  if (arq && compactFraming) {
+    critical();
+  }
+
   util.watchdogRegisterTask();
 
   while (1) {
     util.watchdogKick();
 
-    // Copy next available packet from buffer into wrapper
-    uint32_t len = util.read(msgbuf, &wrap.packet, sizeof(wrap.packet));
-
-    // We could alternatively just assume buffer length is correct
-    // and update the packet field here, but that might let more sigificant
-    // issues slip by.
-    if (len != wrap.packet.length) {
-      util.logln( //
-        "%s dropping packet with invalid length field. Expected %u, got %u",
-        pcTaskGetName(task.handle),
-        len,
-        wrap.packet.length);
-      continue;
+    PacketHandle handle;
+    if (arq) {
+      // Wake up periodically to handle acks and timeouts
+      serviceArq();
+      if (!readNext(handle, arqPollTicks)) {
+        continue;
+      }
+    } else {
+      // Get next available packet from lanes
+      while (!readNext(handle, suggestedTimeoutTicks)) {
+        util.watchdogKick();
+        // Nothing to send is perfectly normal
+        benignTimeout();
+      }
     }
 
-    if (wrap.packet.length != packetSizeFromID(wrap.packet.id)) {
-      util.logln( //
-        "%s dropping packet where length field %u does not match expected length %u from ID",
-        pcTaskGetName(task.handle),
-        wrap.packet.length,
-        packetSizeFromID(wrap.packet.id));
+    if (!preparePacket(handle->packet)) {
+      pool.release(handle);
       continue;
     }
 
-    // Edit origin of parsing errors
-    if (wrap.packet.origin == PacketOrigin::Internal) {
-      wrap.packet.origin = PacketOrigin::TargetToHost;
+    // Bundle any other packets that are already waiting
+    if (aggregatePackets && !arq && aggregateFits(handle->packet)) {
+      sendAggregate(handle);
+    } else {
+      // Pool slots have room for the wrapper, so send in place
+      sendPacket(*handle);
+      pool.release(handle);
+    }
+  }
+}
+
+/*
+ * Picks which lane to read from next.
+ * Returns false if all lanes are empty.
+ */
+bool PacketOutput::nextLane(PacketLane& lane)
+{
+  // Two passes, in case all waiting lanes are out of credits
+  for (uint32_t pass = 0; pass < 2; pass++) {
+    for (uint32_t i = 0; i < numPacketLanes; i++) {
+      if (uxQueueMessagesWaiting(lanes[i].handle) && (!weightedDraining || laneCredits[i])) {
+        lane = static_cast<PacketLane>(i);
+        return true;
+      }
+    }
+
+    if (!weightedDraining) {
+      return false;
+    }
+
+    // Start a new round
+    for (uint32_t i = 0; i < numPacketLanes; i++) {
+      laneCredits[i] = max<uint32_t>(1, laneWeights[i]);
+    }
+  }
+  return false;
+}
+
+/*
+ * Takes next packet from the highest priority lane.
+ * Waits up to `ticks` for a packet to be written to any lane.
+ * Returns false if there's nothing to send.
+ */
+bool PacketOutput::readNext(PacketHandle& handle, TickType_t ticks)
+{
+  PacketLane lane;
+  if (!nextLane(lane)) {
+    // Writers notify us, since we can't block on several queues
+    ulTaskNotifyTake(pdTRUE, ticks);
+    if (!nextLane(lane)) {
+      return false;
     }
+  }
+
+  takeFromLane(lane, handle);
+  return true;
+}
+
+// Takes packet from a lane returned by nextLane()
+void PacketOutput::takeFromLane(PacketLane lane, PacketHandle& handle)
+{
+  uint32_t i = static_cast<uint32_t>(lane);
+  if (laneCredits[i]) {
+    laneCredits[i]--;
+  }
+  xQueueReceive(lanes[i].handle, &handle, 0);
+  itmSendValue(lanePort(ItmPort::ControlLaneDepth, i), uxQueueMessagesWaiting(lanes[i].handle));
+}
+
+// Looks at the packet readNext() would return, without taking it
+bool PacketOutput::peekNext(PacketHandle& handle)
+{
+  PacketLane lane;
+  return nextLane(lane) && xQueuePeek(lanes[static_cast<uint32_t>(lane)].handle, &handle, 0) == pdPASS;
+}
+
+size_t PacketOutput::laneDepth(PacketLane lane)
+{
+  return uxQueueMessagesWaiting(lanes[static_cast<uint32_t>(lane)].handle);
+}
+
+// Counts a dropped packet. May be called from any task.
+void PacketOutput::noteDrop(PacketLane lane)
+{
+  uint32_t i = static_cast<uint32_t>(lane);
+  vTaskSuspendAll();
+  uint32_t drops = ++laneDrops[i];
+  xTaskResumeAll();
+  itmSendValue(lanePort(ItmPort::ControlLaneDrops, i), drops);
+}
 
-    // Update sequence number (updates crc too)
-    sequencer.rewrap(wrap);
+/*
+ * Checks a packet taken from the lanes, and applies outgoing
+ * origin and sequence number.
+ * Returns false if the packet should be dropped.
+ */
+bool PacketOutput::preparePacket(Packet& packet)
+{
+  if (!packetLengthValid(packet.id, packet.length)) {
+    util.logln( //
+      "%s dropping packet where length field %u is outside expected range %u to %u from ID",
+      pcTaskGetName(task.handle),
+      packet.length,
+      minPacketSizeFromID(packet.id),
+      packetSizeFromID(packet.id));
+    noteDrop(packetLaneFromID(packet.id));
+    return false;
+  }
+
+  // Aggregates are only built here, and can't be nested
+  if (packet.id == PacketID::Aggregate) {
+    util.logln("%s dropping aggregate packet", pcTaskGetName(task.handle));
+    noteDrop(PacketLane::Bulk);
+    return false;
+  }
+
+  // Edit origin of parsing errors
+  if (packet.origin == PacketOrigin::Internal) {
+    packet.origin = PacketOrigin::TargetToHost;
+  }
+
+  // Update sequence number. Crc is calculated when sending.
+  if (packet.id == PacketID::ArqAck) {
+    // Acks are unsequenced
+    packet.sequenceNum = 0;
+  } else if (arq) {
+    // Wait for room in window, then let arq number and keep packet
+    while (!arq->canSend()) {
+      util.watchdogKick();
+      vTaskDelay(arqPollTicks);
+      serviceArq();
+    }
+    arq->send(packet, xTaskGetTickCount());
+  } else {
+    packet.sequenceNum = sequencer.num++;
+  }
 
-    // Log outgoing packet counters via ITM
-    packetsOutCount++;
-    itmSendValue(ItmPort::PacketsOutCount, packetsOutCount);
-    //__asm volatile ("nop");
-    itmSendValue(ItmPort::PacketsOutSequence, wrap.packet.sequenceNum);
+  // Log outgoing packet counters via ITM
+  packetsOutCount++;
+  itmSendValue(ItmPort::PacketsOutCount, packetsOutCount);
+  //__asm volatile ("nop");
+  itmSendValue(ItmPort::PacketsOutSequence, packet.sequenceNum);
 
+  if (verboseIO) {
+    // Verbose logging of outgoing packet contents.
+    util.logPacket(pcTaskGetName(task.handle), " sending packet: ", packet);
+  }
+
+  return true;
+}
+
+// Whether another packet is waiting, and fits in an aggregate along with `packet`
+bool PacketOutput::aggregateFits(const Packet& packet)
+{
+  PacketHandle next;
+  return peekNext(next) &&
+         minPacketLength + alignedPacketLength(packet) + alignedPacketLength(next->packet) <= sizeof(Packet);
+}
+
+/*
+ * Builds an aggregate in aggWrap from the `first` packet, followed by
+ * as many other waiting packets as fit, and sends it.
+ * Doesn't wait for more packets. Releases all packets used.
+ */
+void PacketOutput::sendAggregate(PacketHandle first)
+{
+  Packet& aggregate = aggWrap.packet;
+  initializePacket(aggregate, PacketID::Aggregate);
+  aggregate.origin = PacketOrigin::TargetToHost;
+  // Outer sequence number isn't checked, but matching first packet is easier to follow
+  aggregate.sequenceNum = first->packet.sequenceNum;
+  appendToAggregate(aggregate, first->packet);
+  pool.release(first);
+
+  // Take packets in the same order as they'd be sent individually.
+  // Size is checked on the same lane the packet is taken from, since
+  // a writer may fill a higher priority lane in between.
+  PacketLane lane;
+  PacketHandle next;
+  while (nextLane(lane) &&                                                            //
+         xQueuePeek(lanes[static_cast<uint32_t>(lane)].handle, &next, 0) == pdPASS && //
+         aggregate.length + alignedPacketLength(next->packet) <= sizeof(Packet)) {
+    takeFromLane(lane, next);
+    if (!preparePacket(next->packet)) {
+      pool.release(next);
+      continue;
+    }
+    if (!appendToAggregate(aggregate, next->packet)) {
+      // Shouldn't happen, but it's already numbered, so send
+      // what we have so far, then this on its own.
+      sendPacket(aggWrap);
+      sendPacket(*next);
+      pool.release(next);
+      return;
+    }
+    pool.release(next);
+  }
+
+  sendPacket(aggWrap);
+}
+
+// Processes latest ack, and resends any lost packets
+void PacketOutput::serviceArq()
+{
+  vTaskSuspendAll();
+  bool gotAck = ackPending;
+  ArqAck ack = pendingAck;
+  ackPending = false;
+  xTaskResumeAll();
+
+  if (gotAck) {
+    arq->processAck(ack);
+  }
+
+  // Uses aggWrap, since a packet may be waiting for the window
+  const Packet* packet;
+  while ((packet = arq->nextRetransmit(xTaskGetTickCount()))) {
+    memcpy(&aggWrap.packet, packet, packet->length);
     if (verboseIO) {
-      // Verbose logging of outgoing packet contents.
-      util.logPacket(pcTaskGetName(task.handle), " sending wrapped packet: ", wrap.packet);
+      util.logPacket(pcTaskGetName(task.handle), " resending packet: ", aggWrap.packet);
     }
+    sendPacket(aggWrap);
+  }
+}
 
+void PacketOutput::receiveAck(const ArqAck& ack)
+{
+  // Each ack supersedes earlier ones, so just keep the latest
+  vTaskSuspendAll();
+  pendingAck = ack;
+  ackPending = true;
+  xTaskResumeAll();
+}
+
+// Writes packet with either framing
+void PacketOutput::sendPacket(WrappedPacket& out)
+{
+  if (compactFraming) {
+    // Write compact frame.
+    util.write(target, frame, encodeCompact(frame, out.packet));
+  } else {
     // Write wrapped packet.
-    util.write(target, &wrap, wrappedPacketSize(wrap));
+    util.write(target, &setPacketWrapper(out), wrappedPacketSize(out));
   }
 }
 
+// Copies packet into pool, then queues it like writeHandle()
 size_t PacketOutput::write(const void* buf, size_t len, TickType_t ticks)
 {
-  // Message Buffers only allow a single writer by default,
-  // but we can support multiple writers with a mutex.
-  // This mutex is built-in to queues already.
-  ScopedLock locked(writeMutex, suggestedTimeoutTicks);
+  const Packet& packet = *static_cast<const Packet*>(buf);
+
+  // Retrying won't fix a malformed packet, so consume and drop it
+  if (len < minPacketLength || len > sizeof(Packet) || len != packet.length) {
+    noteDrop(PacketLane::Bulk);
+    return len;
+  }
 
-  // Return 0 if we timed-out before acquiring lock
-  if (!locked.gotLock()) {
+  PacketHandle handle = pool.alloc(ticks);
+  if (!handle) {
+    noteDrop(packetLaneFromID(packet.id));
     return 0;
   }
+  memcpy(&handle->packet, buf, len);
+
+  if (!writeHandle(handle, ticks)) {
+    pool.release(handle);
+    return 0;
+  }
+  return len;
+}
+
+bool PacketOutput::writeHandle(PacketHandle handle, TickType_t ticks)
+{
+  PacketLane lane = packetLaneFromID(handle->packet.id);
+  uint32_t i = static_cast<uint32_t>(lane);
+
+  // Queues support multiple writers, so no need for a mutex
+  if (xQueueSendToBack(lanes[i].handle, &handle, ticks) != pdPASS) {
+    noteDrop(lane);
+    return false;
+  }
 
-  return msgbuf.write(buf, len, ticks);
+  itmSendValue(lanePort(ItmPort::ControlLaneDepth, i), uxQueueMessagesWaiting(lanes[i].handle));
+  xTaskNotifyGive(task.handle);
+  return true;
 }
 
 // -------- Coupling ---------
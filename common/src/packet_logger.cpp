@@ -7,20 +7,33 @@
 
 // Formats and logs a packet via provided logger,
 // but only if logging is enabled.
+// In binaryLog mode, formatting is left to the host.
 // Skips expensive formatting step when logging is disabled.
 // Returns number of bytes written, 0 if failed.
 int logPacketBase(const char* callerName, const char* note, const Packet& packet, ItmLogger* logger, LogMsg& msg)
 {
+  if (!logger) {
+    critical();
+  }
+
   // Skip logging if disabled
-  if (!itmEnabled(ItmPort::Print)) {
+  if (!logger->enabled()) {
     // Number of bytes to write is unknown until formatting,
     // but returning a non-zero value here is good enough to
     // indicate success to caller.
     return 1;
   }
 
-  if (!logger) {
-    critical();
+  // Send raw packet to be formatted on host.
+  // Large packets are truncated to fit.
+  uint32_t fmtOffset;
+  if (logger->binaryLog && binLogFlashOffset("%s%s%P", fmtOffset)) {
+    BinLogWriter writer(msg.buf, sizeof(msg.buf));
+    writer.arg(callerName);
+    writer.arg(note);
+    writer.bytes(&packet, packet.length);
+    msg.len = writer.finish(fmtOffset, true);
+    return logger->sendRecord(msg);
   }
 
   msg.len = snprintf((char*)&msg.buf, sizeof(msg), "%s%s", callerName, note);
@@ -0,0 +1,53 @@
+/*
+ * See header for notes.
+ */
+
+#include "packet_pool.h"
+#include "catch_errors.h"
+
+void PacketPool::init(QueueHandle_t freeList_)
+{
+  freeList = freeList_;
+  for (uint32_t i = 0; i < numSlots; i++) {
+    PacketHandle handle = &slots[i];
+    xQueueSendToBack(freeList, &handle, 0);
+  }
+}
+
+PacketHandle PacketPool::alloc(TickType_t ticks)
+{
+  PacketHandle handle;
+  if (xQueueReceive(freeList, &handle, ticks) != pdPASS) {
+    return nullptr;
+  }
+  allocated[index(handle)] = true;
+  return handle;
+}
+
+void PacketPool::release(PacketHandle handle)
+{
+  uint32_t i = index(handle);
+  if (!allocated[i]) {
+    // Already released
+    critical();
+  }
+  allocated[i] = false;
+
+  // Never blocks, since there's room for every slot
+  xQueueSendToBack(freeList, &handle, 0);
+}
+
+uint32_t PacketPool::available()
+{
+  return uxQueueMessagesWaiting(freeList);
+}
+
+uint32_t PacketPool::index(PacketHandle handle)
+{
+  uint32_t i = handle - slots;
+  if (i >= numSlots) {
+    // Not from this pool
+    critical();
+  }
+  return i;
+}
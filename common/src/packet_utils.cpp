@@ -4,11 +4,15 @@
 
 #include "packet_utils.h"
 #include "basic.h"
-#include "software_crc.h"
+#include "crc_engine.h"
 #include <stdio.h>  // fwrite
-#include <string.h> // memmove
+#include <string.h> // memmove, memchr, memcmp
 #include <unistd.h> // write
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifdef HOST_APP
 #define println(format, ...) printf(format "\n", ##__VA_ARGS__)
 #else
@@ -27,14 +31,60 @@ void initializePacket(Packet& packet, PacketID id)
 {
   packet.origin = PacketOrigin::Internal;
   packet.id = id;
-  packet.length = packetSizeFromID(id);
+  packet.length = minPacketSizeFromID(id);
 }
 
 // A version of initializePacket() that just sets id and length fields
 void setPacketIdAndLength(Packet& packet, PacketID id)
 {
   packet.id = id;
-  packet.length = packetSizeFromID(id);
+  packet.length = minPacketSizeFromID(id);
+}
+
+/*
+ * Setters for variable-length bodies.
+ * These also update packet length.
+ * Contents longer than the maximum body size are truncated.
+ */
+
+void setLogMessage(Packet& packet, const char* msg, uint32_t len)
+{
+  LogMessage& log = packet.body.logMessage;
+  log.length = min(len, maxLogMsgLength);
+  memcpy(log.msg, msg, log.length);
+  packet.length = minPacketSizeFromID(PacketID::LogMessage) + log.length;
+}
+
+void setDummyPayload(Packet& packet, const void* payload, uint32_t len)
+{
+  len = min(len, (uint32_t)sizeof(DummyPacket::payload));
+  memcpy(packet.body.dummy.payload, payload, len);
+  packet.length = minPacketSizeFromID(PacketID::DummyPacket) + len;
+}
+
+uint32_t dummyPayloadLength(const Packet& packet)
+{
+  return packet.length - minPacketSizeFromID(PacketID::DummyPacket);
+}
+
+/*
+ * Copies packet to the end of an aggregate packet, and updates
+ * aggregate length. Each inner packet is padded to a 4-byte boundary,
+ * so the parser can deliver them in place.
+ * Returns false if there's not enough room.
+ */
+bool appendToAggregate(Packet& aggregate, const Packet& packet)
+{
+  uint32_t len = alignedPacketLength(packet);
+  if (aggregate.length + len > sizeof(Packet)) {
+    return false;
+  }
+  uint8_t* dst = reinterpret_cast<uint8_t*>(&aggregate) + aggregate.length;
+  memcpy(dst, &packet, packet.length);
+  // Zero padding, so crc is repeatable
+  memset(dst + packet.length, 0, len - packet.length);
+  aggregate.length += len;
+  return true;
 }
 
 /*
@@ -43,7 +93,7 @@ void setPacketIdAndLength(Packet& packet, PacketID id)
 WrappedPacket& setPacketWrapper(WrappedPacket& wrap)
 {
   wrap.magicStart = startWord;
-  wrap.crc = crc32(reinterpret_cast<const uint8_t*>(&wrap.packet), wrap.packet.length);
+  wrap.crc = crcEngine().crc32(reinterpret_cast<const uint8_t*>(&wrap.packet), wrap.packet.length);
   return wrap;
 }
 
@@ -107,6 +157,121 @@ uint32_t copyInner(void* buf, WrappedPacket& wrap)
   return mymemcpy(buf, &wrap.packet, wrap.packet.length);
 }
 
+/*
+ * Compact framing (v2). See packets.h for format.
+ * Header is assembled in a packed struct, and the body is copied as-is,
+ * so this is about as fast as copyWrapped().
+ */
+uint32_t encodeCompact(void* buf, const Packet& packet)
+{
+  uint8_t* frame = (uint8_t*)buf;
+  uint32_t bodyLength = packet.length - minPacketLength;
+
+  CompactHeader header;
+  header.sync = compactSyncWord;
+  header.version = compactVersion;
+  header.crc = 0; // filled in below
+  header.id = static_cast<uint8_t>(packet.id);
+  header.origin = static_cast<uint8_t>(packet.origin);
+  header.bodyLength = bodyLength;
+  header.sequenceNum = packet.sequenceNum;
+
+  memcpy(frame, &header, compactHeaderLength);
+  memcpy(frame + compactHeaderLength, &packet.body, bodyLength);
+
+  uint32_t crc = crcEngine().crc32(frame + compactCrcOffset, compactHeaderLength - compactCrcOffset + bodyLength);
+  memcpy(frame + offsetof(CompactHeader, crc), &crc, sizeof(crc));
+
+  return compactHeaderLength + bodyLength;
+}
+
+uint32_t decodeCompact(Packet& packet, const void* buf, uint32_t len)
+{
+  const uint8_t* frame = (const uint8_t*)buf;
+
+  CompactHeader header;
+  if (len < compactHeaderLength) {
+    return 0;
+  }
+  memcpy(&header, frame, compactHeaderLength);
+
+  uint32_t frameLength = compactHeaderLength + header.bodyLength;
+  if (header.sync != compactSyncWord ||                     //
+      header.version != compactVersion ||                   //
+      header.id >= static_cast<uint8_t>(PacketID::NumIDs) || //
+      minPacketLength + header.bodyLength > sizeof(Packet) || //
+      len < frameLength ||                                  //
+      header.crc != crcEngine().crc32(frame + compactCrcOffset, frameLength - compactCrcOffset)) {
+    return 0;
+  }
+
+  packet.length = minPacketLength + header.bodyLength;
+  packet.sequenceNum = header.sequenceNum;
+  packet.origin = static_cast<PacketOrigin>(header.origin);
+  packet.id = static_cast<PacketID>(header.id);
+  memcpy(&packet.body, frame + compactHeaderLength, header.bodyLength);
+
+  return frameLength;
+}
+
+/*
+ * Returns offset of the first position in [start, end) where the
+ * low `width` bytes (2 or 4) of `word` begin, or `end` if there is none.
+ * Reads up to width - 1 bytes past `end`, so these must be valid.
+ *
+ * Used to quickly skip over garbage when the parser loses sync.
+ * On the host, checks 16 positions at a time with SSE2.
+ * Otherwise, uses memchr to find candidate first bytes, which newlib
+ * implements word-at-a-time on Cortex-M.
+ */
+uint32_t findSyncWord(const void* bufArg, uint32_t start, uint32_t end, uint32_t word, uint32_t width)
+{
+  const uint8_t* buf = (const uint8_t*)bufArg;
+  const uint8_t firstByte = word & 0xFF; // little-endian
+
+#if defined(__SSE2__)
+  const __m128i b0 = _mm_set1_epi8((char)(word >> 0));
+  const __m128i b1 = _mm_set1_epi8((char)(word >> 8));
+  const __m128i b2 = _mm_set1_epi8((char)(word >> 16));
+  const __m128i b3 = _mm_set1_epi8((char)(word >> 24));
+
+  while (start + 16 <= end) {
+    const uint8_t* p = buf + start;
+    // Each lane is set where all bytes of word match
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 0)), b0), //
+                               _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 1)), b1));
+    if (width == 4) {
+      eq = _mm_and_si128(eq,
+                         _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 2)), b2), //
+                                       _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + 3)), b3)));
+    }
+    uint32_t mask = _mm_movemask_epi8(eq);
+    if (mask) {
+      return start + __builtin_ctz(mask);
+    }
+    start += 16;
+  }
+#endif
+
+  // Remaining positions
+  while (start < end) {
+    auto p = (const uint8_t*)memchr(buf + start, firstByte, end - start);
+    if (!p) {
+      return end;
+    }
+    if (!memcmp(p, &word, width)) {
+      return p - buf;
+    }
+    start = p - buf + 1;
+  }
+  return end;
+}
+
+uint32_t findStartWord(const void* buf, uint32_t start, uint32_t end)
+{
+  return findSyncWord(buf, start, end, startWord, sizeof(startWord));
+}
+
 /*
  * Takes a buffer and its length.
  * Looks for any complete packets.
@@ -123,138 +288,106 @@ uint32_t copyInner(void* buf, WrappedPacket& wrap)
  *  These packets will have sequence number 0, which indicates they are
  *  generated internally.
  *
- *  Todos to think about:
- *  	Additional error packet allocated locally.
- *  	If we made a packetExtractor object, could statically allocate
- *  	the errorPacket.
- *  	Could have sequence number history too, to enable that error message.
- *  	There will likely need to be more than one of these extractors, so
- *  	can't just do non-object static.
+ * Parsing logic is shared with the ring version below,
+ * which never needs to shift data. See PacketParserCore::parse().
  */
 uint32_t PacketParser::extractPackets(void* bufArg, uint32_t len)
 {
-  uint32_t offset = 0;
-  uint32_t skippedBytes = 0;
-  uint8_t* buf = (uint8_t*)bufArg;
-
-  // Keep checking while there are still enough bytes to read
-  while (len >= offset + minWrappedPacketLength) {
-    // Check if this is a valid packet
-
-    auto wrap = (WrappedPacket*)(buf + offset);
-    Packet& packet = wrap->packet;
-
-    // Check for start word
-    if (wrap->magicStart != startWord) {
-      // Mismatch, try next byte
-      offset++;
-      skippedBytes++;
-      continue;
-    }
-
-    // Check if length is reasonable
-    if (packet.length < minPacketLength || //
-        packet.length > sizeof(Packet)) {
-      // Report length mismatch
-      initializePacket(errorPacket, PacketID::ParsingErrorInvalidLength);
-      errorPacket.body.parsingError.invalidLength = packet.length;
-      processer.processPacket(errorPacket);
-
-      // Mismatch, try next byte
-      offset++;
-      skippedBytes++;
-      continue;
-    }
-
-    // Check if id is reasonable
-    if (packet.id >= PacketID::NumIDs) {
-      // Report id mismatch
-      initializePacket(errorPacket, PacketID::ParsingErrorInvalidID);
-      errorPacket.body.parsingError.invalidID = static_cast<uint32_t>(packet.id);
-      processer.processPacket(errorPacket);
-
-      // Mismatch, try next byte
-      offset++;
-      skippedBytes++;
-      continue;
-    }
-
-    // Check if we have enough bytes of data for this packet
-    if (len < offset + wrapperLength + packet.length) {
-      // This is just an informative print, rather than an error.
-      // println("Waiting for remaining bytes of packet. Have %d, need %d.",
-      //   len, offset + wrapperLength + packet.length);
-
-      // We likely have an incomplete packet.
-      // Need more data to be sure, so done with parsing for now.
-      // Should hopefully receive the rest of the packet on next parsing call.
-      break;
-    }
-
-    // Check crc
-    uint32_t calculatedCRC = crc32(reinterpret_cast<const uint8_t*>(&packet), packet.length);
-    if (calculatedCRC != wrap->crc) {
-      // Report crc mismatch
-      initializePacket(errorPacket, PacketID::ParsingErrorInvalidCRC);
-      errorPacket.body.parsingError.invalidCRC.provided = wrap->crc;
-      errorPacket.body.parsingError.invalidCRC.calculated = calculatedCRC;
-      processer.processPacket(errorPacket);
-
-      // Mismatch, try next byte
-      offset++;
-      skippedBytes++;
-      continue;
-    }
+  return extractLinear(*this, bufArg, len);
+}
 
-    // We have a valid packet
+/*
+ * Same as above, but for data in a circular buffer.
+ * Consumed bytes are released from the ring, and nothing is moved.
+ * Returns number of leftover bytes in the ring.
+ */
+uint32_t PacketParser::extractPackets(ParserRing& ring)
+{
+  return extractRing(*this, ring);
+}
 
-    // First, report how many bytes we had to skip (if any)
-    if (skippedBytes) {
-      // Report skipped bytes
-      initializePacket(errorPacket, PacketID::ParsingErrorDroppedBytes);
-      errorPacket.body.parsingError.droppedBytes = skippedBytes;
-      processer.processPacket(errorPacket);
+// Copies `n` bytes at offset `at` from `start` in the ring, handling wrap-around.
+void ringCopy(void* dst, const uint8_t* ring, uint32_t size, uint32_t start, uint32_t at, uint32_t n)
+{
+  uint32_t idx = ringIndex(size, start, at);
+  uint32_t first = min(n, size - idx);
+  memcpy(dst, ring + idx, first);
+  memcpy((uint8_t*)dst + first, ring, n - first);
+}
 
-      // Reset skipped bytes
-      skippedBytes = 0;
+/*
+ * Returns offset of the first `byte` in the ring, between offsets
+ * from (inclusive) and end (exclusive), or end if not found.
+ * Offsets are relative to `start`.
+ */
+uint32_t ringFindByte(const uint8_t* ring, uint32_t size, uint32_t start, uint32_t from, uint32_t end, uint8_t byte)
+{
+  while (from < end) {
+    uint32_t idx = ringIndex(size, start, from);
+    uint32_t n = min(end - from, size - idx);
+    auto found = (const uint8_t*)memchr(ring + idx, byte, n);
+    if (found) {
+      return from + (found - (ring + idx));
     }
+    from += n;
+  }
+  return end;
+}
 
-    // Check if sequence number is out of order
-    if (packet.sequenceNum != lastSeqNum + 1) {
-      // Report unexpected sequence number
-      initializePacket(errorPacket, PacketID::ParsingErrorInvalidSequence);
-      errorPacket.body.parsingError.invalidSequence.provided = packet.sequenceNum;
-      errorPacket.body.parsingError.invalidSequence.expected = lastSeqNum + 1;
-      processer.processPacket(errorPacket);
+/*
+ * Ring version of findSyncWord().
+ * Offsets are relative to `start`.
+ */
+uint32_t ringFindSyncWord(const uint8_t* ring, uint32_t size, uint32_t start, uint32_t from, uint32_t end, uint32_t word, uint32_t width)
+{
+  while (from < end) {
+    uint32_t idx = ringIndex(size, start, from);
+    uint32_t room = size - idx;
+    if (room >= width) {
+      // Scan positions where the whole word is before the end of the ring
+      uint32_t linearEnd = min(end, from + room - (width - 1));
+      uint32_t found = findSyncWord(ring, idx, idx + (linearEnd - from), word, width);
+      from += found - idx;
+      if (from < linearEnd) {
+        return from;
+      }
+    } else {
+      // Word wraps around the end
+      uint32_t candidate = 0;
+      ringCopy(&candidate, ring, size, start, from, width);
+      if (!memcmp(&candidate, &word, width)) {
+        return from;
+      }
+      from++;
     }
+  }
+  return end;
+}
 
-    lastSeqNum = packet.sequenceNum;
-
-    // Send valid packet to callback
-
+void PacketParser::deliver(const Packet& packet)
+{
+  if (!batchBuf) {
     processer.processPacket(packet);
-
-    // Adjust offset
-    offset += wrapperLength + packet.length;
+    return;
   }
 
-  // Do a final reporting of skipped bytes
-  if (skippedBytes) {
-    // Report skipped bytes
-    initializePacket(errorPacket, PacketID::ParsingErrorDroppedBytes);
-    errorPacket.body.parsingError.droppedBytes = skippedBytes;
-    processer.processPacket(errorPacket);
+  // Make room if batch is full
+  if (batchLen + alignedPacketLength(packet) > batchSize) {
+    flush();
   }
 
-  // Shift out any consumed bytes
-  if (offset) {
-    len -= offset;
-    // Move leftover bytes to beginning of buffer
-    memmove(buf, buf + offset, len);
-  }
+  memcpy(batchBuf + batchLen, &packet, packet.length);
+  batchLen += alignedPacketLength(packet);
+  batchCount++;
+}
 
-  // Return number of leftover bytes
-  return len;
+void PacketParser::flush()
+{
+  if (batchCount) {
+    processer.processPackets(PacketSpan(batchBuf, batchLen, batchCount));
+    batchLen = 0;
+    batchCount = 0;
+  }
 }
 
 /*
@@ -284,10 +417,21 @@ uint32_t snprintPacket(char* buf, uint32_t len, const Packet& packet)
 
   switch (packet.id) {
     case PacketID::LogMessage: {
-      return snprintf(buf + n,
-                      len - n, //
-                      "%s",
-                      packet.body.logMessage.msg);
+      if (packet.body.logMessage.length & binaryLogFlag) {
+        // Needs format strings from firmware. See host_apps/binlog.
+        return n + snprintf(buf + n,
+                            len - n, //
+                            "%u bytes of binary log records",
+                            packet.body.logMessage.length & ~binaryLogFlag);
+      }
+      // Message is not null-terminated, and length field isn't covered by
+      // length validation, so also limit to what fits in the packet.
+      uint32_t msgLen = min(packet.body.logMessage.length, packet.length - minPacketSizeFromID(PacketID::LogMessage));
+      return n + snprintf(buf + n,
+                          len - n, //
+                          "%.*s",
+                          (int)msgLen,
+                          packet.body.logMessage.msg);
     }
     case PacketID::Heartbeat: return n;
     case PacketID::ParsingErrorInvalidLength: {
@@ -397,8 +541,22 @@ uint32_t snprintPacket(char* buf, uint32_t len, const Packet& packet)
     case PacketID::DummyPacket: {
       return n + snprintf(buf + n,
                           len - n, //
-                          "%u",
-                          packet.body.dummy.outId);
+                          "%u, %u byte payload",
+                          packet.body.dummy.outId,
+                          dummyPayloadLength(packet));
+    }
+    case PacketID::ArqAck: {
+      return n + snprintf(buf + n,
+                          len - n, //
+                          "next %u, selective 0x%08X",
+                          packet.body.arqAck.nextSeq,
+                          packet.body.arqAck.selective);
+    }
+    case PacketID::Aggregate: {
+      return n + snprintf(buf + n,
+                          len - n, //
+                          "%u bytes of inner packets",
+                          packet.length - minPacketLength);
     }
     // This should not be called
     case PacketID::NumIDs: return n;
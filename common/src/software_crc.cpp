@@ -13,24 +13,336 @@
  * Note that STM32 only has special hardware support for 32-bit CRC.
  * 	 - Will need to be careful to only allow exclusive HW CRC access.
  *
- * Todo benchmark:
- * 	- 32 bit slow, vs byte lookup, vs word lookup (double-check storage cost), vs HW
- * 	- 16 bit slow, vs byte lookup, vs word lookup
+ * CRC lookup tables are generated at compile time, so there are
+ * no magic tables to paste in from crcany, and no startup cost.
+ * Slicing variants assume a little-endian architecture (both PC and STM32).
+ *
+ * Benchmark with host_apps/crc_bench.
  *
- * Can use crcany to generate fast lookup tables:
- * https://github.com/madler/crcany
- * Byte-lookup probably best middle-ground for easy architecture interop (no endianness issues).
+ * Todo benchmark:
+ * 	- 32 bit vs HW
  *
  */
 
-#include <stdint.h>
+#include "software_crc.h"
+#include <stddef.h> // size_t
+#include <string.h> // memcpy
+
+#if defined(CRC32_PCLMUL)
+#include <immintrin.h>
+#endif
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "CRC slicing assumes little-endian word loads");
+
+static_assert(CRC32_SLICES == 1 || CRC32_SLICES == 4 || CRC32_SLICES == 8, "CRC32_SLICES must be 1, 4, or 8");
+static_assert(CRC16_SLICES == 1 || CRC16_SLICES == 4, "CRC16_SLICES must be 1 or 4");
+
+// ------- Compile-time table generation --------
+
+// Lookup tables for reflected CRCs.
+// t[0] is the classic byte lookup table.
+// t[n] is the contribution of a byte that is followed by n more bytes,
+// which allows processing multiple bytes per iteration ("slicing").
+template<typename T, size_t TSlices>
+struct CrcTable
+{
+  T t[TSlices][256];
+};
+
+template<typename T, size_t TSlices>
+constexpr CrcTable<T, TSlices> makeCrcTable(T reversedPoly)
+{
+  CrcTable<T, TSlices> table{};
+
+  for (uint32_t i = 0; i < 256; i++) {
+    T reg = i;
+    for (int bit = 0; bit < 8; bit++) {
+      reg = (reg & 1) ? (reg >> 1) ^ reversedPoly : reg >> 1;
+    }
+    table.t[0][i] = reg;
+  }
+
+  for (size_t slice = 1; slice < TSlices; slice++) {
+    for (uint32_t i = 0; i < 256; i++) {
+      T prev = table.t[slice - 1][i];
+      table.t[slice][i] = (prev >> 8) ^ table.t[0][prev & 0xFF];
+    }
+  }
+
+  return table;
+}
+
+// Using inverted 0x04C11DB7
+constexpr uint32_t crc32ReversedPoly = 0xEDB88320;
+
+// Separate tables per variant, so the linker can drop the ones we don't use.
+constexpr CrcTable<uint32_t, 1> crc32Table1 = makeCrcTable<uint32_t, 1>(crc32ReversedPoly);
+constexpr CrcTable<uint32_t, 4> crc32Table4 = makeCrcTable<uint32_t, 4>(crc32ReversedPoly);
+constexpr CrcTable<uint32_t, 8> crc32Table8 = makeCrcTable<uint32_t, 8>(crc32ReversedPoly);
+
+// Spot-check against well-known table entries
+static_assert(crc32Table1.t[0][1] == 0x77073096, "Bad CRC-32 table");
+static_assert(crc32Table1.t[0][255] == 0x2D02EF8D, "Bad CRC-32 table");
+static_assert(crc32Table8.t[0][128] == crc32Table1.t[0][128], "Bad CRC-32 table");
+
+// Using inverted 0x8005
+constexpr uint16_t crc16ReversedPoly = 0xA001;
+
+constexpr CrcTable<uint16_t, 1> crc16Table1 = makeCrcTable<uint16_t, 1>(crc16ReversedPoly);
+constexpr CrcTable<uint16_t, 4> crc16Table4 = makeCrcTable<uint16_t, 4>(crc16ReversedPoly);
+
+static_assert(crc16Table1.t[0][1] == 0xC0C1, "Bad CRC-16 table");
+static_assert(crc16Table1.t[0][255] == 0x4040, "Bad CRC-16 table");
+static_assert(crc16Table4.t[0][128] == crc16Table1.t[0][128], "Bad CRC-16 table");
+
+// Unaligned-safe word load. Compiles to a single load on both PC and Cortex-M4.
+static inline uint32_t load32(const uint8_t* p)
+{
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+// ------- Table-driven register updates --------
+// These take and return the raw CRC register (before any xorout step),
+// so they can be chained across multiple chunks of data.
+
+// One table lookup per byte
+static uint16_t crc16BytewiseUpdate(uint16_t reg, const uint8_t* data, uint32_t length)
+{
+  while (length--) {
+    reg = (reg >> 8) ^ crc16Table1.t[0][(reg ^ *data++) & 0xFF];
+  }
+  return reg;
+}
+
+// Four table lookups per 4-byte word.
+// The 16-bit register only overlaps the first two bytes of each word.
+static uint16_t crc16Slice4Update(uint16_t reg, const uint8_t* data, uint32_t length)
+{
+  const auto& t = crc16Table4.t;
+
+  while (length >= 4) {
+    uint32_t word = load32(data) ^ reg;
+    reg = t[3][word & 0xFF] ^        //
+          t[2][(word >> 8) & 0xFF] ^ //
+          t[1][(word >> 16) & 0xFF] ^
+          t[0][word >> 24];
+    data += 4;
+    length -= 4;
+  }
+
+  // Leftover bytes
+  while (length--) {
+    reg = (reg >> 8) ^ t[0][(reg ^ *data++) & 0xFF];
+  }
+  return reg;
+}
+
+// One table lookup per byte
+static uint32_t crc32BytewiseUpdate(uint32_t reg, const uint8_t* data, uint32_t length)
+{
+  while (length--) {
+    reg = (reg >> 8) ^ crc32Table1.t[0][(reg ^ *data++) & 0xFF];
+  }
+  return reg;
+}
+
+// Four table lookups per 4-byte word
+static uint32_t crc32Slice4Update(uint32_t reg, const uint8_t* data, uint32_t length)
+{
+  const auto& t = crc32Table4.t;
+
+  while (length >= 4) {
+    reg ^= load32(data);
+    reg = t[3][reg & 0xFF] ^        //
+          t[2][(reg >> 8) & 0xFF] ^ //
+          t[1][(reg >> 16) & 0xFF] ^
+          t[0][reg >> 24];
+    data += 4;
+    length -= 4;
+  }
+
+  // Leftover bytes
+  while (length--) {
+    reg = (reg >> 8) ^ t[0][(reg ^ *data++) & 0xFF];
+  }
+  return reg;
+}
+
+// Eight table lookups per 8-byte chunk
+static uint32_t crc32Slice8Update(uint32_t reg, const uint8_t* data, uint32_t length)
+{
+  const auto& t = crc32Table8.t;
+
+  while (length >= 8) {
+    uint32_t lo = load32(data) ^ reg;
+    uint32_t hi = load32(data + 4);
+    reg = t[7][lo & 0xFF] ^         //
+          t[6][(lo >> 8) & 0xFF] ^  //
+          t[5][(lo >> 16) & 0xFF] ^ //
+          t[4][lo >> 24] ^          //
+          t[3][hi & 0xFF] ^         //
+          t[2][(hi >> 8) & 0xFF] ^  //
+          t[1][(hi >> 16) & 0xFF] ^ //
+          t[0][hi >> 24];
+    data += 8;
+    length -= 8;
+  }
+
+  // Leftover bytes
+  while (length--) {
+    reg = (reg >> 8) ^ t[0][(reg ^ *data++) & 0xFF];
+  }
+  return reg;
+}
+
+#if defined(CRC32_PCLMUL)
+
+// ------- Host-only PCLMULQDQ folding --------
+/*
+ * Folds 64 bytes at a time with carry-less multiplies, then reduces to
+ * 32 bits with Barrett reduction.
+ * From Intel's "Fast CRC Computation for Generic Polynomials Using
+ * PCLMULQDQ Instruction". Same approach as zlib and the Linux kernel.
+ * Constants are for the bit-reflected CRC-32 polynomial.
+ */
+
+// Folding needs at least 4 x 16-byte lanes
+const uint32_t crc32PclmulMinLength = 64;
+
+bool crc32PclmulSupported()
+{
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+// Requires length >= 64 and a multiple of 16.
+__attribute__((target("pclmul,sse4.1"))) //
+static uint32_t crc32FoldUpdate(uint32_t reg, const uint8_t* data, uint32_t length)
+{
+  // x^(4*128+32) mod P, x^(4*128-32) mod P - for folding 4 lanes
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  // x^(128+32) mod P, x^(128-32) mod P - for folding 1 lane
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  // x^64 mod P - for folding 96 to 64 bits
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  // Polynomial and its Barrett quotient
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 0x30));
+
+  // Mix in starting register
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(reg));
+
+  data += 64;
+  length -= 64;
+
+  // Fold 4 lanes in parallel
+  while (length >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i*)(data + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i*)(data + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i*)(data + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i*)(data + 0x30)));
+
+    data += 64;
+    length -= 64;
+  }
+
+  // Fold 4 lanes into 1
+  __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Fold any remaining 16-byte lanes
+  while (length >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i*)data)), x5);
+
+    data += 16;
+    length -= 16;
+  }
+
+  // Fold 128 bits to 64 bits
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return _mm_extract_epi32(x1, 1);
+}
+
+// Folds whole 16-byte lanes, then finishes leftover bytes with tables.
+static uint32_t crc32PclmulUpdate(uint32_t reg, const uint8_t* data, uint32_t length)
+{
+  if (length >= crc32PclmulMinLength && crc32PclmulSupported()) {
+    uint32_t foldLength = length & ~15u;
+    reg = crc32FoldUpdate(reg, data, foldLength);
+    data += foldLength;
+    length -= foldLength;
+  }
+  return crc32Slice8Update(reg, data, length);
+}
+
+#endif
+
+// ------- Public API --------
 
 /*
  * CRC-16/Modbus, uses these parameters:
  * Poly    	Init   	RefIn  	RefOut 	XorOut
  * 0x8005 	0xFFFF 	true 	true 	0x0000
  */
-uint16_t crc16(const void* dataArg, uint32_t length)
+uint16_t crc16(const void* data, uint32_t length)
+{
+  return crc16Update(crc16Init, data, length);
+}
+
+// Continues a CRC-16 calculation from a previous register value.
+// There's no xorout step for CRC-16/Modbus, so the register is also the result.
+uint16_t crc16Update(uint16_t reg, const void* data, uint32_t length)
+{
+#if CRC16_SLICES == 4
+  return crc16Slice4Update(reg, (const uint8_t*)data, length);
+#else
+  return crc16BytewiseUpdate(reg, (const uint8_t*)data, length);
+#endif
+}
+
+// Original shift/xor version. Kept as a reference for testing.
+uint16_t crc16Bitwise(const void* dataArg, uint32_t length)
 {
   uint16_t reg = -1;
   uint8_t* data = (uint8_t*)dataArg;
@@ -43,12 +355,22 @@ uint16_t crc16(const void* dataArg, uint32_t length)
       reg >>= 1;
       // Using inverted 0x8005
       if (lsb)
-        reg ^= 0xA001;
+        reg ^= crc16ReversedPoly;
     }
   }
   return reg;
 }
 
+uint16_t crc16Bytewise(const void* data, uint32_t length)
+{
+  return crc16BytewiseUpdate(crc16Init, (const uint8_t*)data, length);
+}
+
+uint16_t crc16Slice4(const void* data, uint32_t length)
+{
+  return crc16Slice4Update(crc16Init, (const uint8_t*)data, length);
+}
+
 /*
  * CRC-32, uses these parameters:
  * Poly    	    Init   	    RefIn  	RefOut 	XorOut
@@ -57,7 +379,28 @@ uint16_t crc16(const void* dataArg, uint32_t length)
  * Could skip xorout step to get JAMCRC,
  * same level of integrity, but may mismatch hardware CRC.
  */
-uint32_t crc32(const void* dataArg, uint32_t length)
+uint32_t crc32(const void* data, uint32_t length)
+{
+  return ~crc32Update(crc32Init, data, length);
+}
+
+// Continues a CRC-32 calculation from a previous register value.
+// Returns the new register value, which still needs the xorout step.
+uint32_t crc32Update(uint32_t reg, const void* data, uint32_t length)
+{
+#if defined(CRC32_PCLMUL)
+  return crc32PclmulUpdate(reg, (const uint8_t*)data, length);
+#elif CRC32_SLICES == 8
+  return crc32Slice8Update(reg, (const uint8_t*)data, length);
+#elif CRC32_SLICES == 4
+  return crc32Slice4Update(reg, (const uint8_t*)data, length);
+#else
+  return crc32BytewiseUpdate(reg, (const uint8_t*)data, length);
+#endif
+}
+
+// Original shift/xor version. Kept as a reference for testing.
+uint32_t crc32Bitwise(const void* dataArg, uint32_t length)
 {
   uint32_t reg = -1;
   uint8_t* data = (uint8_t*)dataArg;
@@ -70,9 +413,43 @@ uint32_t crc32(const void* dataArg, uint32_t length)
       reg >>= 1;
       // Using inverted 0x04C11DB7
       if (lsb)
-        reg ^= 0xEDB88320;
+        reg ^= crc32ReversedPoly;
     }
   }
   // return reg; // no xorout step
   return ~reg; // with full xorout/inversion step
 }
+
+uint32_t crc32Bytewise(const void* data, uint32_t length)
+{
+  return ~crc32BytewiseUpdate(crc32Init, (const uint8_t*)data, length);
+}
+
+uint32_t crc32Slice4(const void* data, uint32_t length)
+{
+  return ~crc32Slice4Update(crc32Init, (const uint8_t*)data, length);
+}
+
+uint32_t crc32Slice8(const void* data, uint32_t length)
+{
+  return ~crc32Slice8Update(crc32Init, (const uint8_t*)data, length);
+}
+
+#if defined(CRC32_PCLMUL)
+uint32_t crc32Pclmul(const void* data, uint32_t length)
+{
+  return ~crc32PclmulUpdate(crc32Init, (const uint8_t*)data, length);
+}
+#endif
+
+// ------- Streaming --------
+
+void Crc16Stream::update(const void* data, uint32_t length)
+{
+  reg = crc16Update(reg, data, length);
+}
+
+void Crc32Stream::update(const void* data, uint32_t length)
+{
+  reg = crc32Update(reg, data, length);
+}
@@ -7,6 +7,7 @@
  */
 
 #include "throughput_tasks.h"
+#include "basic.h"
 #include "board_defs.h"
 #include "string.h"
 
@@ -43,9 +44,11 @@ void Producer::func()
 
     util.watchdogKick();
 
-    // copy in a chunk of dummy data
+    // copy in a chunk of dummy data.
+    // Payload length cycles through all sizes to exercise variable-length packets.
     size_t dummyDataOffset = dummyWrap.packet.sequenceNum % (1 + sizeof(dummyData) - sizeof(dummyPkt.payload));
-    memcpy(dummyPkt.payload, dummyData + dummyDataOffset, sizeof(dummyPkt.payload));
+    size_t payloadLen = dummyWrap.packet.sequenceNum % (1 + sizeof(dummyPkt.payload));
+    setDummyPayload(dummyWrap.packet, dummyData + dummyDataOffset, payloadLen);
 
     // Write packet
     LL_GPIO_SetOutputPin(GreenLedPort, GreenLedPin);
@@ -85,14 +88,14 @@ void Consumer::func()
     util.watchdogKick();
 
     // Attempt to fill buffer
-    size_t bytesRead = util.read(target, buf + len, sizeof(buf) - len);
-    len += bytesRead;
+    size_t bytesRead = util.read(target, ring.writePtr(), ring.writeSpace());
+    ring.commitWrite(bytesRead);
 
     // optional logging of additional info
     // util.logln("%s read %d bytes", pcTaskGetName(task.handle), bytesRead);
 
     // Attempt to parse packets
-    len = parser.extractPackets(buf, len);
+    parser.extractPackets(ring);
   }
 }
 
@@ -175,3 +178,87 @@ void ConsumerUsb::func()
     util.logln("%d total bytes over USB", byteCt);
   }
 }
+
+// ------ StreamProducer ---------
+
+StreamProducer::StreamProducer( //
+  const char* name,
+  Writable& target,
+  TaskUtilitiesArg& utilArg,
+  UBaseType_t priority)
+  : target{ target }
+  , util{ utilArg }
+  , task{ name, funcWrapper, this, priority }
+{}
+
+void StreamProducer::func()
+{
+  util.watchdogRegisterTask();
+
+  uint8_t next = 0;
+
+  while (1) {
+
+    util.watchdogKick();
+
+    for (size_t i = 0; i < chunkLen; i++) {
+      chunk[i] = next++;
+    }
+
+    // Target may accept a partial chunk
+    size_t written = 0;
+    while (written < chunkLen) {
+      written += util.write(target, chunk + written, chunkLen - written);
+    }
+  }
+}
+
+// ------ StreamConsumer ---------
+
+StreamConsumer::StreamConsumer( //
+  const char* name,
+  Readable& target,
+  TaskUtilitiesArg& utilArg,
+  UBaseType_t priority)
+  : target{ target }
+  , util{ utilArg }
+  , task{ name, funcWrapper, this, priority }
+{}
+
+void StreamConsumer::func()
+{
+  util.watchdogRegisterTask();
+
+  uint32_t bytes = 0;
+  TickType_t start = xTaskGetTickCount();
+
+  while (1) {
+
+    util.watchdogKick();
+
+    size_t len = util.read(target, buf, sizeof(buf));
+    for (size_t i = 0; i < len; i++) {
+      if (buf[i] != expected) {
+        mismatches++;
+        // Resync to received data
+        expected = buf[i];
+      }
+      expected++;
+    }
+    bytes += len;
+
+    if (bytes >= reportBytes) {
+      uint32_t ms = max<uint32_t>(1, (xTaskGetTickCount() - start) * portTICK_PERIOD_MS);
+      // Bytes per ms is about KB/s
+      util.logln( //
+        "%s got %lu bytes in %lu ms, %lu KB/s, %lu mismatches",
+        pcTaskGetName(task.handle),
+        bytes,
+        ms,
+        bytes / ms,
+        mismatches);
+      bytes = 0;
+      start = xTaskGetTickCount();
+    }
+  }
+}
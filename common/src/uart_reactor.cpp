@@ -0,0 +1,52 @@
+/*
+ * See header for notes
+ */
+
+#include "uart_reactor.h"
+#include "catch_errors.h"
+
+// C-style wrapper for task entry point
+void uartReactorFuncWrapper(UartReactor* p)
+{
+  p->func();
+}
+
+UartReactor::UartReactor( //
+  const char* name,
+  TaskUtilitiesArg& utilArg,
+  UBaseType_t priority)
+  : task{ name, uartReactorFuncWrapper, this, priority }
+  , util{ utilArg }
+{}
+
+void UartReactor::add(UartPort& port)
+{
+  if (numPorts == uartReactorMaxPorts) {
+    critical();
+  }
+  port.attachReactor(task.handle, 1u << numPorts);
+  ports[numPorts++] = &port;
+}
+
+void UartReactor::func()
+{
+  for (uint32_t i = 0; i < numPorts; i++) {
+    ports[i]->setupTx();
+  }
+
+  util.watchdogRegisterTask();
+
+  // Check every port on first pass, in case of writes before we started
+  uint32_t bits = ~0;
+
+  while (1) {
+    for (uint32_t i = 0; i < numPorts; i++) {
+      if (bits & (1u << i)) {
+        ports[i]->serviceTx();
+      }
+    }
+
+    // Wait for writes or tx completion on any port
+    bits = util.taskNotifyWait();
+  }
+}
@@ -15,8 +15,6 @@
 
 // ------- Forward declarations --------
 
-void txFuncWrapper(UartTasks* p);
-void rxFuncWrapper(UartTasks* p);
 void dmaTxCallbackWrapper(void* p);
 void dmaRxCallbackWrapper(void* p);
 void uartCallbackWrapper(void* p);
@@ -24,77 +22,188 @@ void uartCallbackWrapper(void* p);
 // ------- API ---------
 
 // Constructor
-UartTasks::UartTasks( //
+UartPort::UartPort( //
   const char* name,
   const UartInfo ui,
   TaskUtilitiesArg& utilArg,
   HalfDuplexCallbacks* halfDuplexCallbacks,
-  UBaseType_t txPriority,
-  UBaseType_t rxPriority)
-  : txTask{ concat(txName, name, "_tx", sizeof(rxName)), txFuncWrapper, this, txPriority }
-  , rxTask{ concat(rxName, name, "_rx", sizeof(rxName)), rxFuncWrapper, this, rxPriority }
-  , ui{ ui }
+  LinkFraming framing,
+  UartRxCoalescing coalescing,
+  UartStorage storage)
+  : name{ name }
+  , txMsgBuf{ storage.txMsgBuf }
+  , txDmaBufs{ storage.txDmaBufs[0], storage.txDmaBufs[1] }
+  , txDmaSize{ storage.txSize }
+  , rxDmaBuf{ storage.rxDmaBuf }
+  , rxDmaSize{ storage.rxSize }
   , txUtil{ utilArg }
   , rxUtil{ utilArg }
   , halfDuplexCallbacks{ halfDuplexCallbacks }
+  , framing{ framing }
+  , ui{ ui }
+  , rxMinBytes{ max<size_t>(1, min(coalescing.minBytes, rxDmaSize / 2)) }
+  , rxMaxDelayTicks{ (TickType_t)(((uint64_t)coalescing.maxDelayUs * configTICK_RATE_HZ + 999'999) / 1'000'000) }
 {
   // Register ISR callbacks
   registerDmaCallback(ui.dmaRxInstNum, ui.dmaRxStream, dmaRxCallbackWrapper, this);
   registerDmaCallback(ui.dmaTxInstNum, ui.dmaTxStream, dmaTxCallbackWrapper, this);
   registerUartCallback(ui.uartNum, uartCallbackWrapper, this);
+
+  // Receive from now on, even before anyone reads
+  startRx();
+}
+
+void UartPort::attachReactor(TaskHandle_t task, uint32_t bit)
+{
+  txNotifyTask = task;
+  txNotifyBits = bit;
+  txViaReactor = true;
 }
 
 // Blocking read and write
 
-size_t UartTasks::read(void* buf, size_t len, TickType_t ticks)
+size_t UartPort::read(void* buf, size_t len, TickType_t ticks)
 {
-  return rxStreamBuf.read(buf, len, ticks);
+  // Register for wakeups before checking for data,
+  // so nothing arriving in between is missed.
+  rxReader = xTaskGetCurrentTaskHandle();
+
+  TimeOut_t timeOut;
+  vTaskSetTimeOutState(&timeOut);
+
+  while (1) {
+    uint32_t laps;
+    uint32_t idx;
+    size_t pending = rxDmaPending(laps, idx);
+
+    if (!pending) {
+      // Have the next rx interrupt wake us regardless of coalescing,
+      // then recheck in case data arrived before that was set.
+      rxAwaitingFirst = true;
+      pending = rxDmaPending(laps, idx);
+    }
+
+    // Time left until held data is due
+    TickType_t holdTicks = portMAX_DELAY;
+
+    if (pending) {
+      rxAwaitingFirst = false;
+      TickType_t now = xTaskGetTickCount();
+      if (!rxHolding) {
+        rxHolding = true;
+        rxFirstTick = now;
+      }
+      TickType_t held = now - rxFirstTick;
+
+      if (pending >= min(len, rxMinBytes) || held >= rxMaxDelayTicks) {
+        size_t numRead = readDma(buf, len);
+        // Anything left over is just as old, so keep holding.
+        // Otherwise, the next byte starts a new delay.
+        rxHolding = numRead && numRead < pending;
+        rxAwaitingFirst = !rxHolding;
+        if (numRead) {
+          return numRead;
+        }
+      } else {
+        holdTicks = rxMaxDelayTicks - held;
+      }
+    }
+
+    if (xTaskCheckForTimeOut(&timeOut, &ticks)) {
+      // Out of time, so hand over whatever is here
+      size_t numRead = readDma(buf, len);
+      rxHolding = numRead && numRead < pending;
+      rxAwaitingFirst = !rxHolding;
+      return numRead;
+    }
+
+    // Wait for HT, TC, or IDLE interrupt, or for held data to be due
+    ulTaskNotifyTake(pdTRUE, min(ticks, holdTicks));
+    countRxWakeup();
+  }
 }
 
-size_t UartTasks::write(const void* buf, size_t len, TickType_t ticks)
+size_t UartPort::write(const void* buf, size_t len, TickType_t ticks)
 {
-  return txMsgBuf.write(buf, len, ticks);
+  size_t written = txMsgBuf.write(buf, len, ticks);
+
+  // A StaticUartTasks tx task waits on txMsgBuf itself,
+  // but a reactor needs to be told which port has data.
+  if (written && txViaReactor) {
+    xTaskNotify(txNotifyTask, txNotifyBits, eSetBits);
+  }
+  return written;
 }
 
 // ---------- Internal details -------------
 
-constexpr uint32_t rxRolloverFlag = 1 << 31;
-
 // C-style wrapper to enable launching C++ class member functions in rtos
 // as task entry points.
-void txFuncWrapper(UartTasks* p)
+void uartTxFuncWrapper(UartPort* p)
 {
   p->txFunc();
 }
-void rxFuncWrapper(UartTasks* p)
-{
-  p->rxFunc();
-}
 
 // Callback wrappers for ISRs
 // Note - these can be modified to remove void pointers and casting,
 // but requires some additional templatizing.
 void dmaTxCallbackWrapper(void* p)
 {
-  ((UartTasks*)p)->dmaTxCallback();
+  ((UartPort*)p)->dmaTxCallback();
 }
 void dmaRxCallbackWrapper(void* p)
 {
-  ((UartTasks*)p)->dmaRxCallback();
+  ((UartPort*)p)->dmaRxCallback();
 }
 void uartCallbackWrapper(void* p)
 {
-  ((UartTasks*)p)->uartCallback();
+  ((UartPort*)p)->uartCallback();
 }
 
 /*
  * Regarding notifications:
- * Note that there are two separate task functions here,
- * so there's no issue with ulTaskNotifyTake clearing the bits
- * upon read. It won't interfere with the other task.
+ * Tx notifications go to the tx task or reactor, and rx notifications go
+ * to whichever task is reading, so there's no issue with
+ * ulTaskNotifyTake clearing the bits upon read.
+ * Rx notifications may arrive before anyone reads, or when the
+ * reader isn't waiting. These just cause an extra check for data.
  */
 
-void UartTasks::dmaTxCallback()
+void UartPort::notifyReader()
+{
+  TaskHandle_t reader = rxReader;
+  if (!reader) {
+    return;
+  }
+
+  // While holding data, reader wakes itself once it's due,
+  // so only wake it early if enough has arrived.
+  // Read position may be stale here, which at worst
+  // causes an extra wakeup or an on-time one.
+  if (rxMinBytes > 1 && !rxAwaitingFirst) {
+    uint32_t laps;
+    uint32_t idx;
+    if (rxDmaPending(laps, idx) < rxMinBytes) {
+      return;
+    }
+  }
+
+  isrTaskNotifyIncrement(reader);
+}
+
+void UartPort::countRxWakeup()
+{
+  rxWakeups++;
+  TickType_t now = xTaskGetTickCount();
+  TickType_t elapsed = now - rxWakeupsSampleTick;
+  if (elapsed >= configTICK_RATE_HZ) {
+    rxWakeupsPerSec = (uint64_t)(rxWakeups - rxWakeupsSampleCount) * configTICK_RATE_HZ / elapsed;
+    rxWakeupsSampleTick = now;
+    rxWakeupsSampleCount = rxWakeups;
+  }
+}
+
+void UartPort::dmaTxCallback()
 {
   // This interrupt should only be enabled in full duplex mode
   if (halfDuplexCallbacks) {
@@ -105,8 +214,8 @@ void UartTasks::dmaTxCallback()
   if (dmaFlagCheckAndClear(ui.dmaTxReg, ui.dmaTxStream, DmaFlag::TC)) {
 
     // Generate signal that we're ready for next message.
-    // The particular bits set in this case is insignificant.
-    isrTaskNotifyBits(txTask.handle, 1);
+    txDone = true;
+    isrTaskNotifyBits(txNotifyTask, txNotifyBits);
 
     // We can rely solely on DMA transfer-complete (no need for UART transfer-complete).
     // Next DMA transfer automatically waits until UART is ready to receive more data.
@@ -119,27 +228,29 @@ void UartTasks::dmaTxCallback()
   }
 }
 
-void UartTasks::dmaRxCallback()
+void UartPort::dmaRxCallback()
 {
   // half transfer
   if (dmaFlagCheckAndClear(ui.dmaRxReg, ui.dmaRxStream, DmaFlag::HT)) {
-    isrTaskNotifyIncrement(rxTask.handle);
+    notifyReader();
   }
 
   // transfer complete
   if (dmaFlagCheckAndClear(ui.dmaRxReg, ui.dmaRxStream, DmaFlag::TC)) {
-    isrTaskNotifyBits(rxTask.handle, rxRolloverFlag);
+    // Note that DMA wrapped around to start of buffer
+    rxDmaLaps = rxDmaLaps + 1;
+    notifyReader();
   }
 }
 
-void UartTasks::uartCallback()
+void UartPort::uartCallback()
 {
   // Check for idle line - a gap in the data that
   // indicates likely end of packet
   if (LL_USART_IsActiveFlag_IDLE(ui.uartReg)) {
     LL_USART_ClearFlag_IDLE(ui.uartReg);
-    // Notify rx task to wake-up and process data
-    isrTaskNotifyIncrement(rxTask.handle);
+    // Notify reader to wake-up and process data
+    notifyReader();
   }
 
   // Only need to handle UART TC in half-duplex mode
@@ -156,21 +267,16 @@ void UartTasks::uartCallback()
       // by rewriting a clear-only version.
       dmaFlagCheckAndClear(ui.dmaTxReg, ui.dmaTxStream, DmaFlag::TC);
 
-      // Indicate to txTask that the transmit has completed,
+      // Indicate to tx task or reactor that the transmit has completed,
       // and that we should go back to listening mode.
-      // The particular bits set in this case is insignificant.
-      isrTaskNotifyBits(txTask.handle, 1);
+      txDone = true;
+      isrTaskNotifyBits(txNotifyTask, txNotifyBits);
     }
   }
 }
 
-void UartTasks::txFunc()
+void UartPort::setupTx()
 {
-  // Additional DMA setup
-
-  // Memory address to copy from - this is always the same buffer for us
-  LL_DMA_SetMemoryAddress(ui.dmaTxReg, ui.dmaTxStream, (uint32_t)txDmaBuf);
-
   // Peripheral address to write to
   LL_DMA_SetPeriphAddress(ui.dmaTxReg, ui.dmaTxStream, (uint32_t)&ui.uartReg->DR);
 
@@ -195,72 +301,134 @@ void UartTasks::txFunc()
 
   // Enable DMA TX in UART
   LL_USART_EnableDMAReq_TX(ui.uartReg);
+}
 
-  txUtil.watchdogRegisterTask();
+void UartPort::startTx(uint8_t* buf, size_t len)
+{
+  // Check if transfer is still in-progress
+  if (LL_DMA_IsEnabledStream(ui.dmaTxReg, ui.dmaTxStream)) {
+    // error, although we shouldn't ever be in this situation
+    error("DMA transfer still in-progress");
+  }
 
-  while (1) {
-    txUtil.watchdogKick();
+  // Configure source and size of this next transfer
+  LL_DMA_SetMemoryAddress(ui.dmaTxReg, ui.dmaTxStream, (uint32_t)buf);
+  LL_DMA_SetDataLength(ui.dmaTxReg, ui.dmaTxStream, len);
 
-    // Wait until new data to send is available on buffer
-    size_t len = txUtil.readAll(txMsgBuf, txDmaBuf, sizeof(txDmaBuf));
+  // Set output mode for half-duplex
+  if (halfDuplexCallbacks) {
+    halfDuplexCallbacks->txMode();
+  }
 
-    // Check if transfer is still in-progress
-    if (LL_DMA_IsEnabledStream(ui.dmaTxReg, ui.dmaTxStream)) {
-      // error, although we shouldn't ever be in this situation
-      error("DMA transfer still in-progress");
-    }
+  UartTxDbgPinHigh();
 
-    // Configure size of this next transfer
-    LL_DMA_SetDataLength(ui.dmaTxReg, ui.dmaTxStream, len);
+  // Start transfer
+  LL_DMA_EnableStream(ui.dmaTxReg, ui.dmaTxStream);
+}
 
-    // Set output mode for half-duplex
+void UartPort::serviceTx()
+{
+  // Previous transfer finished.
+  // In half-duplex mode, switch back to input right away
+  // so that replies aren't missed.
+  if (txInFlight && txDone) {
+    txDone = false;
+    txInFlight = false;
     if (halfDuplexCallbacks) {
-      halfDuplexCallbacks->txMode();
+      halfDuplexCallbacks->rxMode();
     }
+    UartTxDbgPinLow();
+  }
 
-    UartTxDbgPinHigh();
+  stageTx();
 
-    // Start transfer
-    LL_DMA_EnableStream(ui.dmaTxReg, ui.dmaTxStream);
+  if (txStagedLen && !txInFlight) {
+    startTx(txDmaBufs[txNext], txStagedLen);
+    txInFlight = true;
+    txStagedLen = 0;
+    txNext ^= 1;
 
-    // Wait until UART transmit or DMA transfer is complete.
+    // Start on the next batch, in case more is already waiting
+    stageTx();
+  }
+}
 
-    // In half-duplex mode we wait for for a signal from the UART ISR
-    // that the UART transmit is complete.
+void UartPort::stageTx()
+{
+  // Frame any waiting messages into the buffer that's not in use.
+  // This overlaps with any transfer still in progress.
+  txStagedLen = txUtil.appendAllFramed( //
+    txMsgBuf,
+    txDmaBufs[txNext],
+    txStagedLen,
+    txDmaSize,
+    framing);
+}
+
+void UartPort::txFunc()
+{
+  // Additional DMA setup
+  setupTx();
 
-    // In full-duplex mode, we can avoid this unnecessary extra
-    // delay (~170 uS @ 115200 baud), and wait for the earlier signal
-    // from the DMA ISR that the transfer has completed. This means
-    // that we can initiate the next dma transfer, even while UART is
-    // still busy sending out bits, so there are no unnecessary gaps
-    // in data output.
+  txUtil.watchdogRegisterTask();
 
-    // Clear notification value upon receipt and block forever.
-    txUtil.taskNotifyTake(pdTRUE);
+  // Which of txDmaBufs to fill next
+  uint32_t next = 0;
 
-    // Set input mode for half-duplex
+  // Whether a transfer was started and not yet waited on
+  bool inFlight = false;
+
+  while (1) {
+    txUtil.watchdogKick();
+
+    // Wait until new data to send is available on buffer.
+    // Data is framed directly in the DMA buffer that's not in use,
+    // so this overlaps with any transfer still in progress.
+    uint8_t* dmaBuf = txDmaBufs[next];
+    size_t len = txUtil.readAllFramed(txMsgBuf, dmaBuf, txDmaSize, framing);
+
+    // Wait until previous DMA transfer is complete.
+    // This signal from the DMA ISR arrives while the UART is still
+    // sending out the last byte, so the next transfer follows with
+    // no gap in data output.
+    if (inFlight) {
+      // Clear notification value upon receipt and block forever.
+      txUtil.taskNotifyTake(pdTRUE);
+      UartTxDbgPinLow();
+
+      // Top up with anything written while we were waiting,
+      // so this batch keeps growing until the DMA is free.
+      len = txUtil.appendAllFramed(txMsgBuf, dmaBuf, len, txDmaSize, framing);
+    }
+
+    startTx(dmaBuf, len);
+    inFlight = true;
+    next ^= 1;
+
+    // In half-duplex mode we wait for for a signal from the UART ISR
+    // that the UART transmit is complete, and then switch back to
+    // input mode right away so that replies aren't missed.
+    // So there's no overlap in this mode.
     if (halfDuplexCallbacks) {
+      txUtil.taskNotifyTake(pdTRUE);
       halfDuplexCallbacks->rxMode();
       // txUtil.logln("%s enabled rx", pcTaskGetName(txTask.handle));
+      UartTxDbgPinLow();
+      inFlight = false;
     }
-
-    UartTxDbgPinLow();
   }
 }
 
 /*
- * Finishes DMA RX setup, then listens for whenever there's new data to
- * copy from the DMA memory destination to the rtos stream buffer.
- * Note that DMA RX is setup for circular mode, so it is this function's
- * job to keep up with copying to avoid being lapped by DMA overwrites.
- * ISR-based notifications to this function are:
+ * Finishes DMA RX setup.
+ * Note that DMA RX is setup for circular mode, so it is the reader's
+ * job to keep up to avoid being lapped by DMA overwrites.
+ * ISR-based notifications to the reader are:
  * - DMA half-transfer and transfer-complete: HT TC
  * - UART idle line
  */
-void UartTasks::rxFunc()
+void UartPort::startRx()
 {
-  // Additional DMA and UART setup
-
   // point to peripheral address to read from
   LL_DMA_SetPeriphAddress(ui.dmaRxReg, ui.dmaRxStream, (uint32_t)&ui.uartReg->DR);
 
@@ -268,7 +436,7 @@ void UartTasks::rxFunc()
   LL_DMA_SetMemoryAddress(ui.dmaRxReg, ui.dmaRxStream, (uint32_t)rxDmaBuf);
 
   // setup size of memory destination
-  LL_DMA_SetDataLength(ui.dmaRxReg, ui.dmaRxStream, sizeof(rxDmaBuf));
+  LL_DMA_SetDataLength(ui.dmaRxReg, ui.dmaRxStream, rxDmaSize);
 
   // enable transfer-complete interrupt
   LL_DMA_EnableIT_TC(ui.dmaRxReg, ui.dmaRxStream);
@@ -284,79 +452,70 @@ void UartTasks::rxFunc()
 
   // Enable DMA stream
   LL_DMA_EnableStream(ui.dmaRxReg, ui.dmaRxStream);
+}
 
-  // Keeps track of our stopping point in the buffer from last time.
-  uint32_t oldIdx = 0;
-
-  // Tracks the difference in the number of times the DMA buffer rolls over.
-  // This lets us check if we're not grabbing data from DMA fast enough.
-  // We expect to see this value alternate between -1 and 0.
-  // Positive values indicate data loss.
-  // todo - this might be better to as object member for easier logging.
-  // - Moving all locals to private members will reduce stack usage.
-  // - Unfortunately, private members expand scope. There's no way to have
-  //   per-instance static variables with function scope.
-  int32_t lostBuffers = 0;
-
-  rxUtil.watchdogRegisterTask();
-
-  while (1) {
+size_t UartPort::rxDmaPending(uint32_t& laps, uint32_t& idx)
+{
+  // Lap count must match DMA position, so retry if
+  // TC interrupt lands in between reading these.
+  do {
+    laps = rxDmaLaps;
+    idx = rxDmaSize - LL_DMA_GetDataLength(ui.dmaRxReg, ui.dmaRxStream);
+  } while (laps != rxDmaLaps);
+
+  // Data length may briefly read zero before reloading
+  if (idx == rxDmaSize) {
+    idx = 0;
+  }
 
-    rxUtil.watchdogKick();
+  // DMA wrapped around, but TC interrupt hasn't run yet
+  if (laps == rxReadLaps && idx < rxReadIdx) {
+    laps++;
+  }
 
-    // Wait until it's time to read from DMA
+  return (laps - rxReadLaps) * rxDmaSize + idx - rxReadIdx;
+}
 
-    // Clear notification value upon receipt and block forever
-    uint32_t notifyValue = rxUtil.taskNotifyTake(pdTRUE);
+size_t UartPort::readDma(void* buf, size_t len)
+{
+  uint32_t laps;
+  uint32_t idx;
+  size_t pending = rxDmaPending(laps, idx);
+  size_t numRead = 0;
 
+  if (pending <= rxDmaSize) {
     UartRxDbgPinHigh();
 
-    // Figure out where we are in the buffer
-    uint32_t newIdx = sizeof(rxDmaBuf) - LL_DMA_GetDataLength(ui.dmaRxReg, ui.dmaRxStream);
-
-    // rxUtil.logln("%s got rx data to index %lu", pcTaskGetName(rxTask.handle), newIdx);
-
-    if (newIdx > oldIdx) {
-      // New data
-
-      // Wait forever to write
-      rxUtil.write(rxStreamBuf, rxDmaBuf + oldIdx, newIdx - oldIdx);
-
-    } else if (newIdx < oldIdx) {
-      // New data with rollover - needs two separate writes
-
-      // Write everything until the end of the buffer
-      rxUtil.write(rxStreamBuf, rxDmaBuf + oldIdx, sizeof(rxDmaBuf) - oldIdx);
-
-      // If we respond quickly to the TC interrupt, then there will be no
-      // rollover data written, so this following packet will be of length 0.
-      // FreeRTOS asserts when attempting to write a packet of length 0,
-      // so we'll skip this unnecessary (and problematic) write.
-      if (newIdx > 0) // check if there's any rollover data to write.
-      {
-        // Write the next chunk at the beginning of the buffer
-        rxUtil.write(rxStreamBuf, rxDmaBuf, newIdx);
-      }
-
-      // Note that we handled a rollover
-      lostBuffers--;
-
-    } else {
-      // This means we got a notification, even though nothing was written.
-      // This can happen if end of latest packet stops exactly at the end or
-      // midpoint of the buffer, since will get a TC or HT notification, and then
-      // and IDLE line notification.
-      // So there's nothing we need to do here.
-    }
+    // Copy, in two parts if wrapping around end of buffer
+    numRead = min(len, pending);
+    size_t first = min(numRead, rxDmaSize - rxReadIdx);
+    memcpy(buf, rxDmaBuf + rxReadIdx, first);
+    memcpy((uint8_t*)buf + first, rxDmaBuf, numRead - first);
 
     UartRxDbgPinLow();
 
-    oldIdx = newIdx;
+    // DMA may have lapped us while copying
+    pending = rxDmaPending(laps, idx);
+  }
 
-    // Check if we got a special notification value which indicates that DMA got to the end of the write
-    // buffer and rolled over.
-    if (notifyValue >= rxRolloverFlag) {
-      lostBuffers++;
-    }
+  if (pending > rxDmaSize) {
+    // Data was overwritten before we could read it.
+    // Skip to where DMA is now, and drop whatever we copied.
+    rxOverruns++;
+    rxUtil.warnln( //
+      "%s rx overrun, lost at least %lu bytes",
+      name,
+      (uint32_t)(pending - rxDmaSize));
+    nonCritical();
+    rxReadLaps = laps;
+    rxReadIdx = idx;
+    return 0;
+  }
+
+  rxReadIdx += numRead;
+  if (rxReadIdx >= rxDmaSize) {
+    rxReadIdx -= rxDmaSize;
+    rxReadLaps++;
   }
+  return numRead;
 }
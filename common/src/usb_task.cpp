@@ -1,13 +1,14 @@
 /*
  * Wrapper for a USB instance.
  * Provides read() and write() interfaces.
- * Statically allocates one tx task and two stream buffers.
- * Rx is interrupt-based.
+ * Statically allocates one tx task and one message buffer.
+ * Rx is interrupt-based, into a pool of endpoint buffers.
  */
 
 #include "usb_task.h"
 #include "board_defs.h"
 #include "catch_errors.h"
+#include "basic.h"
 #include "itm_logging.h"
 #include "usbd_core.h"
 #include "usbd_desc.h"
@@ -55,9 +56,11 @@ void txFuncWrapper(UsbTask* p)
 // Constructor
 UsbTask::UsbTask( //
   TaskUtilitiesArg& utilArg,
+  LinkFraming framing,
   UBaseType_t priority)
   : txTask{ "usb_tx", txFuncWrapper, this, priority }
   , callbacks{ initWrap, deInitWrap, controlWrap, receiveWrap, transmitCpltWrap }
+  , framing{ framing }
   , util{ utilArg }
 {
   if (singleton != nullptr) {
@@ -85,7 +88,21 @@ UsbTask::UsbTask( //
 
 size_t UsbTask::read(void* buf, size_t len, TickType_t ticks)
 {
-  return rxMsgBuf.read(buf, len, ticks);
+  // Register for wakeups before checking for data,
+  // so nothing arriving in between is missed.
+  rxReader = xTaskGetCurrentTaskHandle();
+
+  TimeOut_t timeOut;
+  vTaskSetTimeOutState(&timeOut);
+
+  while (1) {
+    size_t numRead = readSlots(buf, len);
+    if (numRead || xTaskCheckForTimeOut(&timeOut, &ticks)) {
+      return numRead;
+    }
+    // Wait for receiveCb
+    ulTaskNotifyTake(pdTRUE, ticks);
+  }
 }
 
 size_t UsbTask::write(const void* buf, size_t len, TickType_t ticks)
@@ -95,19 +112,82 @@ size_t UsbTask::write(const void* buf, size_t len, TickType_t ticks)
 
 // ---------- Internal details -------------
 
+void UsbTask::armRx()
+{
+  if (rxFilled - rxConsumed < usbRxSlots) {
+    USBD_CDC_SetRxBuffer(&usbDeviceHandle, rxSlots[rxFilled % usbRxSlots]);
+    USBD_CDC_ReceivePacket(&usbDeviceHandle);
+  } else {
+    // Leave endpoint unarmed, so host is NAKed.
+    // Reader re-arms once it frees a slot.
+    rxStalled = true;
+    rxStalls++;
+  }
+}
+
+size_t UsbTask::readSlots(void* buf, size_t len)
+{
+  uint8_t* out = (uint8_t*)buf;
+  size_t copied = 0;
+
+  // Read across as many slots as fit
+  while (copied < len && rxConsumed != rxFilled) {
+    uint32_t slot = rxConsumed % usbRxSlots;
+    size_t n = min(len - copied, rxLens[slot] - rxSlotOffset);
+    memcpy(out + copied, rxSlots[slot] + rxSlotOffset, n);
+    copied += n;
+    rxSlotOffset += n;
+
+    if (rxSlotOffset == rxLens[slot]) {
+      // Slot is empty, so free it
+      rxSlotOffset = 0;
+      rxConsumed++;
+
+      // Resume receiving if ISR ran out of slots.
+      // USB ISR is masked, so it can't arm at the same time.
+      taskENTER_CRITICAL();
+      if (rxStalled) {
+        rxStalled = false;
+        armRx();
+      }
+      taskEXIT_CRITICAL();
+    }
+  }
+
+  return copied;
+}
+
 void UsbTask::txFunc()
 {
   util.watchdogRegisterTask();
 
+  uint32_t next = 0;     // which of txBufs to stage into
+  size_t carry = 0;      // bytes already staged in txBufs[next]
+  bool inFlight = false; // whether a transfer was started and not yet waited on
+
   while (1) {
 
     util.watchdogKick();
 
-    // Wait until new data to send is available on buffer
-    txLen = util.readAll(txMsgBuf, txBuf, sizeof(txBuf));
+    // Link is about to go idle, so finish the last transfer rather than
+    // leave its completion pending until more data shows up.
+    // A transfer that fills its last packet needs a zero-length packet to
+    // end it, but USBD_CDC_DataIn already sends one and only calls
+    // transmitCpltCb after that, so nothing extra is needed here.
+    if (inFlight && !carry && !txMsgBuf.nextLengthBytes()) {
+      waitTransmit(nullptr, 0);
+      inFlight = false;
+    }
+
+    // Stage next batch into idle buffer.
+    // Only waits for new data if nothing is staged yet.
+    uint8_t* buf = txBufs[next];
+    size_t len = carry ? util.appendAllFramed(txMsgBuf, buf, carry, sizeof(txBufs[next]), framing)
+                       : util.readAllFramed(txMsgBuf, buf, sizeof(txBufs[next]), framing);
+    carry = 0;
 
     // Don't attempt to transmit if there's no data to transmit
-    if (!txLen) {
+    if (!len) {
       continue;
     }
 
@@ -119,49 +199,88 @@ void UsbTask::txFunc()
       continue;
     }
 
-    // Check if transfer is still in-progress
-    while (((USBD_CDC_HandleTypeDef*)(usbDeviceHandle.pClassData))->TxState != 0) {
-      // USB busy - this should not happen if notifications are setup correctly
-      error("USB unexpectedly busy");
-      // util.warnln("USB unexpectedly busy");
-      // osDelay(1);
+    // Keep staging while previous transfer is in flight
+    if (inFlight) {
+      len = waitTransmit(buf, len);
     }
 
-    // Setup transmit
-    USBD_CDC_SetTxBuffer(&usbDeviceHandle, txBuf, txLen);
-
-    // USBD_CDC_TransmitPacket just starts the transmit.
-    // We need to then wait for transmitCpltCb callback to be called,
-    // which then notifies this task that the transmit has completed.
-    uint8_t txResult;
-    while ((txResult = USBD_CDC_TransmitPacket(&usbDeviceHandle)) != USBD_OK) {
-      // report error
-      util.warnln("USB failed to initiate transmit %d", txResult);
-      osDelay(1);
+    // If more data is waiting, only send whole packets, and carry the
+    // remainder over to the other buffer as the start of the next transfer.
+    size_t partial = len % usbTxPacketSize;
+    if (partial && len > usbTxPacketSize && txMsgBuf.nextLengthBytes()) {
+      len -= partial;
+      memcpy(txBufs[next ^ 1], buf + len, partial);
+      carry = partial;
     }
 
-    // Log pending bytes counter via ITM
-    txPendingTotal += txLen;
-    itmSendValue(ItmPort::UsbBytesOutPending, txPendingTotal);
-
-    // Wait until transfer is complete.
-    // Will be signaled from transmitCpltCb ISR.
-    // Clear notification value upon receipt.
-    // Timeout occasionally for easier detection of this stall
-    // location during debugging.
-    uint32_t bytesSent;
-    while (!(bytesSent = ulTaskNotifyTake(pdTRUE, suggestedTimeoutTicks))) {
+    startTransmit(buf, len);
+    inFlight = true;
+    next ^= 1;
+  }
+}
+
+void UsbTask::startTransmit(uint8_t* buf, size_t len)
+{
+  // Check if transfer is still in-progress
+  while (((USBD_CDC_HandleTypeDef*)(usbDeviceHandle.pClassData))->TxState != 0) {
+    // USB busy - this should not happen if notifications are setup correctly
+    error("USB unexpectedly busy");
+    // util.warnln("USB unexpectedly busy");
+    // osDelay(1);
+  }
+
+  // Setup transmit
+  txLen = len;
+  USBD_CDC_SetTxBuffer(&usbDeviceHandle, buf, len);
+
+  // USBD_CDC_TransmitPacket just starts the transmit.
+  // We need to then wait for transmitCpltCb callback to be called,
+  // which then notifies this task that the transmit has completed.
+  uint8_t txResult;
+  while ((txResult = USBD_CDC_TransmitPacket(&usbDeviceHandle)) != USBD_OK) {
+    // report error
+    util.warnln("USB failed to initiate transmit %d", txResult);
+    osDelay(1);
+  }
+
+  // Log pending bytes and transfer counters via ITM.
+  // Bytes per transfer shows how well transfers are batched,
+  // since each one costs an interrupt and a task wakeup.
+  txPendingTotal += len;
+  itmSendValue(ItmPort::UsbBytesOutPending, txPendingTotal);
+  txTransfersTotal++;
+  itmSendValue(ItmPort::UsbTransfersOut, txTransfersTotal);
+}
+
+size_t UsbTask::waitTransmit(uint8_t* buf, size_t len)
+{
+  // Wait until transfer is complete.
+  // Will be signaled from transmitCpltCb ISR.
+  // Clear notification value upon receipt.
+  // Wakes every tick to keep staging, and times out occasionally
+  // for easier detection of this stall location during debugging.
+  uint32_t bytesSent;
+  TickType_t waited = 0;
+  while (!(bytesSent = ulTaskNotifyTake(pdTRUE, 1))) {
+    if (buf) {
+      len = util.appendAllFramed(txMsgBuf, buf, len, sizeof(txBufs[0]), framing);
+    }
+    if (++waited >= suggestedTimeoutTicks) {
       util.watchdogKick();
       timeout();
+      waited = 0;
     }
-    if (bytesSent != txLen) {
-      util.warnln("Only sent %d of %d bytes", bytesSent, txLen);
-    }
+  }
 
-    // Log transmitted bytes counter via ITM
-    txTransmittedTotal += bytesSent;
-    itmSendValue(ItmPort::UsbBytesOutTransmitted, txTransmittedTotal);
+  if (bytesSent != txLen) {
+    util.warnln("Only sent %d of %d bytes", bytesSent, txLen);
   }
+
+  // Log transmitted bytes counter via ITM
+  txTransmittedTotal += bytesSent;
+  itmSendValue(ItmPort::UsbBytesOutTransmitted, txTransmittedTotal);
+
+  return len;
 }
 
 // ---- Callbacks -----
@@ -173,9 +292,16 @@ void UsbTask::txFunc()
  */
 int8_t UsbTask::initCb(void)
 {
-  // Set buffers
-  USBD_CDC_SetTxBuffer(&usbDeviceHandle, txBuf, 0);
-  USBD_CDC_SetRxBuffer(&usbDeviceHandle, rxBuf);
+  // Set buffers.
+  // The driver arms rx after this returns, so there must be somewhere
+  // to receive into, even if the reader hasn't freed any slots yet.
+  USBD_CDC_SetTxBuffer(&usbDeviceHandle, txBufs[0], 0);
+  if (rxFilled - rxConsumed < usbRxSlots) {
+    USBD_CDC_SetRxBuffer(&usbDeviceHandle, rxSlots[rxFilled % usbRxSlots]);
+  } else {
+    USBD_CDC_SetRxBuffer(&usbDeviceHandle, rxSpare);
+  }
+  rxStalled = false;
   return USBD_OK;
 }
 
@@ -222,62 +348,31 @@ int8_t UsbTask::receiveCb(uint8_t* buf, uint32_t* len)
 {
   UsbRxPinHigh();
 
-  // Performing a copy in here is somewhat sub-optimal for an ISR.
-  // We could do ping-pong buffers (or similar for improved performance).
-  // Made this a lower priority (higher number) ISR to compensate.
+  // Data was received directly into a slot, so there's nothing to copy here.
 
-  // Also, logging to ITM has potential to block, but shouldn't,
+  // Logging to ITM has potential to block, but shouldn't,
   // unless this same callback happened within 10uS (unlikely).
-  // Todo - should still move this to tx task once that becomes
-  // non-blocking with watchdog additions.
 
   // Log received bytes counter via ITM
   rxReceivedTotal += *len;
   itmSendValue(ItmPort::UsbBytesIn, rxReceivedTotal);
 
-  // Check how much data we can copy into the stream buffer
-  size_t spaces = xStreamBufferSpacesAvailable(rxMsgBuf.handle);
-  if (spaces == 0) {
-    // No space. Do nothing and allow data to drop.
-    // Note that USBD_CDC_ReceivePacket must still be called,
-    // otherwise incoming USB data will be blocked after 16 drops
-    // stall all endpoints.
-    // nonCritical();
+  if (buf == rxSpare) {
+    // Driver re-initialized while all slots were full. Drop this data.
+    nonCritical();
   } else {
-    // Space available
-
-    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-
-    if (spaces < *len) {
-      // Not enough space, but copy as much as we can.
-      // Going to lose some data, but not as bad as locking-up system.
-      xStreamBufferSendFromISR(rxMsgBuf.handle, buf, spaces, &xHigherPriorityTaskWoken);
-
-      // May achieve better packet parsing performance (and overall higher data rates)
-      // by eliminating the above line to avoid writing packet fragments that will
-      // definitely fail parsing. Downside of no partial write is that we could
-      // miss out on any whole packets contained within the partial write.
-
-      // nonCritical();
-    } else {
-// plenty of space, copy all of it
-#if 1
-      xStreamBufferSendFromISR(rxMsgBuf.handle, buf, *len, &xHigherPriorityTaskWoken);
-#else
-      // artificial data loss - occasionally drop the last few bytes
-      static uint32_t ndrop = 0;
-      ndrop++;
-      ndrop %= 4;
-      xStreamBufferSendFromISR(rxMsgBuf.handle, buf, *len - ndrop, &xHigherPriorityTaskWoken);
-#endif
-    }
+    // Hand slot to reader
+    rxLens[rxFilled % usbRxSlots] = *len;
+    rxFilled++;
 
-    // If another task was waiting on data, then trigger context switch
-    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+    TaskHandle_t reader = rxReader;
+    if (reader) {
+      isrTaskNotifyIncrement(reader);
+    }
   }
 
-  // Request next packet.
-  USBD_CDC_ReceivePacket(&usbDeviceHandle);
+  // Request next packet, if there's somewhere to put it.
+  armRx();
 
   UsbRxPinLow();
 
@@ -312,7 +407,7 @@ int8_t UsbTask::transmitCpltCb(uint8_t* buf, uint32_t* len, uint8_t epnum)
   if (*len == txLen) {
     // We were able to transmit everything.
   } else if (*len == 0) {
-    // Zero bytes - shouldn't happen
+    // Zero bytes, but we sent data - shouldn't happen
     critical();
   } else {
     // We couldn't transmit everything.
@@ -0,0 +1,12 @@
+COMPONENT_NAME=binaryLog
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/binary_log.cpp \
+  $(PROJECT_SRC_DIR)/cobs.cpp \
+  $(PROJECT_SRC_DIR)/packet_utils.cpp \
+  $(PROJECT_SRC_DIR)/software_crc.cpp \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_binaryLog.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
@@ -0,0 +1,9 @@
+COMPONENT_NAME=cobs
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/cobs.cpp \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_cobs.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
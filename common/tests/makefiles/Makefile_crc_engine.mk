@@ -0,0 +1,10 @@
+COMPONENT_NAME=crc_engine
+
+SRC_FILES = \
+  $(PROJECT_SRC_DIR)/crc_engine.cpp \
+  $(PROJECT_SRC_DIR)/software_crc.cpp \
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_crc_engine.cpp
+
+include $(CPPUTEST_MAKFILE_INFRA)
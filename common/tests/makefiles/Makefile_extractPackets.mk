@@ -1,6 +1,7 @@
 COMPONENT_NAME=extractPackets
 
 SRC_FILES = \
+  $(PROJECT_SRC_DIR)/cobs.cpp \
   $(PROJECT_SRC_DIR)/packet_utils.cpp \
   $(PROJECT_SRC_DIR)/software_crc.cpp \
 
@@ -0,0 +1,12 @@
+COMPONENT_NAME=spscRing
+
+# Header-only
+SRC_FILES =
+
+TEST_SRC_FILES = \
+  $(UNITTEST_SRC_DIR)/test_spscRing.cpp
+
+# Stress test runs producer and consumer threads
+CPPUTEST_ADDITIONAL_LDFLAGS = -pthread
+
+include $(CPPUTEST_MAKFILE_INFRA)
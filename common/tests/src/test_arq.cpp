@@ -0,0 +1,388 @@
+#include "CppUTest/TestHarness.h"
+
+#include "arq.h"
+#include "packet_utils.h"
+#include <deque>
+#include <string.h>
+#include <vector>
+
+TEST_GROUP(TestArq){ void setup(){} void teardown(){} };
+
+// Data packet carrying its index in the frequency field
+static Packet dataPacket(uint32_t index)
+{
+  Packet packet;
+  initializePacket(packet, PacketID::VfdSetFrequency);
+  packet.origin = PacketOrigin::HostToTarget;
+  packet.body.vfdSetFrequency.frequency = index;
+  return packet;
+}
+
+static void checkInOrder(ArqReceiver& receiver, uint32_t first, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    const Packet* packet = receiver.nextInOrder();
+    CHECK(packet);
+    LONGS_EQUAL(first + i, packet->body.vfdSetFrequency.frequency);
+  }
+  CHECK(!receiver.nextInOrder());
+}
+
+TEST(TestArq, test_ack_bits)
+{
+  ArqSender sender;
+  ArqReceiver receiver;
+  sender.timeoutTicks = 10;
+
+  // Send 5, but 2 and 5 are lost
+  Packet sent[6];
+  for (uint32_t i = 1; i <= 5; i++) {
+    sent[i] = dataPacket(i);
+    sender.send(sent[i], 0);
+    LONGS_EQUAL(i, sent[i].sequenceNum);
+  }
+  LONGS_EQUAL(5, sender.inFlight());
+
+  CHECK(receiver.receive(sent[1]));
+  checkInOrder(receiver, 1, 1);
+  CHECK(receiver.receive(sent[3]));
+  CHECK(receiver.receive(sent[4]));
+  checkInOrder(receiver, 0, 0);
+
+  ArqAck ack = receiver.ack();
+  LONGS_EQUAL(2, ack.nextSeq);
+  LONGS_EQUAL(0x3, ack.selective);
+
+  // 2 was skipped over, so is resent right away.
+  // 5 was sent after everything acked, so waits for timeout.
+  sender.processAck(ack);
+  LONGS_EQUAL(4, sender.inFlight());
+  const Packet* resend = sender.nextRetransmit(1);
+  CHECK(resend);
+  LONGS_EQUAL(2, resend->sequenceNum);
+  CHECK(!sender.nextRetransmit(1));
+  resend = sender.nextRetransmit(10);
+  CHECK(resend);
+  LONGS_EQUAL(5, resend->sequenceNum);
+  CHECK(!sender.nextRetransmit(10));
+  LONGS_EQUAL(2, sender.retransmits);
+
+  // Duplicates are dropped
+  CHECK(!receiver.receive(sent[3]));
+  CHECK(!receiver.receive(sent[1]));
+  LONGS_EQUAL(2, receiver.duplicates);
+
+  CHECK(receiver.receive(sent[2]));
+  CHECK(receiver.receive(sent[5]));
+  checkInOrder(receiver, 2, 4);
+
+  sender.processAck(receiver.ack());
+  LONGS_EQUAL(0, sender.inFlight());
+  CHECK(!sender.nextRetransmit(100));
+
+  // Stale ack is ignored
+  sender.processAck(ack);
+  LONGS_EQUAL(0, sender.inFlight());
+}
+
+TEST(TestArq, test_window)
+{
+  ArqSender sender;
+  ArqReceiver receiver;
+
+  Packet packet = dataPacket(0);
+  for (uint32_t i = 0; i < arqWindowSize; i++) {
+    CHECK(sender.canSend());
+    sender.send(packet, 0);
+  }
+  CHECK(!sender.canSend());
+
+  packet.sequenceNum = 1;
+  CHECK(receiver.receive(packet));
+
+  // End of window uses the last selective bit
+  packet.sequenceNum = arqWindowSize;
+  CHECK(receiver.receive(packet));
+  LONGS_EQUAL(1, receiver.ack().nextSeq);
+  LONGS_EQUAL(1u << (arqWindowSize - 2), receiver.ack().selective);
+}
+
+TEST(TestArq, test_restart)
+{
+  ArqSender sender;
+  ArqReceiver receiver;
+  Packet packet = dataPacket(0);
+
+  // New receiver syncs to sender that's already running
+  packet.sequenceNum = 100;
+  CHECK(receiver.receive(packet));
+  checkInOrder(receiver, 0, 1);
+  LONGS_EQUAL(101, receiver.ack().nextSeq);
+
+  // Ack from before restart is ignored by sender
+  sender.processAck(receiver.ack());
+  sender.send(packet, 0);
+  LONGS_EQUAL(1, packet.sequenceNum);
+  LONGS_EQUAL(1, sender.inFlight());
+
+  // Restarted sender's packet 1 resyncs receiver
+  packet.body.vfdSetFrequency.frequency = 1;
+  CHECK(receiver.receive(packet));
+  checkInOrder(receiver, 1, 1);
+  LONGS_EQUAL(2, receiver.ack().nextSeq);
+  sender.processAck(receiver.ack());
+  LONGS_EQUAL(0, sender.inFlight());
+
+  // Exchange a few more packets, so receiver is only a little way in
+  for (uint32_t i = 2; i <= 10; i++) {
+    packet = dataPacket(i);
+    sender.send(packet, 0);
+    CHECK(receiver.receive(packet));
+  }
+  checkInOrder(receiver, 2, 9);
+  ArqAck staleAck = receiver.ack();
+  LONGS_EQUAL(11, staleAck.nextSeq);
+
+  // Sender restarts as a new session, and every packet is delivered
+  ArqSender restarted(0x89ABCDEF);
+  for (uint32_t i = 1; i <= 10; i++) {
+    packet = dataPacket(100 + i);
+    restarted.send(packet, 0);
+    CHECK(receiver.receive(packet));
+  }
+  checkInOrder(receiver, 101, 10);
+  LONGS_EQUAL(0, receiver.duplicates);
+
+  // Ack from before the restart frees nothing
+  restarted.processAck(staleAck);
+  LONGS_EQUAL(10, restarted.inFlight());
+  restarted.processAck(receiver.ack());
+  LONGS_EQUAL(0, restarted.inFlight());
+
+  // Same for a packet that lands just past the receiver's window
+  packet = dataPacket(200);
+  packet.sequenceNum = receiver.ack().nextSeq + arqWindowSize;
+  CHECK(receiver.receive(packet));
+  checkInOrder(receiver, 200, 1);
+
+  // Resends from within the window are still duplicates
+  packet.sequenceNum -= 1;
+  CHECK(!receiver.receive(packet));
+  LONGS_EQUAL(1, receiver.duplicates);
+}
+
+// ------- Lossy channel --------
+
+// Repeatable pseudo-random numbers
+class Prng
+{
+public:
+  uint32_t next()
+  {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+  }
+
+  // Returns true with the given probability in percent
+  bool chance(uint32_t percent) { return next() % 100 < percent; }
+
+private:
+  uint32_t seed = 1;
+};
+
+struct ChannelConfig
+{
+  uint32_t dropPercent;
+  uint32_t corruptPercent;
+  uint32_t latencyTicks;
+};
+
+// One direction of a link. Frames arrive after a fixed latency,
+// unless dropped. Corrupted frames have a single byte flipped.
+class Channel
+{
+public:
+  Channel(const ChannelConfig& config, Prng& prng)
+    : config{ config }
+    , prng{ prng }
+  {}
+
+  void send(WrappedPacket& wrap, uint32_t now)
+  {
+    frames++;
+    if (prng.chance(config.dropPercent)) {
+      return;
+    }
+    setPacketWrapper(wrap);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&wrap);
+    Frame frame{ now + config.latencyTicks, std::vector<uint8_t>(bytes, bytes + wrappedPacketSize(wrap)) };
+    if (prng.chance(config.corruptPercent)) {
+      frame.bytes[prng.next() % frame.bytes.size()] ^= 0x10;
+    }
+    inFlight.push_back(frame);
+  }
+
+  // Appends frames that have arrived by now
+  void receive(std::vector<uint8_t>& out, uint32_t now)
+  {
+    while (!inFlight.empty() && inFlight.front().arrival <= now) {
+      auto& bytes = inFlight.front().bytes;
+      out.insert(out.end(), bytes.begin(), bytes.end());
+      inFlight.pop_front();
+    }
+  }
+
+  uint32_t frames = 0; // total sent, including dropped
+
+private:
+  struct Frame
+  {
+    uint32_t arrival;
+    std::vector<uint8_t> bytes;
+  };
+  const ChannelConfig& config;
+  Prng& prng;
+  std::deque<Frame> inFlight;
+};
+
+// One end of a link, sending `total` data packets, and receiving from the other end
+class Endpoint : public CanProcessPacket
+{
+public:
+  Endpoint(uint32_t total)
+    : total{ total }
+  {
+    parser.checkSequence = false;
+    sender.timeoutTicks = 30;
+  }
+
+  void processPacket(const Packet& packet)
+  {
+    if (packet.origin == PacketOrigin::Internal) {
+      // Corruption, which arq will recover from
+      return;
+    }
+    if (packet.id == PacketID::ArqAck) {
+      sender.processAck(packet.body.arqAck);
+      return;
+    }
+    ackNeeded = true;
+    receiver.receive(packet);
+    const Packet* next;
+    while ((next = receiver.nextInOrder())) {
+      // Must be delivered exactly once, and in order
+      LONGS_EQUAL(delivered, next->body.vfdSetFrequency.frequency);
+      delivered++;
+    }
+  }
+
+  // Parses newly arrived bytes
+  void receive(Channel& in, uint32_t now)
+  {
+    in.receive(rx, now);
+    if (!rx.empty()) {
+      rx.resize(parser.extractPackets(reinterpret_cast<char*>(rx.data()), rx.size()));
+    }
+  }
+
+  // Sends up to one data packet, plus an ack if needed
+  void send(Channel& out, uint32_t now)
+  {
+    if (ackNeeded) {
+      ackNeeded = false;
+      initializePacket(wrap.packet, PacketID::ArqAck);
+      wrap.packet.origin = PacketOrigin::HostToTarget;
+      wrap.packet.sequenceNum = 0;
+      wrap.packet.body.arqAck = receiver.ack();
+      out.send(wrap, now);
+    }
+
+    const Packet* resend = sender.nextRetransmit(now);
+    if (resend) {
+      memcpy(&wrap.packet, resend, resend->length);
+      out.send(wrap, now);
+      dataFrames++;
+    } else if (sent < total && sender.canSend()) {
+      wrap.packet = dataPacket(sent++);
+      sender.send(wrap.packet, now);
+      out.send(wrap, now);
+      dataFrames++;
+    }
+  }
+
+  bool done() { return delivered == total && sent == total && !sender.inFlight(); }
+
+  ArqSender sender;
+  ArqReceiver receiver;
+  uint32_t dataFrames = 0; // including resends
+  uint32_t delivered = 0;
+
+private:
+  PacketParser parser{ *this };
+  uint32_t total;
+  uint32_t sent = 0;
+  bool ackNeeded = false;
+  WrappedPacket wrap;
+  std::vector<uint8_t> rx;
+};
+
+/*
+ * Runs a bidirectional transfer of `total` packets each way.
+ * Each end sends at most one data packet per tick.
+ * Sets `ticks` to time taken.
+ */
+static void runLink(const ChannelConfig& config, uint32_t total, Endpoint& a, Endpoint& b, uint32_t& ticks)
+{
+  Prng prng;
+  Channel aToB(config, prng);
+  Channel bToA(config, prng);
+
+  uint32_t now = 0;
+  const uint32_t maxTicks = total * 10;
+  for (; now < maxTicks && !(a.done() && b.done()); now++) {
+    a.send(aToB, now);
+    b.send(bToA, now);
+    a.receive(bToA, now);
+    b.receive(aToB, now);
+  }
+  CHECK(now < maxTicks);
+  LONGS_EQUAL(total, a.delivered);
+  LONGS_EQUAL(total, b.delivered);
+  ticks = now;
+}
+
+TEST(TestArq, test_lossless_link)
+{
+  const uint32_t total = 1000;
+  const ChannelConfig config{ 0, 0, 5 };
+  Endpoint a(total), b(total);
+  uint32_t ticks;
+  runLink(config, total, a, b, ticks);
+
+  // No resends, and window is large enough to keep the link busy
+  LONGS_EQUAL(total, a.dataFrames);
+  LONGS_EQUAL(total, b.dataFrames);
+  CHECK(ticks <= total + 2 * config.latencyTicks + 2);
+}
+
+TEST(TestArq, test_lossy_link)
+{
+  const uint32_t total = 2000;
+  // Window must cover a couple round trips to keep sending while
+  // recovering from a loss, so latency is kept short here.
+  const ChannelConfig config{ 5, 2, 2 };
+  Endpoint a(total), b(total);
+  uint32_t ticks;
+  runLink(config, total, a, b, ticks);
+
+  // Lost packets are resent about once each.
+  // Ideal is total / (1 - loss), where loss includes both data and acks,
+  // so allow some margin.
+  const double loss = (config.dropPercent + config.corruptPercent) / 100.0;
+  const double ideal = total / (1 - loss);
+  CHECK(a.dataFrames < ideal * 1.05);
+  CHECK(b.dataFrames < ideal * 1.05);
+
+  // Selective resends keep the link busy, rather than stalling on timeouts
+  CHECK(ticks < ideal * 1.1);
+}
@@ -0,0 +1,126 @@
+#include "CppUTest/TestHarness.h"
+
+#include "binary_log.h"
+#include "packet_utils.h"
+#include <string.h>
+
+TEST_GROUP(TestBinaryLog){ void setup(){} void teardown(){} };
+
+// Stand-in for strings in the firmware ELF, at fake flash addresses
+static const char* const flashStrings[] = {
+  "plain text",
+  "%u %d %x %08X %c",
+  "%hhd %hu %lld %llu",
+  "%.2f %g",
+  "%s says %s",
+  "%*d|%-4s|%%",
+  "%s%s%P",
+  "flash string",
+};
+
+static uint32_t flashAddress(uint32_t index)
+{
+  return binLogFlashBase + 0x100 * index;
+}
+
+static const char* lookup(uint32_t address)
+{
+  for (uint32_t i = 0; i < sizeof(flashStrings) / sizeof(flashStrings[0]); i++) {
+    if (address == flashAddress(i)) {
+      return flashStrings[i];
+    }
+  }
+  return nullptr;
+}
+
+// Encodes a record in the same way as ItmLogger, then decodes it
+template<typename... Args>
+static void checkRecord(const char* expected, uint32_t fmtIndex, bool newline, Args... args)
+{
+  uint8_t record[252];
+  BinLogWriter writer(record, sizeof(record));
+  int expand[] = { 0, (writer.arg(args), 0)... };
+  (void)expand;
+  uint32_t len = writer.finish(flashAddress(fmtIndex) - binLogFlashBase, newline);
+  LONGS_EQUAL(len, binLogRecordLength(*(uint32_t*)record));
+
+  char out[600];
+  LONGS_EQUAL(strlen(expected), binLogFormat(out, sizeof(out), record, len, lookup));
+  STRCMP_EQUAL(expected, out);
+}
+
+TEST(TestBinaryLog, test_binary_log_args)
+{
+  checkRecord("plain text", 0, false);
+  checkRecord("plain text\n", 0, true);
+
+  // Integers are sized by type on the target
+  checkRecord("7 -3 ff 0000ABCD z", 1, false, 7u, -3, 0xFFu, 0xABCD, 'z');
+  checkRecord("-1 65535 -5000000000 18000000000", 2, false, (int8_t)-1, (uint16_t)65535, -5000000000LL, 18000000000ULL);
+
+  // Floats are promoted to double
+  checkRecord("1.25 0.5", 3, false, 1.25f, 0.5);
+
+  // Runtime strings are sent inline
+  char name[] = "uart5";
+  checkRecord("uart5 says hi", 4, false, name, "hi");
+
+  // Star width takes an argument
+  checkRecord("   42|ab  |%", 5, false, 5, 42, "ab");
+}
+
+TEST(TestBinaryLog, test_binary_log_records)
+{
+  uint8_t record[252];
+  char out[600];
+
+  // Constant strings can be sent as flash addresses
+  BinLogWriter writer(record, sizeof(record));
+  writer.word(flashAddress(7));
+  writer.arg("inline");
+  uint32_t len = writer.finish(flashAddress(4) - binLogFlashBase, false);
+  binLogFormat(out, sizeof(out), record, len, lookup);
+  STRCMP_EQUAL("flash string says inline", out);
+
+  // Packets are formatted on host
+  WrappedPacket wrap;
+  fillFreqPacket(wrap, 5, 3, 25);
+  char expected[300];
+  uint32_t n = snprintf(expected, sizeof(expected), "intake got: ");
+  snprintPacket(expected + n, sizeof(expected) - n, wrap.packet);
+  writer = BinLogWriter(record, sizeof(record));
+  writer.arg("intake");
+  writer.arg(" got: ");
+  writer.bytes(&wrap.packet, wrap.packet.length);
+  len = writer.finish(flashAddress(6) - binLogFlashBase, false);
+  binLogFormat(out, sizeof(out), record, len, lookup);
+  STRCMP_EQUAL(expected, out);
+
+  // Long inline strings are truncated to fit
+  char longStr[400];
+  memset(longStr, 'a', sizeof(longStr) - 1);
+  longStr[sizeof(longStr) - 1] = '\0';
+  writer = BinLogWriter(record, sizeof(record));
+  writer.arg(longStr);
+  writer.arg("dropped");
+  len = writer.finish(flashAddress(4) - binLogFlashBase, false);
+  LONGS_EQUAL(sizeof(record), len);
+  LONGS_EQUAL(sizeof(record) - 8 + strlen(" says <missing>"), binLogFormat(out, sizeof(out), record, len, lookup));
+  CHECK(strstr(out, "aaa says <missing>") != NULL);
+
+  // Incomplete record notes missing args
+  writer = BinLogWriter(record, sizeof(record));
+  writer.arg(1u);
+  len = writer.finish(flashAddress(1) - binLogFlashBase, false);
+  binLogFormat(out, sizeof(out), record, len, lookup);
+  STRCMP_EQUAL("1 <missing>", out);
+
+  // Unknown format shows raw words
+  len = writer.finish(0x1234, true);
+  binLogFormat(out, sizeof(out), record, len, lookup);
+  STRCMP_EQUAL("<unknown format 0x08001234> 00000001\n", out);
+
+  // Output is clamped to buffer size
+  LONGS_EQUAL(4, binLogFormat(out, 5, record, len, lookup));
+  STRCMP_EQUAL("<unk", out);
+}
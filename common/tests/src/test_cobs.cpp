@@ -0,0 +1,87 @@
+#include "CppUTest/TestHarness.h"
+
+#include "cobs.h"
+#include <string.h>
+
+TEST_GROUP(TestCobs){ void setup(){} void teardown(){} };
+
+// Encodes, checks against expected frame, then decodes back
+static void checkRoundTrip(const uint8_t* in, uint32_t len, const uint8_t* expected, uint32_t expectedLen)
+{
+  uint8_t frame[600];
+  uint8_t out[600];
+  uint32_t frameLen = cobsEncode(frame, in, len);
+  LONGS_EQUAL(expectedLen, frameLen);
+  MEMCMP_EQUAL(expected, frame, expectedLen);
+  LONGS_EQUAL(len, cobsDecode(out, frame, frameLen - 1));
+  MEMCMP_EQUAL(in, out, len);
+}
+
+TEST(TestCobs, test_cobs_examples)
+{
+  // Examples from wikipedia
+  const uint8_t in1[] = { 0x00 };
+  const uint8_t out1[] = { 0x01, 0x01, 0x00 };
+  checkRoundTrip(in1, sizeof(in1), out1, sizeof(out1));
+
+  const uint8_t in2[] = { 0x00, 0x00 };
+  const uint8_t out2[] = { 0x01, 0x01, 0x01, 0x00 };
+  checkRoundTrip(in2, sizeof(in2), out2, sizeof(out2));
+
+  const uint8_t in3[] = { 0x00, 0x11, 0x00 };
+  const uint8_t out3[] = { 0x01, 0x02, 0x11, 0x01, 0x00 };
+  checkRoundTrip(in3, sizeof(in3), out3, sizeof(out3));
+
+  const uint8_t in4[] = { 0x11, 0x22, 0x00, 0x33 };
+  const uint8_t out4[] = { 0x03, 0x11, 0x22, 0x02, 0x33, 0x00 };
+  checkRoundTrip(in4, sizeof(in4), out4, sizeof(out4));
+
+  const uint8_t in5[] = { 0x11, 0x00, 0x00, 0x00 };
+  const uint8_t out5[] = { 0x02, 0x11, 0x01, 0x01, 0x01, 0x00 };
+  checkRoundTrip(in5, sizeof(in5), out5, sizeof(out5));
+
+  // Full run of 254 non-zero bytes needs no trailing code byte
+  uint8_t in6[254];
+  uint8_t out6[256];
+  for (uint32_t i = 0; i < sizeof(in6); i++) {
+    in6[i] = i + 1;
+    out6[i + 1] = i + 1;
+  }
+  out6[0] = 0xFF;
+  out6[255] = 0x00;
+  checkRoundTrip(in6, sizeof(in6), out6, sizeof(out6));
+
+  // Malformed frames
+  const uint8_t bad1[] = { 0x05, 0x11, 0x22 }; // run past end
+  const uint8_t bad2[] = { 0x02, 0x11, 0x00 }; // delimiter in frame
+  uint8_t out[8];
+  LONGS_EQUAL(0, cobsDecode(out, bad1, sizeof(bad1)));
+  LONGS_EQUAL(0, cobsDecode(out, bad2, sizeof(bad2)));
+}
+
+TEST(TestCobs, test_cobs_in_place)
+{
+  uint8_t in[1000];
+  uint8_t buf[1200];
+  uint32_t seed = 1;
+
+  for (uint32_t len = 0; len <= sizeof(in); len += 37) {
+    // Mix of mostly non-zero data (long runs), and data with frequent zeros
+    for (uint32_t i = 0; i < len; i++) {
+      seed = seed * 1103515245 + 12345;
+      in[i] = len % 2 ? (seed >> 16) | 1 : (seed >> 16) % 4;
+    }
+
+    // Read data into end of buffer, then encode in place
+    uint32_t offset = cobsOverhead(len);
+    memcpy(buf + offset, in, len);
+    uint32_t frameLen = cobsEncode(buf, buf + offset, len);
+    CHECK(frameLen <= cobsMaxFrameLength(len));
+    LONGS_EQUAL(0, buf[frameLen - 1]);
+    CHECK(memchr(buf, 0, frameLen - 1) == NULL);
+
+    // Decode in place
+    LONGS_EQUAL(len, cobsDecode(buf, buf, frameLen - 1));
+    MEMCMP_EQUAL(in, buf, len);
+  }
+}
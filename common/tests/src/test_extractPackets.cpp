@@ -65,7 +65,9 @@ TEST(TestExtractPackets, test_extractPackets)
 void foo()
 #endif
 {
-  WrappedPacket goodPkt1;
+  // Zeroed so padding bytes match the raw encoding check below,
+  // regardless of what earlier tests left on the stack.
+  WrappedPacket goodPkt1{};
   fillFreqPacket(goodPkt1, 1, 3, 25);
 
   WrappedPacket goodPkt2;
@@ -304,3 +306,627 @@ void foo()
   LONGS_EQUAL(bufExpectPos, testProcesser.bufOutPos);
   MEMCMP_EQUAL(bufExpect, testProcesser.bufOut, bufExpectPos);
 }
+
+#ifdef TEST
+TEST(TestExtractPackets, test_findStartWord)
+#else
+void bar()
+#endif
+{
+  // Garbage that's dense with partial start words, plus a few real ones
+  uint8_t buf[200];
+  const uint8_t partial[] = { 0xBE, 0xAB, 0xED, 0xFE };
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < sizeof(buf); i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = partial[(seed >> 16) % sizeof(partial)];
+  }
+  mymemcpy(buf + 37, &startWord, sizeof(startWord));
+  mymemcpy(buf + 38 + 16, &startWord, sizeof(startWord));
+  mymemcpy(buf + 150, &startWord, sizeof(startWord));
+
+  // Compare against checking every position
+  for (uint32_t start = 0; start < 60; start++) {
+    for (uint32_t end = start; end <= sizeof(buf) - 3; end++) {
+      uint32_t expected = start;
+      while (expected < end && memcmp(buf + expected, &startWord, sizeof(startWord))) {
+        expected++;
+      }
+      LONGS_EQUAL(expected, findStartWord(buf, start, end));
+    }
+  }
+}
+
+// Records every parsed packet back-to-back
+class RecordingProcesser : public CanProcessPacket
+{
+public:
+  uint8_t bufOut[30000];
+  uint32_t bufOutPos = 0;
+
+  void processPacket(const Packet& packet) { bufOutPos += mymemcpy(bufOut + bufOutPos, &packet, packet.length); }
+};
+
+#ifdef TEST
+TEST(TestExtractPackets, test_extractPackets_ring)
+#else
+void baz()
+#endif
+{
+  // Stream of good packets of various sizes, garbage, and partial start words
+  uint8_t bufIn[20000];
+  uint32_t bufInPos = 0;
+  uint32_t seed = 1;
+  WrappedPacket wrap;
+  for (uint32_t seq = 1; seq < 60; seq++) {
+    if (seq % 3) {
+      fillFreqPacket(wrap, seq, 3, seq);
+    } else {
+      char msg[maxLogMsgLength];
+      memset(msg, 'a' + seq % 26, sizeof(msg));
+      initializePacket(wrap.packet, PacketID::LogMessage);
+      wrap.packet.sequenceNum = seq;
+      setLogMessage(wrap.packet, msg, seq * 37 % (maxLogMsgLength + 1));
+      setPacketWrapper(wrap);
+    }
+    bufInPos += copyWrapped(bufIn + bufInPos, wrap);
+
+    seed = seed * 1103515245 + 12345;
+    uint32_t garbage = (seed >> 16) % 12;
+    for (uint32_t i = 0; i < garbage; i++) {
+      bufIn[bufInPos++] = (startWord >> (8 * (i % 4))) & 0xFF;
+    }
+  }
+
+  // Odd size, so packets land across the wrap point at many offsets
+  const uint32_t capacity = maxWrappedPacketLength + 37;
+
+  RecordingProcesser linearOut;
+  PacketParser linearParser(linearOut);
+  uint8_t linear[capacity];
+  uint32_t linearLen = 0;
+
+  RecordingProcesser ringOut;
+  PacketParser ringParser(ringOut);
+  StaticParserRing<capacity> ring;
+
+  // Feed identical random-sized chunks to both parsers
+  uint32_t pos = 0;
+  while (pos < bufInPos) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t chunk = min(min(1 + (seed >> 16) % 80, capacity - linearLen), bufInPos - pos);
+
+    memcpy(linear + linearLen, bufIn + pos, chunk);
+    linearLen = linearParser.extractPackets(linear, linearLen + chunk);
+
+    // Ring may need two writes if chunk wraps around the end
+    uint32_t written = 0;
+    while (written < chunk) {
+      uint32_t n = min(chunk - written, ring.writeSpace());
+      memcpy(ring.writePtr(), bufIn + pos + written, n);
+      ring.commitWrite(n);
+      written += n;
+    }
+    LONGS_EQUAL(linearLen, ringParser.extractPackets(ring));
+
+    pos += chunk;
+  }
+
+  // Same callbacks, and same leftover bytes
+  LONGS_EQUAL(linearOut.bufOutPos, ringOut.bufOutPos);
+  MEMCMP_EQUAL(linearOut.bufOut, ringOut.bufOut, linearOut.bufOutPos);
+  LONGS_EQUAL(59, linearParser.lastSeqNum);
+  LONGS_EQUAL(59, ringParser.lastSeqNum);
+  for (uint32_t i = 0; i < linearLen; i++) {
+    LONGS_EQUAL(linear[i], ring.buf[ringIndex(ring.size, ring.readIdx, i)]);
+  }
+}
+
+// Records packets delivered in batches
+class BatchRecordingProcesser : public RecordingProcesser
+{
+public:
+  uint32_t batches = 0;
+  uint32_t batchedPackets = 0;
+
+  void processPackets(const PacketSpan& packets)
+  {
+    batches++;
+    batchedPackets += packets.count;
+    for (const Packet& packet : packets) {
+      processPacket(packet);
+    }
+  }
+};
+
+#ifdef TEST
+TEST(TestExtractPackets, test_extractPackets_batch)
+#else
+void qux()
+#endif
+{
+  // Good packets with a corrupted one in the middle, so errors are batched too
+  uint8_t bufIn[2000];
+  uint32_t bufInPos = 0;
+  WrappedPacket wrap;
+  for (uint32_t seq = 1; seq <= 20; seq++) {
+    fillFreqPacket(wrap, seq, 3, seq);
+    if (seq == 10) {
+      wrap.crc++;
+    }
+    bufInPos += copyWrapped(bufIn + bufInPos, wrap);
+  }
+  uint8_t bufCopy[sizeof(bufIn)];
+  memcpy(bufCopy, bufIn, bufInPos);
+
+  RecordingProcesser singleOut;
+  PacketParser singleParser(singleOut);
+  LONGS_EQUAL(0, singleParser.extractPackets(bufIn, bufInPos));
+
+  // Batch storage smaller than all packets, so it must flush mid-parse
+  alignas(Packet) uint8_t batch[sizeof(Packet) + 64];
+  BatchRecordingProcesser batchOut;
+  PacketParser batchParser(batchOut, batch);
+  LONGS_EQUAL(0, batchParser.extractPackets(bufCopy, bufInPos));
+
+  // Same packets in same order
+  LONGS_EQUAL(singleOut.bufOutPos, batchOut.bufOutPos);
+  MEMCMP_EQUAL(singleOut.bufOut, batchOut.bufOut, singleOut.bufOutPos);
+
+  // 19 good packets, crc error, dropped bytes error, sequence error
+  LONGS_EQUAL(22, batchOut.batchedPackets);
+  CHECK(batchOut.batches > 1);
+  CHECK(batchOut.batches < batchOut.batchedPackets);
+}
+
+// Processor for TypedPacketParser. Doesn't need CanProcessPacket.
+class TypedRecordingProcesser final
+{
+public:
+  uint8_t bufOut[30000];
+  uint32_t bufOutPos = 0;
+  uint32_t errors = 0;
+
+  void processPacket(const Packet& packet)
+  {
+    if (packet.origin == PacketOrigin::Internal) {
+      errors++;
+    }
+    bufOutPos += mymemcpy(bufOut + bufOutPos, &packet, packet.length);
+  }
+};
+
+#ifdef TEST
+TEST(TestExtractPackets, test_typed_parser)
+#else
+void quux()
+#endif
+{
+  // Alternating IDs, with one corrupted packet
+  uint8_t bufIn[4000];
+  uint32_t bufInPos = 0;
+  WrappedPacket wrap;
+  for (uint32_t seq = 1; seq <= 20; seq++) {
+    initializePacket(wrap.packet, seq % 2 ? PacketID::VfdSetFrequency : PacketID::Heartbeat);
+    wrap.packet.origin = PacketOrigin::HostToTarget;
+    wrap.packet.sequenceNum = seq;
+    wrap.packet.body.vfdSetFrequency = { 3, (uint16_t)seq };
+    setPacketWrapper(wrap);
+    if (seq == 7) {
+      wrap.crc++;
+    }
+    bufInPos += copyWrapped(bufIn + bufInPos, wrap);
+  }
+  uint8_t bufCopy[sizeof(bufIn)];
+
+  // Without an ID list, matches PacketParser
+  memcpy(bufCopy, bufIn, bufInPos);
+  RecordingProcesser virtualOut;
+  PacketParser virtualParser(virtualOut);
+  LONGS_EQUAL(0, virtualParser.extractPackets(bufCopy, bufInPos));
+
+  memcpy(bufCopy, bufIn, bufInPos);
+  TypedRecordingProcesser typedOut;
+  TypedPacketParser<TypedRecordingProcesser> typedParser(typedOut);
+  LONGS_EQUAL(0, typedParser.extractPackets(bufCopy, bufInPos));
+
+  LONGS_EQUAL(virtualOut.bufOutPos, typedOut.bufOutPos);
+  MEMCMP_EQUAL(virtualOut.bufOut, typedOut.bufOut, virtualOut.bufOutPos);
+
+  // Only accepting Heartbeat skips corrupted VfdSetFrequency packet
+  // without reporting crc, dropped bytes, or sequence errors.
+  memcpy(bufCopy, bufIn, bufInPos);
+  TypedRecordingProcesser heartbeatOut;
+  TypedPacketParser<TypedRecordingProcesser, PacketID::Heartbeat> heartbeatParser(heartbeatOut);
+  LONGS_EQUAL(0, heartbeatParser.extractPackets(bufCopy, bufInPos));
+
+  LONGS_EQUAL(0, heartbeatOut.errors);
+  LONGS_EQUAL(10 * packetSizeFromID(PacketID::Heartbeat), heartbeatOut.bufOutPos);
+  LONGS_EQUAL(20, heartbeatParser.lastSeqNum);
+}
+
+#ifdef TEST
+TEST(TestExtractPackets, test_compact_encode_decode)
+#else
+void corge()
+#endif
+{
+  WrappedPacket wrap;
+  fillFreqPacket(wrap, 0x12345, 3, 25);
+
+  uint8_t frame[maxCompactFrameLength];
+  uint32_t frameLen = encodeCompact(frame, wrap.packet);
+  LONGS_EQUAL(compactFrameSizeFromID(PacketID::VfdSetFrequency), frameLen);
+  LONGS_EQUAL(17, frameLen);
+
+  // Explicit little-endian header layout
+  const uint8_t header[] = {
+    0xBE, 0xAB, // sync
+    0x02,       // version
+  };
+  MEMCMP_EQUAL(header, frame, sizeof(header));
+  const uint8_t fields[] = {
+    0x08,       // ID freq 8
+    0x00,       // origin internal 0
+    0x04, 0x00, // body length 4
+    0x45, 0x23, // low 16 bits of sequence
+    0x03,       // addr 3
+  };
+  MEMCMP_EQUAL(fields, frame + compactCrcOffset, sizeof(fields));
+
+  Packet decoded;
+  LONGS_EQUAL(frameLen, decodeCompact(decoded, frame, frameLen));
+  LONGS_EQUAL(wrap.packet.length, decoded.length);
+  LONGS_EQUAL(0x2345, decoded.sequenceNum);
+  LONGS_EQUAL(3, decoded.body.vfdSetFrequency.node);
+  LONGS_EQUAL(25, decoded.body.vfdSetFrequency.frequency);
+
+  // Incomplete or corrupted
+  LONGS_EQUAL(0, decodeCompact(decoded, frame, frameLen - 1));
+  frame[frameLen - 1] ^= 1;
+  LONGS_EQUAL(0, decodeCompact(decoded, frame, frameLen));
+
+  // Sequence numbers extend across 16-bit rollover
+  LONGS_EQUAL(0x10000, unwrapSequence(0xFFFF, 0x0000));
+  LONGS_EQUAL(0x1FFFF, unwrapSequence(0x20001, 0xFFFF));
+  LONGS_EQUAL(1, unwrapSequence(0, 1));
+}
+
+#ifdef TEST
+TEST(TestExtractPackets, test_extractPackets_mixed_framing)
+#else
+void grault()
+#endif
+{
+  // Alternate wrapped and compact frames, with garbage and a corrupted compact frame
+  uint8_t bufIn[20000];
+  uint32_t bufInPos = 0;
+  uint32_t seed = 3;
+  WrappedPacket wrap;
+  const uint32_t firstSeq = 0xFFF0; // crosses 16-bit rollover
+  const uint32_t lastSeq = firstSeq + 40;
+  for (uint32_t seq = firstSeq; seq <= lastSeq; seq++) {
+    fillFreqPacket(wrap, seq, 3, seq);
+    if (seq % 2) {
+      bufInPos += copyWrapped(bufIn + bufInPos, wrap);
+    } else {
+      uint32_t len = encodeCompact(bufIn + bufInPos, wrap.packet);
+      if (seq == firstSeq + 10) {
+        bufIn[bufInPos + len - 1] ^= 0x80;
+      }
+      bufInPos += len;
+    }
+
+    // A few garbage bytes, including partial sync words
+    seed = seed * 1103515245 + 12345;
+    uint32_t garbage = (seed >> 16) % 4;
+    for (uint32_t i = 0; i < garbage; i++) {
+      bufIn[bufInPos++] = (startWord >> (8 * (i % 2))) & 0xFF;
+    }
+  }
+
+  RecordingProcesser out;
+  PacketParser parser(out);
+  parser.acceptCompact = true;
+  parser.lastSeqNum = firstSeq - 1;
+  StaticParserRing<maxWrappedPacketLength + 13> ring;
+
+  uint32_t pos = 0;
+  while (pos < bufInPos) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t chunk = min(min(1 + (seed >> 16) % 50, ring.size - ring.len), bufInPos - pos);
+    uint32_t written = 0;
+    while (written < chunk) {
+      uint32_t n = min(chunk - written, ring.writeSpace());
+      memcpy(ring.writePtr(), bufIn + pos + written, n);
+      ring.commitWrite(n);
+      written += n;
+    }
+    parser.extractPackets(ring);
+    pos += chunk;
+  }
+
+  LONGS_EQUAL(lastSeq, parser.lastSeqNum);
+
+  // Walk through output, counting good packets
+  uint32_t good = 0;
+  uint32_t crcErrors = 0;
+  uint32_t pktPos = 0;
+  while (pktPos < out.bufOutPos) {
+    Packet* packet = (Packet*)(out.bufOut + pktPos);
+    if (packet->id == PacketID::VfdSetFrequency) {
+      LONGS_EQUAL(packet->sequenceNum & 0xFFFF, packet->body.vfdSetFrequency.frequency);
+      good++;
+    }
+    if (packet->id == PacketID::ParsingErrorInvalidCRC) {
+      crcErrors++;
+    }
+    pktPos += packet->length;
+  }
+  LONGS_EQUAL(40, good);
+  LONGS_EQUAL(1, crcErrors);
+}
+
+#ifdef TEST
+TEST(TestExtractPackets, test_extractPackets_cobs)
+#else
+void garply()
+#endif
+{
+  // COBS frames holding wrapped packets and compact frames,
+  // with noise between frames and a few corrupted frames.
+  uint8_t bufIn[20000];
+  uint32_t bufInPos = 0;
+  uint32_t seed = 5;
+  WrappedPacket wrap;
+  uint8_t frame[maxWrappedPacketLength];
+  const uint32_t numPackets = 60;
+  uint32_t corrupted = 0;
+  for (uint32_t seq = 1; seq <= numPackets; seq++) {
+    fillFreqPacket(wrap, seq, 3, seq);
+    uint32_t len = seq % 2 ? copyWrapped(frame, wrap) : encodeCompact(frame, wrap.packet);
+    uint32_t frameStart = bufInPos;
+    bufInPos += cobsEncode(bufIn + bufInPos, frame, len);
+
+    // Flip a bit in every 10th frame, but not in the delimiter
+    if (seq % 10 == 0) {
+      bufIn[frameStart + 3] ^= 0x10;
+      corrupted++;
+    }
+
+    // Garbage (including start words) followed by a delimiter every 15th frame
+    if (seq % 15 == 0) {
+      bufInPos += copyWrapped(bufIn + bufInPos, wrap) - 1;
+      bufIn[bufInPos++] = cobsDelimiter;
+    }
+  }
+
+  RecordingProcesser out;
+  PacketParser parser(out);
+  parser.framing = LinkFraming::Cobs;
+  StaticParserRing<maxWrappedPacketLength + 7> ring;
+
+  uint32_t pos = 0;
+  while (pos < bufInPos) {
+    seed = seed * 1103515245 + 12345;
+    uint32_t chunk = min(min(1 + (seed >> 16) % 80, ring.size - ring.len), bufInPos - pos);
+    uint32_t written = 0;
+    while (written < chunk) {
+      uint32_t n = min(chunk - written, ring.writeSpace());
+      memcpy(ring.writePtr(), bufIn + pos + written, n);
+      ring.commitWrite(n);
+      written += n;
+    }
+    parser.extractPackets(ring);
+    pos += chunk;
+  }
+
+  // Everything consumed, since stream ends with a delimiter
+  LONGS_EQUAL(0, ring.len);
+  // Last packet was corrupted
+  LONGS_EQUAL(numPackets - 1, parser.lastSeqNum);
+
+  // Count good packets and errors
+  uint32_t good = 0;
+  uint32_t frameErrors = 0;
+  uint32_t pktPos = 0;
+  while (pktPos < out.bufOutPos) {
+    Packet* packet = (Packet*)(out.bufOut + pktPos);
+    switch (packet->id) {
+      case PacketID::VfdSetFrequency:
+        LONGS_EQUAL(packet->sequenceNum, packet->body.vfdSetFrequency.frequency);
+        good++;
+        break;
+      case PacketID::ParsingErrorInvalidCRC:
+      case PacketID::ParsingErrorInvalidLength:
+      case PacketID::ParsingErrorInvalidID:
+        frameErrors++;
+        break;
+      default:
+        break;
+    }
+    pktPos += packet->length;
+  }
+  LONGS_EQUAL(numPackets - corrupted, good);
+
+  // Exactly one error per bad frame
+  LONGS_EQUAL(corrupted + numPackets / 15, frameErrors);
+}
+
+#ifdef TEST
+TEST(TestExtractPackets, test_variable_length)
+#else
+void waldo()
+#endif
+{
+  // Variable-length bodies are accepted anywhere in their range
+  LONGS_EQUAL(20, minPacketSizeFromID(PacketID::LogMessage));
+  LONGS_EQUAL(20, minPacketSizeFromID(PacketID::DummyPacket));
+  CHECK(packetLengthValid(PacketID::DummyPacket, 20));
+  CHECK(packetLengthValid(PacketID::DummyPacket, 84));
+  CHECK(!packetLengthValid(PacketID::DummyPacket, 19));
+  CHECK(!packetLengthValid(PacketID::DummyPacket, 85));
+  CHECK(packetLengthValid(PacketID::VfdSetFrequency, 20));
+  CHECK(!packetLengthValid(PacketID::VfdSetFrequency, 24));
+  CHECK(!packetLengthValid(PacketID::NumIDs, 20));
+
+  uint8_t bufIn[2000];
+  uint32_t bufInPos = 0;
+  WrappedPacket wrap{};
+  uint8_t payload[64];
+  memset(payload, 0x5A, sizeof(payload));
+
+  // Good dummy packets of each payload length
+  uint32_t seq = 1;
+  for (uint32_t len = 0; len <= sizeof(payload); len += 16) {
+    initializePacket(wrap.packet, PacketID::DummyPacket);
+    wrap.packet.sequenceNum = seq++;
+    setDummyPayload(wrap.packet, payload, len);
+    LONGS_EQUAL(len, dummyPayloadLength(wrap.packet));
+    bufInPos += copyWrapped(bufIn + bufInPos, setPacketWrapper(wrap));
+  }
+
+  // Short log message
+  initializePacket(wrap.packet, PacketID::LogMessage);
+  wrap.packet.sequenceNum = seq++;
+  setLogMessage(wrap.packet, "hello", 5);
+  LONGS_EQUAL(25, wrap.packet.length);
+  bufInPos += copyWrapped(bufIn + bufInPos, setPacketWrapper(wrap));
+
+  // Frequency packet with a valid crc, but padded past its fixed length
+  fillFreqPacket(wrap, seq++, 3, 25);
+  wrap.packet.length += 4;
+  bufInPos += copyWrapped(bufIn + bufInPos, setPacketWrapper(wrap));
+
+  RecordingProcesser out;
+  PacketParser parser(out);
+  // Tail of rejected packet is kept, in case it's the start of another
+  uint32_t leftover = parser.extractPackets(bufIn, bufInPos);
+  LONGS_EQUAL(minWrappedPacketLength - 1, leftover);
+
+  uint32_t pktPos = 0;
+  uint32_t dummies = 0;
+  uint32_t logs = 0;
+  uint32_t lengthErrors = 0;
+  while (pktPos < out.bufOutPos) {
+    Packet* packet = (Packet*)(out.bufOut + pktPos);
+    switch (packet->id) {
+      case PacketID::DummyPacket:
+        LONGS_EQUAL(dummies * 16, dummyPayloadLength(*packet));
+        dummies++;
+        break;
+      case PacketID::LogMessage: {
+        char buf[100];
+        snprintPacket(buf, sizeof(buf), *packet);
+        CHECK(strstr(buf, "LogMessage: hello") != NULL);
+        logs++;
+        break;
+      }
+      case PacketID::ParsingErrorInvalidLength:
+        lengthErrors++;
+        break;
+      default:
+        break;
+    }
+    pktPos += packet->length;
+  }
+  LONGS_EQUAL(5, dummies);
+  LONGS_EQUAL(1, logs);
+  // Padded packet is rejected once at its start word
+  LONGS_EQUAL(1, lengthErrors);
+}
+
+#ifdef TEST
+TEST(TestExtractPackets, test_aggregate)
+#else
+void fred()
+#endif
+{
+  uint8_t bufIn[2000];
+  uint32_t bufInPos = 0;
+  uint8_t expected[2000];
+  uint32_t expectedPos = 0;
+  WrappedPacket wrap;
+  WrappedPacket agg;
+
+  // Fills up with heartbeats
+  initializePacket(agg.packet, PacketID::Aggregate);
+  initializePacket(wrap.packet, PacketID::Heartbeat);
+  uint32_t count = 0;
+  while (appendToAggregate(agg.packet, wrap.packet)) {
+    count++;
+  }
+  LONGS_EQUAL((sizeof(Packet) - minPacketLength) / minPacketLength, count);
+  LONGS_EQUAL(minPacketLength * (count + 1), agg.packet.length);
+
+  // Standalone packet before aggregate
+  uint32_t seq = 1;
+  fillFreqPacket(wrap, seq++, 3, 25);
+  bufInPos += copyWrapped(bufIn + bufInPos, setPacketWrapper(wrap));
+  expectedPos += mymemcpy(expected + expectedPos, &wrap.packet, wrap.packet.length);
+
+  // Aggregate of alternating IDs, with an odd-length log message
+  initializePacket(agg.packet, PacketID::Aggregate);
+  agg.packet.origin = PacketOrigin::TargetToHost;
+  for (uint32_t i = 0; i < 6; i++) {
+    if (i == 3) {
+      initializePacket(wrap.packet, PacketID::LogMessage);
+      setLogMessage(wrap.packet, "hi", 2);
+    } else if (i % 2) {
+      initializePacket(wrap.packet, PacketID::Heartbeat);
+    } else {
+      fillFreqPacket(wrap, 0, 3, i);
+    }
+    wrap.packet.origin = PacketOrigin::TargetToHost;
+    wrap.packet.sequenceNum = seq++;
+    CHECK(appendToAggregate(agg.packet, wrap.packet));
+    expectedPos += mymemcpy(expected + expectedPos, &wrap.packet, wrap.packet.length);
+  }
+  bufInPos += copyWrapped(bufIn + bufInPos, setPacketWrapper(agg));
+
+  // Standalone packet after aggregate continues sequence
+  fillFreqPacket(wrap, seq++, 3, 26);
+  bufInPos += copyWrapped(bufIn + bufInPos, setPacketWrapper(wrap));
+  expectedPos += mymemcpy(expected + expectedPos, &wrap.packet, wrap.packet.length);
+
+  uint8_t bufCopy[sizeof(bufIn)];
+
+  // Inner packets are delivered individually, in order, without errors
+  memcpy(bufCopy, bufIn, bufInPos);
+  RecordingProcesser out;
+  PacketParser parser(out);
+  LONGS_EQUAL(0, parser.extractPackets(bufCopy, bufInPos));
+  LONGS_EQUAL(expectedPos, out.bufOutPos);
+  MEMCMP_EQUAL(expected, out.bufOut, expectedPos);
+  LONGS_EQUAL(seq - 1, parser.lastSeqNum);
+
+  // Typed parser filters inner packets too
+  memcpy(bufCopy, bufIn, bufInPos);
+  TypedRecordingProcesser heartbeatOut;
+  TypedPacketParser<TypedRecordingProcesser, PacketID::Heartbeat> heartbeatParser(heartbeatOut);
+  LONGS_EQUAL(0, heartbeatParser.extractPackets(bufCopy, bufInPos));
+  LONGS_EQUAL(0, heartbeatOut.errors);
+  LONGS_EQUAL(2 * packetSizeFromID(PacketID::Heartbeat), heartbeatOut.bufOutPos);
+  LONGS_EQUAL(seq - 1, heartbeatParser.lastSeqNum);
+
+  // Inner packet claiming to run past the end of the aggregate.
+  // Earlier inner packets are still delivered.
+  initializePacket(agg.packet, PacketID::Aggregate);
+  fillFreqPacket(wrap, 1, 3, 27);
+  appendToAggregate(agg.packet, wrap.packet);
+  initializePacket(wrap.packet, PacketID::DummyPacket);
+  wrap.packet.sequenceNum = 2;
+  appendToAggregate(agg.packet, wrap.packet);
+  Packet* last = (Packet*)((uint8_t*)&agg.packet + agg.packet.length - alignedPacketLength(wrap.packet));
+  last->length += 4;
+  bufInPos = copyWrapped(bufIn, setPacketWrapper(agg));
+
+  RecordingProcesser badOut;
+  PacketParser badParser(badOut);
+  LONGS_EQUAL(0, badParser.extractPackets(bufIn, bufInPos));
+  Packet* first = (Packet*)badOut.bufOut;
+  CHECK(PacketID::VfdSetFrequency == first->id);
+  Packet* error = (Packet*)(badOut.bufOut + first->length);
+  CHECK(PacketID::ParsingErrorInvalidLength == error->id);
+  LONGS_EQUAL(first->length + error->length, badOut.bufOutPos);
+}
@@ -23,3 +23,144 @@ TEST(TestCrc, test_crc32)
   uint8_t in2[] = { 0x01, 0x10, 0x20, 0x00, 0x00, 0x02 };
   LONGS_EQUAL(0x54422B96, crc32(in2, sizeof(in2)));
 }
+
+// Fills buffer with a repeatable pseudo-random pattern
+static void fillPattern(uint8_t* buf, uint32_t len, uint32_t seed)
+{
+  for (uint32_t i = 0; i < len; i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+}
+
+TEST(TestCrc, test_crc32_variants_match_bitwise)
+{
+  uint8_t buf[600];
+  fillPattern(buf, sizeof(buf), 1);
+
+  // Cover every leftover byte count and misaligned start addresses
+  for (uint32_t offset = 0; offset < 8; offset++) {
+    for (uint32_t len = 0; len <= sizeof(buf) - offset; len += (len < 40 ? 1 : 37)) {
+      uint32_t expected = crc32Bitwise(buf + offset, len);
+      LONGS_EQUAL(expected, crc32Bytewise(buf + offset, len));
+      LONGS_EQUAL(expected, crc32Slice4(buf + offset, len));
+      LONGS_EQUAL(expected, crc32Slice8(buf + offset, len));
+      LONGS_EQUAL(expected, crc32(buf + offset, len));
+    }
+  }
+}
+
+#if defined(CRC32_PCLMUL)
+TEST(TestCrc, test_crc32_pclmul_matches_bitwise)
+{
+  static uint8_t buf[4096 + 16];
+  fillPattern(buf, sizeof(buf), 6);
+
+  // Every length around the folding thresholds, at misaligned starts, plus larger sizes
+  for (uint32_t offset = 0; offset < 16; offset += 3) {
+    for (uint32_t len = 0; len <= 4096; len += (len < 300 ? 1 : 251)) {
+      LONGS_EQUAL(crc32Bitwise(buf + offset, len), crc32Pclmul(buf + offset, len));
+    }
+  }
+
+  // Continuing from a non-initial register
+  uint32_t reg = crc32Update(crc32Init, buf, 5);
+  reg = crc32Update(reg, buf + 5, sizeof(buf) - 5);
+  LONGS_EQUAL(crc32Bitwise(buf, sizeof(buf)), ~reg);
+}
+#endif
+
+TEST(TestCrc, test_crc32_check_value)
+{
+  // Standard "check" value for CRC-32
+  const char check[] = "123456789";
+  LONGS_EQUAL(0xCBF43926, crc32Bitwise(check, 9));
+  LONGS_EQUAL(0xCBF43926, crc32Bytewise(check, 9));
+  LONGS_EQUAL(0xCBF43926, crc32Slice4(check, 9));
+  LONGS_EQUAL(0xCBF43926, crc32Slice8(check, 9));
+}
+
+TEST(TestCrc, test_crc16_variants_match_bitwise)
+{
+  uint8_t buf[300];
+  fillPattern(buf, sizeof(buf), 2);
+
+  // Modbus packets are at most 256 bytes, so check every length up to that
+  for (uint32_t offset = 0; offset < 4; offset++) {
+    for (uint32_t len = 0; len <= 256; len++) {
+      uint16_t expected = crc16Bitwise(buf + offset, len);
+      LONGS_EQUAL(expected, crc16Bytewise(buf + offset, len));
+      LONGS_EQUAL(expected, crc16Slice4(buf + offset, len));
+      LONGS_EQUAL(expected, crc16(buf + offset, len));
+    }
+  }
+}
+
+TEST(TestCrc, test_crc16_check_value)
+{
+  // Standard "check" value for CRC-16/Modbus
+  const char check[] = "123456789";
+  LONGS_EQUAL(0x4B37, crc16Bitwise(check, 9));
+  LONGS_EQUAL(0x4B37, crc16Bytewise(check, 9));
+  LONGS_EQUAL(0x4B37, crc16Slice4(check, 9));
+}
+
+TEST(TestCrc, test_crc32_stream_matches_oneshot)
+{
+  uint8_t buf[100];
+  fillPattern(buf, sizeof(buf), 3);
+  const uint32_t expected = crc32(buf, sizeof(buf));
+
+  // Split into three chunks at every possible pair of split points
+  for (uint32_t a = 0; a <= sizeof(buf); a++) {
+    for (uint32_t b = a; b <= sizeof(buf); b++) {
+      Crc32Stream crc;
+      crc.update(buf, a);
+      crc.update(buf + a, b - a);
+      crc.update(buf + b, sizeof(buf) - b);
+      LONGS_EQUAL(expected, crc.finalize());
+    }
+  }
+}
+
+TEST(TestCrc, test_crc16_stream_matches_oneshot)
+{
+  uint8_t buf[100];
+  fillPattern(buf, sizeof(buf), 4);
+  const uint16_t expected = crc16(buf, sizeof(buf));
+
+  for (uint32_t a = 0; a <= sizeof(buf); a++) {
+    for (uint32_t b = a; b <= sizeof(buf); b++) {
+      Crc16Stream crc;
+      crc.update(buf, a);
+      crc.update(buf + a, b - a);
+      crc.update(buf + b, sizeof(buf) - b);
+      LONGS_EQUAL(expected, crc.finalize());
+    }
+  }
+}
+
+TEST(TestCrc, test_crc_stream_byte_at_a_time_and_reuse)
+{
+  uint8_t buf[37];
+  fillPattern(buf, sizeof(buf), 5);
+
+  Crc32Stream crc32s;
+  Crc16Stream crc16s;
+
+  // Run twice to check that init() fully resets state
+  for (int pass = 0; pass < 2; pass++) {
+    crc32s.init();
+    crc16s.init();
+    for (uint32_t i = 0; i < sizeof(buf); i++) {
+      crc32s.update(buf + i, 1);
+      crc16s.update(buf + i, 1);
+    }
+    LONGS_EQUAL(crc32(buf, sizeof(buf)), crc32s.finalize());
+    LONGS_EQUAL(crc16(buf, sizeof(buf)), crc16s.finalize());
+  }
+
+  // Empty stream matches empty buffer
+  Crc32Stream empty;
+  LONGS_EQUAL(crc32(buf, 0), empty.finalize());
+}
@@ -0,0 +1,182 @@
+#include "CppUTest/TestHarness.h"
+
+#include "spsc_ring.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+TEST_GROUP(TestSpscRing){ void setup(){} void teardown(){} };
+
+TEST(TestSpscRing, test_wrap)
+{
+  SpscRing<16> ring;
+  uint8_t in[16];
+  uint8_t out[16];
+  for (uint32_t i = 0; i < sizeof(in); i++) {
+    in[i] = i;
+  }
+
+  LONGS_EQUAL(16, ring.writeSpace());
+  LONGS_EQUAL(0, ring.readAvailable());
+  LONGS_EQUAL(0, ring.read(out, sizeof(out)));
+
+  // Advance to near the end, so the next write wraps
+  LONGS_EQUAL(11, ring.write(in, 11));
+  LONGS_EQUAL(11, ring.read(out, sizeof(out)));
+  MEMCMP_EQUAL(in, out, 11);
+
+  // Only fits 16
+  LONGS_EQUAL(16, ring.write(in, 16));
+  LONGS_EQUAL(0, ring.writeSpace());
+  LONGS_EQUAL(0, ring.write(in, 1));
+
+  // Partial reads across the wrap
+  LONGS_EQUAL(7, ring.read(out, 7));
+  MEMCMP_EQUAL(in, out, 7);
+  LONGS_EQUAL(7, ring.writeSpace());
+  LONGS_EQUAL(9, ring.read(out, sizeof(out)));
+  MEMCMP_EQUAL(in + 7, out, 9);
+  LONGS_EQUAL(0, ring.readAvailable());
+}
+
+TEST(TestSpscRing, test_transitions)
+{
+  SpscRing<8> ring;
+  uint8_t buf[8] = {};
+  bool wasEmpty;
+  bool wasFull;
+
+  ring.write(buf, 3, wasEmpty);
+  CHECK(wasEmpty);
+  ring.write(buf, 3, wasEmpty);
+  CHECK(!wasEmpty);
+
+  // Nothing written to a full ring
+  ring.write(buf, 5, wasEmpty);
+  LONGS_EQUAL(0, ring.writeSpace());
+  LONGS_EQUAL(0, ring.write(buf, 1, wasEmpty));
+  CHECK(!wasEmpty);
+
+  ring.read(buf, 1, wasFull);
+  CHECK(wasFull);
+  ring.read(buf, 1, wasFull);
+  CHECK(!wasFull);
+
+  // Reading everything, then writing, reports empty again
+  ring.read(buf, 8, wasFull);
+  LONGS_EQUAL(0, ring.read(buf, 1, wasFull));
+  CHECK(!wasFull);
+  ring.write(buf, 1, wasEmpty);
+  CHECK(wasEmpty);
+}
+
+// Stands in for a task's notification value with ulTaskNotifyTake(pdTRUE, ...)
+class Notification
+{
+public:
+  void give()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    count++;
+    cv.notify_one();
+  }
+
+  // Returns false on timeout
+  bool take()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    bool got = cv.wait_for(lock, std::chrono::seconds(2), [this] { return count > 0; });
+    count = 0;
+    return got;
+  }
+
+private:
+  std::mutex mutex;
+  std::condition_variable cv;
+  uint32_t count = 0;
+};
+
+static uint32_t nextRandom(uint32_t& seed)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+/*
+ * Producer and consumer threads pass a counting sequence in random
+ * sized chunks. Each side only waits after making no progress, and
+ * is only woken on the transitions reported by the other side.
+ * A missed wakeup shows up as a timeout, rather than a hang.
+ */
+TEST(TestSpscRing, test_threaded_stress)
+{
+  static SpscRing<64> ring;
+  const uint32_t totalBytes = 1 << 22;
+
+  Notification readerNotify;
+  Notification writerNotify;
+  bool writerTimedOut = false;
+  bool readerTimedOut = false;
+  uint32_t readerWaits = 0;
+
+  std::thread producer([&] {
+    uint32_t seed = 1;
+    uint8_t chunk[100];
+    uint32_t sent = 0;
+    while (sent < totalBytes) {
+      uint32_t len = min<uint32_t>(1 + nextRandom(seed) % sizeof(chunk), totalBytes - sent);
+      for (uint32_t i = 0; i < len; i++) {
+        chunk[i] = sent + i;
+      }
+      uint32_t written = 0;
+      while (written < len) {
+        bool wasEmpty;
+        uint32_t n = ring.write(chunk + written, len - written, wasEmpty);
+        written += n;
+        if (wasEmpty) {
+          readerNotify.give();
+        }
+        if (!n && !writerNotify.take()) {
+          writerTimedOut = true;
+          return;
+        }
+      }
+      sent += len;
+    }
+  });
+
+  uint32_t seed = 2;
+  uint8_t chunk[100];
+  uint32_t received = 0;
+  uint32_t mismatches = 0;
+  while (received < totalBytes) {
+    bool wasFull;
+    uint32_t n = ring.read(chunk, 1 + nextRandom(seed) % sizeof(chunk), wasFull);
+    if (wasFull) {
+      writerNotify.give();
+    }
+    if (!n) {
+      readerWaits++;
+      if (!readerNotify.take()) {
+        readerTimedOut = true;
+        break;
+      }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+      if (chunk[i] != (uint8_t)(received + i)) {
+        mismatches++;
+      }
+    }
+    received += n;
+  }
+  producer.join();
+
+  CHECK(!writerTimedOut);
+  CHECK(!readerTimedOut);
+  LONGS_EQUAL(totalBytes, received);
+  LONGS_EQUAL(0, mismatches);
+  LONGS_EQUAL(0, ring.readAvailable());
+  // Sanity check that the waiting paths were exercised
+  CHECK(readerWaits > 0);
+}
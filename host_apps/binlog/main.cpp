@@ -0,0 +1,220 @@
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "binary_log.h"
+#include "itm_logging.h"
+#include "packet_utils.h"
+#include "packets.h"
+
+#define println(format, ...) printf(format "\n", ##__VA_ARGS__)
+
+// ------- Format strings from firmware ELF --------
+
+static uint8_t* elfData;
+static long elfSize;
+
+// Loads ELF file. Returns false on failure.
+bool loadElf(const char* path)
+{
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  elfSize = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  elfData = new uint8_t[elfSize];
+  bool ok = fread(elfData, 1, elfSize, f) == (size_t)elfSize;
+  fclose(f);
+
+  Elf32_Ehdr* ehdr = (Elf32_Ehdr*)elfData;
+  if (!ok || elfSize < (long)sizeof(Elf32_Ehdr) ||     //
+      memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||         //
+      ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||          //
+      ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||          //
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf32_Shdr) > (unsigned long)elfSize) {
+    println("%s is not a 32-bit little-endian ELF file", path);
+    return false;
+  }
+  return true;
+}
+
+// Finds null-terminated string at target address, within sections loaded to the target
+const char* lookupElf(uint32_t address)
+{
+  Elf32_Ehdr* ehdr = (Elf32_Ehdr*)elfData;
+  Elf32_Shdr* shdrs = (Elf32_Shdr*)(elfData + ehdr->e_shoff);
+  for (uint32_t i = 0; i < ehdr->e_shnum; i++) {
+    Elf32_Shdr& sh = shdrs[i];
+    if (!(sh.sh_flags & SHF_ALLOC) || sh.sh_type == SHT_NOBITS || //
+        address < sh.sh_addr || address >= sh.sh_addr + sh.sh_size ||
+        sh.sh_offset + sh.sh_size > (unsigned long)elfSize) {
+      continue;
+    }
+    const char* str = (const char*)elfData + sh.sh_offset + (address - sh.sh_addr);
+    // Must be terminated within section
+    if (memchr(str, '\0', sh.sh_addr + sh.sh_size - address)) {
+      return str;
+    }
+  }
+  return nullptr;
+}
+
+// Prints all records in buffer
+void printRecords(const uint8_t* buf, uint32_t len)
+{
+  char out[1024];
+  uint32_t pos = 0;
+  while (pos + 4 <= len) {
+    uint32_t header;
+    memcpy(&header, buf + pos, 4);
+    uint32_t recordLen = min(binLogRecordLength(header), len - pos);
+    binLogFormat(out, sizeof(out), buf + pos, recordLen, lookupElf);
+    fputs(out, stdout);
+    pos += recordLen;
+  }
+}
+
+// ------- Packet stream --------
+
+// Decodes binary LogMessage packets, and prints everything else like monitor
+class PacketProcesser : public CanProcessPacket
+{
+public:
+  void processPacket(const Packet& packet)
+  {
+    const LogMessage& log = packet.body.logMessage;
+    if (packet.id == PacketID::LogMessage && (log.length & binaryLogFlag)) {
+      uint32_t len = min(log.length & ~binaryLogFlag, packet.length - minPacketSizeFromID(PacketID::LogMessage));
+      printRecords((const uint8_t*)log.msg, len);
+      return;
+    }
+    char buf[300];
+    snprintPacket(buf, sizeof(buf), packet);
+    println("%s", buf);
+  }
+};
+
+void readPackets()
+{
+  char buf[maxWrappedPacketLength * 2];
+  // How many bytes are leftover in buffer after parsing attempt
+  uint32_t bufLen = 0;
+
+  PacketProcesser processer;
+  PacketParser parser(processer);
+  parser.acceptCompact = true; // target may send either format
+
+  // Loop until file/stdin is closed
+  ssize_t numRead;
+  while ((numRead = read(STDIN_FILENO, buf + bufLen, sizeof(buf) - bufLen)) > 0) {
+    bufLen += numRead;
+    bufLen = parser.extractPackets(buf, bufLen);
+  }
+}
+
+// ------- ITM stream --------
+
+// Buffered byte reader for stdin.
+// Returns false at end of file.
+bool readByte(uint8_t& byte)
+{
+  static uint8_t buf[4096];
+  static ssize_t len = 0;
+  static ssize_t pos = 0;
+  if (pos == len) {
+    len = read(STDIN_FILENO, buf, sizeof(buf));
+    pos = 0;
+    if (len <= 0) {
+      return false;
+    }
+  }
+  byte = buf[pos++];
+  return true;
+}
+
+/*
+ * Reads raw ITM packets from SWO capture.
+ * Text from the print port is passed through, and records
+ * from the binary log port are decoded.
+ * Other ports, timestamps, and hardware packets are skipped.
+ */
+void readItm()
+{
+  uint8_t record[4 * (binLogMaxArgWords + 1)];
+  uint32_t recordLen = 0;
+  uint8_t byte;
+
+  while (readByte(byte)) {
+    if (byte == 0x00 || byte == 0x80) {
+      // Part of a sync packet
+      continue;
+    }
+
+    if (byte == 0x70) {
+      // Overflow. Partial record can't be trusted.
+      println("<ITM overflow>");
+      recordLen = 0;
+      continue;
+    }
+
+    if ((byte & 0x03) == 0) {
+      // Timestamp or extension packet. Skip continuation bytes.
+      uint8_t next = byte;
+      while ((next & 0x80) && readByte(next)) {
+      }
+      continue;
+    }
+
+    // Source packet
+    uint32_t size = 1 << ((byte & 0x03) - 1);
+    uint8_t payload[4] = {};
+    for (uint32_t i = 0; i < size; i++) {
+      if (!readByte(payload[i])) {
+        return;
+      }
+    }
+    bool hardware = byte & 0x04;
+    uint32_t port = byte >> 3;
+
+    if (hardware) {
+      continue;
+    }
+
+    if (port == static_cast<uint32_t>(ItmPort::Print)) {
+      fwrite(payload, 1, size, stdout);
+    } else if (port == static_cast<uint32_t>(ItmPort::BinaryLog) && size == 4) {
+      memcpy(record + recordLen, payload, 4);
+      recordLen += 4;
+      uint32_t header;
+      memcpy(&header, record, 4);
+      if (recordLen == binLogRecordLength(header)) {
+        printRecords(record, recordLen);
+        recordLen = 0;
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2 || (argc == 3 && strcmp(argv[2], "--itm")) || argc > 3) {
+    println("Usage: %s <firmware.elf> [--itm] < input", argv[0]);
+    println("Decodes binary log records in LogMessage packets, or in raw ITM (SWO) data with --itm");
+    return 1;
+  }
+
+  if (!loadElf(argv[1])) {
+    return 1;
+  }
+
+  if (argc == 3) {
+    readItm();
+  } else {
+    readPackets();
+  }
+  return 0;
+}
@@ -4,11 +4,13 @@
 #include <fcntl.h>
 #include <iostream>
 #include <poll.h>
+#include <random>
 #include <stdlib.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arq.h"
 #include "basic.h"
 #include "packet_utils.h"
 #include "packets.h"
@@ -135,6 +137,40 @@ class PacketProcesser : public CanProcessPacket
 public:
   // What to do with incoming packets over serial
   void processPacket(const Packet& packet)
+  {
+    // Parsing errors aren't sequenced
+    if (!arqReceiver || packet.origin == PacketOrigin::Internal) {
+      showPacket(packet);
+      return;
+    }
+
+    if (packet.id == PacketID::ArqAck) {
+      arqSender->processAck(packet.body.arqAck);
+      return;
+    }
+
+    // Ack even if dropped, since target may have missed the last ack
+    ackNeeded = true;
+    if (!arqReceiver->receive(packet)) {
+      println("Dropped duplicate packet %u", packet.sequenceNum);
+    }
+
+    // Show everything that's now in order
+    const Packet* next;
+    while ((next = arqReceiver->nextInOrder())) {
+      showPacket(*next);
+    }
+  }
+
+  // Optional reliable delivery. Set both or neither.
+  ArqSender* arqSender = nullptr;
+  ArqReceiver* arqReceiver = nullptr;
+
+  // Whether anything was received since the last ack
+  bool ackNeeded = false;
+
+private:
+  void showPacket(const Packet& packet)
   {
     // Display contents
     // printHex(&packet, packet.length);
@@ -170,6 +206,7 @@ public:
 // Available options
 static struct argp_option options[] = { //
   { "device", 'd', "DEVICE", 0, "Serial port to use. Default: " DEFAULT_SERIAL_PORT },
+  { "reliable", 'r', 0, 0, "Ack and resend packets. Target must be built with USE_ARQ" },
   { 0 }
 };
 
@@ -180,6 +217,7 @@ static char doc[] = "See readme for more detailed usage information";
 struct arguments
 {
   char* device;
+  bool reliable;
 };
 
 // How to parse a single option or argument
@@ -192,6 +230,10 @@ static error_t parse_arg(int key, char* arg, struct argp_state* state)
       arguments->device = arg;
       break;
 
+    case 'r': //
+      arguments->reliable = true;
+      break;
+
     case ARGP_KEY_ARG:
       // Unexpected additional arguments
       argp_usage(state);
@@ -212,11 +254,12 @@ int main(int argc, char** argv)
 
   // Default argument values
   arguments.device = (char*)DEFAULT_SERIAL_PORT;
+  arguments.reliable = false;
 
   // Parse program arguments
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
-  println("Launching on %s", arguments.device);
+  println("Launching on %s%s", arguments.device, arguments.reliable ? " with reliable delivery" : "");
 
   // Open (b)inary files for (w)riting:
 
@@ -247,6 +290,28 @@ int main(int argc, char** argv)
   // https://blog.feabhas.com/2014/03/demystifying-c-lambdas/
   auto seq = [&sequencer](WrappedPacket& wrap) -> WrappedPacket& { return sequencer.rewrap(wrap); };
 
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Arq timing is in milliseconds
+  auto msNow = [&start]() -> uint32_t { return usSince(start) / 1000; };
+
+  // Random start marks this as a new session to the target
+  ArqSender arqSender(std::random_device{}());
+  ArqReceiver arqReceiver;
+
+  // Sends packet to target, either with arq, or just sequenced
+  auto send = [&](WrappedPacket& wrap) {
+    if (!arguments.reliable) {
+      writeToMonitorAndSerialOut(seq(wrap));
+    } else if (!arqSender.canSend()) {
+      println("Target isn't acking. Dropping packet");
+    } else {
+      arqSender.send(wrap.packet, msNow());
+      writeToMonitorAndSerialOut(setPacketWrapper(wrap));
+    }
+  };
+
   WrappedPacket heartbeat;
   initializePacket(heartbeat.packet, PacketID::Heartbeat);
   heartbeat.packet.origin = PacketOrigin::HostToTarget;
@@ -289,18 +354,26 @@ int main(int argc, char** argv)
 
   PacketProcesser processer;
   PacketParser parser(processer);
+  parser.acceptCompact = true; // target may send either format
+
+  if (arguments.reliable) {
+    processer.arqSender = &arqSender;
+    processer.arqReceiver = &arqReceiver;
+    // Arq does its own ordering, so gaps aren't errors
+    parser.checkSequence = false;
+  }
+
+  // Wake up often enough to resend lost packets
+  const int pollTimeoutMs = arguments.reliable ? 10 : 1000;
 
   const uint64_t usBetweenHeartbeats = 1E6;
 
-  struct timespec start;
-  clock_gettime(CLOCK_MONOTONIC, &start);
   uint64_t nextHeartbeat = usSince(start);
 
   bool quit = false;
   while (!quit) {
     // Wait for new data on one of the watched interfaces.
-    // Timeout after 1000ms
-    int ret = poll(fds, sizeof(fds) / sizeof(fds[0]), 1000);
+    int ret = poll(fds, sizeof(fds) / sizeof(fds[0]), pollTimeoutMs);
 
     // Check for errors
     if (ret == -1) {
@@ -355,7 +428,7 @@ int main(int argc, char** argv)
                     data.node,
                     data.frequency / 10,
                     data.frequency % 10);
-            writeToMonitorAndSerialOut(seq(freqPkt));
+            send(freqPkt);
             break;
           }
           case 'd': {
@@ -366,7 +439,7 @@ int main(int argc, char** argv)
                     data.node,
                     data.frequency / 10,
                     data.frequency % 10);
-            writeToMonitorAndSerialOut(seq(freqPkt));
+            send(freqPkt);
             break;
           }
           case 'z': {
@@ -377,7 +450,7 @@ int main(int argc, char** argv)
                     data.node,
                     data.frequency / 10,
                     data.frequency % 10);
-            writeToMonitorAndSerialOut(seq(freqPkt));
+            send(freqPkt);
             break;
           }
           case ' ': {
@@ -390,7 +463,7 @@ int main(int argc, char** argv)
                     data.node,
                     data.frequency / 10,
                     data.frequency % 10);
-            writeToMonitorAndSerialOut(seq(freqPkt));
+            send(freqPkt);
             break;
           }
           case 'n': {
@@ -410,14 +483,35 @@ int main(int argc, char** argv)
           default: break;
         }
       }
-    } else {
+    } else if (!arguments.reliable) {
       println("Timeout");
     }
 
+    if (arguments.reliable) {
+      // One ack covers everything parsed this pass
+      if (processer.ackNeeded) {
+        processer.ackNeeded = false;
+        WrappedPacket ack;
+        initializePacket(ack.packet, PacketID::ArqAck);
+        ack.packet.origin = PacketOrigin::HostToTarget;
+        ack.packet.sequenceNum = 0; // acks are unsequenced
+        ack.packet.body.arqAck = arqReceiver.ack();
+        writeToMonitorAndSerialOut(setPacketWrapper(ack));
+      }
+
+      // Resend anything lost
+      const Packet* lost;
+      while ((lost = arqSender.nextRetransmit(msNow()))) {
+        WrappedPacket wrap;
+        memcpy(&wrap.packet, lost, lost->length);
+        writeToMonitorAndSerialOut(setPacketWrapper(wrap));
+      }
+    }
+
     // Send heartbeat periodically
     uint64_t t = usSince(start);
     if (t > nextHeartbeat) {
-      writeToMonitorAndSerialOut(seq(heartbeat));
+      send(heartbeat);
       nextHeartbeat += usBetweenHeartbeats;
     }
 
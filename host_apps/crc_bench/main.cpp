@@ -0,0 +1,147 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "modbus_defs.h"
+#include "packets.h"
+#include "software_crc.h"
+
+#define println(format, ...) printf(format "\n", ##__VA_ARGS__)
+
+// Get microseconds elapsed since the time of the passed argument
+uint64_t usSince(struct timespec& past)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - past.tv_sec) * 1E6 + (now.tv_nsec - past.tv_nsec) / 1E3;
+}
+
+template<typename T>
+struct CrcVariant
+{
+  const char* name;
+  T (*func)(const void*, uint32_t);
+};
+
+const CrcVariant<uint32_t> crc32Variants[] = {
+  { "bitwise", crc32Bitwise },
+  { "bytewise", crc32Bytewise },
+  { "slice4", crc32Slice4 },
+  { "slice8", crc32Slice8 },
+#if defined(CRC32_PCLMUL)
+  { "pclmul", crc32Pclmul },
+#endif
+};
+
+const CrcVariant<uint16_t> crc16Variants[] = {
+  { "bitwise", crc16Bitwise },
+  { "bytewise", crc16Bytewise },
+  { "slice4", crc16Slice4 },
+};
+
+// Sizes to benchmark.
+// Includes smallest and largest wrapped packets, since that's what we hash most often.
+const uint32_t crc32Sizes[] = {
+  wrappedPacketSizeFromID(PacketID::VfdSetFrequency),
+  maxWrappedPacketLength,
+  4096,
+  65536,
+  1 << 20,
+};
+
+// Modbus read request (8 bytes) and largest modbus packet
+const uint32_t crc16Sizes[] = {
+  ModbusHeaderAndCrcSize + sizeof(ModbusPacket::readMultipleRegistersRequest),
+  MaxModbusPktSize,
+  4096,
+};
+
+// How long to spend measuring each variant and size
+const uint64_t usPerMeasurement = 200000;
+
+static uint8_t buf[1 << 20];
+
+// Prevents compiler from optimizing-away unused results
+volatile uint32_t sink;
+
+// Returns throughput in MB/s
+template<typename TFunc>
+double measure(TFunc func, uint32_t len)
+{
+  uint64_t bytes = 0;
+  uint64_t elapsed;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    // Batch several calls between clock checks
+    for (int i = 0; i < 16; i++) {
+      sink = func(buf, len);
+      bytes += len;
+    }
+  } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+  return (double)bytes / elapsed; // bytes per us is MB/s
+}
+
+// Checks that all variants match the bitwise reference.
+// Returns false on mismatch.
+template<typename T, size_t TNum>
+bool verify(const CrcVariant<T> (&variants)[TNum])
+{
+  T expected = variants[0].func(buf, sizeof(buf));
+  for (auto& variant : variants) {
+    if (variant.func(buf, sizeof(buf)) != expected) {
+      println("%s mismatches bitwise reference", variant.name);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Prints a table of throughput for each variant and size
+template<typename T, size_t TNum, size_t TSizes>
+void report(const CrcVariant<T> (&variants)[TNum], const uint32_t (&sizes)[TSizes])
+{
+  printf("%10s", "bytes");
+  for (auto& variant : variants) {
+    printf("%10s", variant.name);
+  }
+  println();
+
+  for (auto len : sizes) {
+    printf("%10u", len);
+    for (auto& variant : variants) {
+      printf("%10.1f", measure(variant.func, len));
+    }
+    println();
+  }
+}
+
+int main()
+{
+  // Repeatable pseudo-random data
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < sizeof(buf); i++) {
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+
+  // Sanity check that all variants agree before timing them
+  if (!verify(crc32Variants) || !verify(crc16Variants)) {
+    return 1;
+  }
+
+  println("CRC-32 throughput in MB/s. crc32() uses CRC32_SLICES=%d", CRC32_SLICES);
+#if defined(CRC32_PCLMUL)
+  println("PCLMULQDQ %s", crc32PclmulSupported() ? "supported, used by crc32() for 64+ bytes" : "not supported, pclmul falls back to slice8");
+#endif
+  report(crc32Variants, crc32Sizes);
+  println();
+
+  println("CRC-16/Modbus throughput in MB/s. crc16() uses CRC16_SLICES=%d", CRC16_SLICES);
+  report(crc16Variants, crc16Sizes);
+
+  return 0;
+}
@@ -0,0 +1,462 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet_utils.h"
+#include "packets.h"
+
+#define println(format, ...) printf(format "\n", ##__VA_ARGS__)
+
+// Get microseconds elapsed since the time of the passed argument
+uint64_t usSince(struct timespec& past)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - past.tv_sec) * 1E6 + (now.tv_nsec - past.tv_nsec) / 1E3;
+}
+
+// Repeatable pseudo-random numbers
+uint32_t seed = 1;
+uint32_t rand32()
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+// Counts parsed packets and errors
+class CountingProcessor : public CanProcessPacket
+{
+public:
+  void processPacket(const Packet& packet)
+  {
+    // Parsing errors are generated internally
+    if (packet.origin == PacketOrigin::Internal) {
+      errors++;
+    } else {
+      packets++;
+    }
+  }
+
+  uint64_t packets = 0;
+  uint64_t errors = 0;
+};
+
+// Bytes per second on a UART at 115200 baud (8N1 is 10 bits per byte)
+const double uartBytesPerSec = 115200 / 10;
+
+// How long to spend measuring each format
+const uint64_t usPerMeasurement = 500000;
+
+// Size of simulated stream
+static uint8_t stream[1 << 24];
+
+// Packets to encode, one of each ID.
+// Skips the last two IDs:
+// - ArqAck, which is unsequenced, so would show up as a sequence error.
+// - Aggregate, which is covered separately.
+static WrappedPacket packets[static_cast<uint32_t>(PacketID::ArqAck)];
+const uint32_t numPackets = sizeof(packets) / sizeof(packets[0]);
+
+// Prevents compiler from optimizing-away unused results
+volatile uint32_t sink;
+
+// Fills packet with random body contents
+void fillPacket(WrappedPacket& wrap, PacketID id)
+{
+  memset(&wrap, 0, sizeof(wrap));
+  wrap.packet.id = id;
+  wrap.packet.origin = PacketOrigin::HostToTarget;
+  wrap.packet.length = packetSizeFromID(id);
+  for (uint32_t i = 0; i < packetBodySizeFromID(id); i++) {
+    reinterpret_cast<uint8_t*>(&wrap.packet.body)[i] = rand32();
+  }
+}
+
+// Encodes a stream of packets in either format, cycling through IDs.
+// Returns bytes used.
+uint32_t fillStream(bool compact)
+{
+  uint32_t pos = 0;
+  uint32_t seq = 1;
+  while (pos + maxWrappedPacketLength <= sizeof(stream)) {
+    for (auto& wrap : packets) {
+      if (pos + maxWrappedPacketLength > sizeof(stream)) {
+        break;
+      }
+      wrap.packet.sequenceNum = seq++;
+      if (compact) {
+        pos += encodeCompact(stream + pos, wrap.packet);
+      } else {
+        setPacketWrapper(wrap);
+        pos += copyWrapped(stream + pos, wrap);
+      }
+    }
+  }
+  return pos;
+}
+
+// Returns encoding throughput in packets per us
+double measureEncode(bool compact)
+{
+  uint64_t count = 0;
+  uint64_t elapsed;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    uint32_t seq = 1;
+    for (auto& wrap : packets) {
+      wrap.packet.sequenceNum = seq++;
+      if (compact) {
+        sink = encodeCompact(stream, wrap.packet);
+      } else {
+        setPacketWrapper(wrap);
+        sink = copyWrapped(stream, wrap);
+      }
+    }
+    count += numPackets;
+  } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+  return (double)count / elapsed;
+}
+
+// Returns parsing throughput in packets per us.
+// Also reports MB/s through `mbps`.
+double measureDecode(bool compact, uint32_t streamLen, double& mbps)
+{
+  uint64_t bytes = 0;
+  uint64_t count = 0;
+  uint64_t elapsed;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    CountingProcessor counter;
+    PacketParser parser(counter);
+    parser.acceptCompact = compact;
+    StaticParserRing<4096> ring;
+
+    uint32_t pos = 0;
+    while (pos < streamLen) {
+      uint32_t n = ring.writeSpace();
+      if (n > streamLen - pos) {
+        n = streamLen - pos;
+      }
+      memcpy(ring.writePtr(), stream + pos, n);
+      ring.commitWrite(n);
+      parser.extractPackets(ring);
+      pos += n;
+    }
+
+    if (counter.errors) {
+      println("unexpected parsing errors: %lu", counter.errors);
+    }
+    bytes += streamLen;
+    count += counter.packets;
+  } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+  mbps = (double)bytes / elapsed; // bytes per us is MB/s
+  return (double)count / elapsed;
+}
+
+// ------- Aggregation of small packets --------
+
+// Small packets, where the wrapper is most of the cost
+const PacketID smallIDs[] = {
+  PacketID::Heartbeat,
+  PacketID::VfdSetFrequency,
+  PacketID::ParsingErrorInvalidLength,
+  PacketID::ParsingErrorInvalidCRC,
+  PacketID::VfdStatus,
+};
+const uint32_t numSmallIDs = sizeof(smallIDs) / sizeof(smallIDs[0]);
+
+/*
+ * Fills aggregate with as many inner packets as fit, cycling through ids.
+ * Inner packets are numbered from seq.
+ * Returns number of inner packets.
+ */
+uint32_t fillAggregate(WrappedPacket& agg, const PacketID* ids, uint32_t numIds, uint32_t seq)
+{
+  initializePacket(agg.packet, PacketID::Aggregate);
+  agg.packet.origin = PacketOrigin::HostToTarget;
+  agg.packet.sequenceNum = seq;
+  uint32_t count = 0;
+  while (1) {
+    Packet& inner = packets[static_cast<uint32_t>(ids[count % numIds])].packet;
+    inner.sequenceNum = seq + count;
+    if (!appendToAggregate(agg.packet, inner)) {
+      return count;
+    }
+    count++;
+  }
+}
+
+// Encodes a stream of small packets, either individually or aggregated.
+// Returns bytes used.
+uint32_t fillSmallStream(bool compact, bool aggregate)
+{
+  WrappedPacket agg;
+  uint32_t pos = 0;
+  uint32_t seq = 1;
+  while (pos + maxWrappedPacketLength <= sizeof(stream)) {
+    WrappedPacket* wrap;
+    if (aggregate) {
+      wrap = &agg;
+      seq += fillAggregate(agg, smallIDs, numSmallIDs, seq);
+    } else {
+      wrap = &packets[static_cast<uint32_t>(smallIDs[seq % numSmallIDs])];
+      wrap->packet.sequenceNum = seq++;
+    }
+    if (compact) {
+      pos += encodeCompact(stream + pos, wrap->packet);
+    } else {
+      setPacketWrapper(*wrap);
+      pos += copyWrapped(stream + pos, *wrap);
+    }
+  }
+  return pos;
+}
+
+// Prints wire cost of sending small packets individually or aggregated
+void reportAggregation()
+{
+  WrappedPacket agg;
+
+  println("Aggregated small packets, wire cost per packet, and packets/s at 115200 baud");
+  println("%28s %6s %8s %8s %8s %8s %8s %8s",
+          "id",
+          "count",
+          "wrapped",
+          "wrap agg",
+          "cmpt agg",
+          "wrap/s",
+          "wagg/s",
+          "cagg/s");
+  for (PacketID id : smallIDs) {
+    uint32_t count = fillAggregate(agg, &id, 1, 1);
+    double wrapped = wrappedPacketSizeFromID(id);
+    double wrapAgg = (double)wrappedPacketSize(agg) / count;
+    double compactAgg = (double)encodeCompact(stream, agg.packet) / count;
+    println("%28s %6u %8.0f %8.1f %8.1f %8.0f %8.0f %8.0f",
+            packetIdToString(id),
+            count,
+            wrapped,
+            wrapAgg,
+            compactAgg,
+            uartBytesPerSec / wrapped,
+            uartBytesPerSec / wrapAgg,
+            uartBytesPerSec / compactAgg);
+  }
+  println();
+
+  println("Host throughput, cycling through small IDs");
+  println("%10s %10s %12s %12s", "format", "bytes/pkt", "decode Mp/s", "decode MB/s");
+  const char* names[] = { "wrapped", "compact", "wrap agg", "cmpt agg" };
+  for (int aggregate = 0; aggregate < 2; aggregate++) {
+    for (int compact = 0; compact < 2; compact++) {
+      uint32_t streamLen = fillSmallStream(compact, aggregate);
+      double mbps;
+      double decodeRate = measureDecode(compact, streamLen, mbps);
+      println("%10s %10.1f %12.1f %12.1f", names[aggregate * 2 + compact], mbps / decodeRate, decodeRate, mbps);
+    }
+  }
+  println();
+}
+
+// ------- Noisy stream comparison --------
+
+enum class Format
+{
+  Wrapped,
+  Compact,
+  CobsWrapped,
+  CobsCompact,
+};
+
+const char* formatNames[] = { "wrapped", "compact", "cobs+wrap", "cobs+cmpt" };
+
+enum class Noise
+{
+  BitFlips,    // A single bit flip
+  FalseStarts, // 64 bytes of garbage made of sync words
+};
+
+const char* noiseNames[] = { "bit flips", "false starts" };
+
+// One in this many packets is damaged
+const uint32_t damageIntervals[] = { 1000, 100, 10, 2 };
+
+/*
+ * Fills stream with packets in the given format, cycling through IDs,
+ * then damages one in `interval` packets.
+ * Returns bytes used. `sent` is set to number of packets.
+ */
+uint32_t fillNoisyStream(Format format, Noise noise, uint32_t interval, uint32_t& sent)
+{
+  uint8_t frame[maxWrappedPacketLength];
+  uint32_t pos = 0;
+  uint32_t seq = 1;
+  sent = 0;
+
+  // Leave room for largest frame plus garbage
+  while (pos + cobsMaxFrameLength(maxWrappedPacketLength) + 64 <= sizeof(stream)) {
+    WrappedPacket& wrap = packets[seq % numPackets];
+    wrap.packet.sequenceNum = seq++;
+    sent++;
+
+    uint32_t len;
+    bool compact = format == Format::Compact || format == Format::CobsCompact;
+    if (compact) {
+      len = encodeCompact(frame, wrap.packet);
+    } else {
+      setPacketWrapper(wrap);
+      len = copyWrapped(frame, wrap);
+    }
+
+    uint32_t start = pos;
+    if (format == Format::CobsWrapped || format == Format::CobsCompact) {
+      pos += cobsEncode(stream + pos, frame, len);
+    } else {
+      memcpy(stream + pos, frame, len);
+      pos += len;
+    }
+
+    if (rand32() % interval == 0) {
+      if (noise == Noise::BitFlips) {
+        stream[start + rand32() % (pos - start)] ^= 1 << (rand32() % 8);
+      } else {
+        for (uint32_t i = 0; i < 64; i += 4) {
+          memcpy(stream + pos + i, &startWord, sizeof(startWord));
+        }
+        pos += 64;
+      }
+    }
+  }
+  return pos;
+}
+
+struct NoisyResult
+{
+  double mbps;
+  uint64_t good;
+  uint64_t errors;
+};
+
+// Parses stream in the given format, in chunks through a ring
+NoisyResult measureNoisy(Format format, uint32_t streamLen)
+{
+  NoisyResult result{};
+  uint64_t bytes = 0;
+  uint64_t elapsed;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    CountingProcessor counter;
+    PacketParser parser(counter);
+    parser.acceptCompact = format == Format::Compact;
+    parser.framing = format == Format::CobsWrapped || format == Format::CobsCompact ? LinkFraming::Cobs : LinkFraming::Raw;
+    StaticParserRing<4096> ring;
+
+    uint32_t pos = 0;
+    while (pos < streamLen) {
+      uint32_t n = ring.writeSpace();
+      if (n > streamLen - pos) {
+        n = streamLen - pos;
+      }
+      memcpy(ring.writePtr(), stream + pos, n);
+      ring.commitWrite(n);
+      parser.extractPackets(ring);
+      pos += n;
+    }
+
+    bytes += streamLen;
+    result.good = counter.packets;
+    result.errors = counter.errors;
+  } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+  result.mbps = (double)bytes / elapsed; // bytes per us is MB/s
+  return result;
+}
+
+// Prints a table for each kind of noise
+void reportNoisy()
+{
+  for (int noise = 0; noise < 2; noise++) {
+    println("Noisy stream with %s, cycling through all IDs", noiseNames[noise]);
+    println("%10s %9s %10s %8s %8s %10s", "format", "damaged", "bytes/pkt", "good %", "errs/dmg", "parse MB/s");
+    for (uint32_t interval : damageIntervals) {
+      for (int format = 0; format < 4; format++) {
+        uint32_t sent;
+        seed = 1;
+        uint32_t streamLen = fillNoisyStream(static_cast<Format>(format), static_cast<Noise>(noise), interval, sent);
+        uint32_t damaged = sent / interval;
+        NoisyResult result = measureNoisy(static_cast<Format>(format), streamLen);
+        println("%10s %8.1f%% %10.1f %7.2f%% %8.1f %10.1f",
+                formatNames[format],
+                100.0 / interval,
+                (double)streamLen / sent,
+                100.0 * result.good / sent,
+                (double)result.errors / damaged,
+                result.mbps);
+      }
+    }
+    println();
+  }
+}
+
+int main()
+{
+  for (uint32_t i = 0; i < numPackets; i++) {
+    fillPacket(packets[i], static_cast<PacketID>(i));
+  }
+
+  println("Wire cost per packet, and packets/s at 115200 baud");
+  println("%28s %6s %8s %8s %8s %8s %8s %8s",
+          "id",
+          "body",
+          "wrapped",
+          "compact",
+          "wrap gp",
+          "cmpt gp",
+          "wrap/s",
+          "cmpt/s");
+  for (uint32_t i = 0; i < numPackets; i++) {
+    PacketID id = static_cast<PacketID>(i);
+    uint32_t body = packetBodySizeFromID(id);
+    uint32_t wrapped = wrappedPacketSizeFromID(id);
+    uint32_t compact = compactFrameSizeFromID(id);
+    println("%28s %6u %8u %8u %7.0f%% %7.0f%% %8.0f %8.0f",
+            packetIdToString(id),
+            body,
+            wrapped,
+            compact,
+            100.0 * body / wrapped,
+            100.0 * body / compact,
+            uartBytesPerSec / wrapped,
+            uartBytesPerSec / compact);
+  }
+  println();
+
+  println("Host throughput, cycling through all IDs");
+  println("%8s %12s %12s %12s", "format", "encode Mp/s", "decode Mp/s", "decode MB/s");
+  const char* names[] = { "wrapped", "compact" };
+  for (int compact = 0; compact < 2; compact++) {
+    uint32_t streamLen = fillStream(compact);
+    double mbps;
+    double decodeRate = measureDecode(compact, streamLen, mbps);
+    println("%8s %12.1f %12.1f %12.1f", names[compact], measureEncode(compact), decodeRate, mbps);
+  }
+  println();
+
+  reportAggregation();
+
+  reportNoisy();
+
+  return 0;
+}
@@ -40,6 +40,7 @@ int main()
 
   PacketProcesser processer;
   PacketParser parser(processer);
+  parser.acceptCompact = true; // target may send either format
 
   // Loop until file/stdin is closed
   while (1) {
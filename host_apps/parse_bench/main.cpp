@@ -0,0 +1,401 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet_utils.h"
+#include "packets.h"
+
+#define println(format, ...) printf(format "\n", ##__VA_ARGS__)
+
+// Get microseconds elapsed since the time of the passed argument
+uint64_t usSince(struct timespec& past)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - past.tv_sec) * 1E6 + (now.tv_nsec - past.tv_nsec) / 1E3;
+}
+
+// Repeatable pseudo-random numbers
+uint32_t seed = 1;
+uint32_t rand32()
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+// Counts parsed packets and errors
+class CountingProcessor : public CanProcessPacket
+{
+public:
+  void processPacket(const Packet& packet)
+  {
+    // Parsing errors are generated internally
+    if (packet.origin == PacketOrigin::Internal) {
+      errors++;
+    } else {
+      packets++;
+    }
+  }
+
+  uint64_t packets = 0;
+  uint64_t errors = 0;
+};
+
+// Size of simulated stream
+static uint8_t stream[1 << 24];
+
+// How many bytes are fed to the parser at once.
+// Similar to a single read() in host apps.
+const uint32_t chunkSize = 4096;
+
+// Garbage fraction of stream, in percent
+const uint32_t garbageDensities[] = { 0, 50, 90, 99, 100 };
+
+// How long to spend measuring each density
+const uint64_t usPerMeasurement = 500000;
+
+/*
+ * Fills stream with VfdSetFrequency packets separated by
+ * random garbage, so that `density` percent of bytes are garbage.
+ * Returns number of packets written.
+ */
+uint32_t fillStream(uint32_t density)
+{
+  const uint32_t pktLen = wrappedPacketSizeFromID(PacketID::VfdSetFrequency);
+  // Average garbage run length between packets, to achieve density
+  uint32_t avgGarbage = density == 100 ? 0 : pktLen * density / (100 - density);
+
+  WrappedPacket wrap;
+  uint32_t pos = 0;
+  uint32_t seq = 1;
+  while (pos + 2 * avgGarbage + pktLen <= sizeof(stream)) {
+    uint32_t garbage = density == 100 ? sizeof(stream) : (avgGarbage ? rand32() % (2 * avgGarbage + 1) : 0);
+    for (uint32_t i = 0; i < garbage && pos < sizeof(stream); i++) {
+      stream[pos++] = rand32();
+    }
+    if (density == 100) {
+      break;
+    }
+    fillFreqPacket(wrap, seq++, 1, 600);
+    wrap.packet.origin = PacketOrigin::TargetToHost;
+    setPacketWrapper(wrap);
+    pos += copyWrapped(stream + pos, wrap);
+  }
+  // Pad remainder with garbage
+  while (pos < sizeof(stream)) {
+    stream[pos++] = rand32();
+  }
+  return seq - 1;
+}
+
+// Feeds the entire stream to a parser in chunks, as a host app would.
+void parseStream(PacketParser& parser)
+{
+  static uint8_t buf[chunkSize + maxWrappedPacketLength];
+  uint32_t leftover = 0;
+  parser.lastSeqNum = 0;
+
+  for (uint32_t pos = 0; pos < sizeof(stream); pos += chunkSize) {
+    memcpy(buf + leftover, stream + pos, chunkSize);
+    leftover = parser.extractPackets(buf, leftover + chunkSize);
+  }
+}
+
+// Same as above, but parses from a ring buffer, so leftover bytes are never moved.
+void parseStreamRing(PacketParser& parser)
+{
+  static StaticParserRing<chunkSize + maxWrappedPacketLength> ring;
+  ring.consume(ring.len); // Discard leftovers from previous pass
+  parser.lastSeqNum = 0;
+
+  for (uint32_t pos = 0; pos < sizeof(stream); pos += chunkSize) {
+    // May take two copies if chunk wraps around end of ring
+    uint32_t copied = 0;
+    while (copied < chunkSize) {
+      uint32_t n = min(chunkSize - copied, ring.writeSpace());
+      memcpy(ring.writePtr(), stream + pos + copied, n);
+      ring.commitWrite(n);
+      copied += n;
+    }
+    parser.extractPackets(ring);
+  }
+}
+
+// Linear and ring versions, measured side by side
+void (*const parseFuncs[])(PacketParser&) = { parseStream, parseStreamRing };
+
+// Reference scan that checks one byte at a time, like the parser used to
+uint32_t findStartWordBytewise(const uint8_t* buf, uint32_t start, uint32_t end)
+{
+  while (start < end) {
+    uint32_t word;
+    memcpy(&word, buf + start, sizeof(word));
+    if (word == startWord) {
+      break;
+    }
+    start++;
+  }
+  return start;
+}
+
+// ------- Adversarial scenarios --------
+
+enum class Scenario
+{
+  Clean,           // Back-to-back packets of every PacketID
+  BitFlips,        // A random bit flipped in some packets
+  DroppedBytes,    // A few bytes missing from some packets
+  FalseStartWords, // startWord followed by a plausible header, but not a real packet
+  Truncated,       // Some packets cut short
+  NumScenarios,
+};
+
+const char* scenarioToString(Scenario scenario)
+{
+  switch (scenario) {
+    case Scenario::Clean: return "clean";
+    case Scenario::BitFlips: return "bit flips";
+    case Scenario::DroppedBytes: return "dropped";
+    case Scenario::FalseStartWords: return "false start";
+    case Scenario::Truncated: return "truncated";
+    case Scenario::NumScenarios: break;
+  }
+  return "?";
+}
+
+// One in this many packets is damaged in the non-clean scenarios
+const uint32_t damageInterval = 8;
+
+// Fills wrap with a valid packet, cycling through every PacketID.
+// Skips the last two IDs:
+// - ArqAck, which is unsequenced, so would show up as a sequence error.
+// - Aggregate, since a random body isn't a valid aggregate.
+void fillNextPacket(WrappedPacket& wrap, uint32_t seq)
+{
+  initializePacket(wrap.packet, static_cast<PacketID>(seq % static_cast<uint32_t>(PacketID::ArqAck)));
+  wrap.packet.origin = PacketOrigin::TargetToHost;
+  wrap.packet.sequenceNum = seq;
+  uint8_t* body = (uint8_t*)&wrap.packet.body;
+  for (uint32_t i = 0; i < packetBodySizeFromID(wrap.packet.id); i++) {
+    body[i] = rand32();
+  }
+  setPacketWrapper(wrap);
+}
+
+/*
+ * Fills stream with packets, damaged according to scenario.
+ * Always generates the same stream for a given scenario.
+ * Returns number of packets written (including damaged ones).
+ */
+uint32_t fillScenario(Scenario scenario)
+{
+  seed = 1;
+  WrappedPacket wrap;
+  uint32_t pos = 0;
+  uint32_t seq = 1;
+
+  // Leave room for the largest packet plus any extra bytes
+  while (pos + 2 * maxWrappedPacketLength <= sizeof(stream)) {
+    fillNextPacket(wrap, seq++);
+    uint8_t* raw = (uint8_t*)&wrap;
+    uint32_t len = wrappedPacketSize(wrap);
+    bool damage = scenario != Scenario::Clean && rand32() % damageInterval == 0;
+
+    if (damage && scenario == Scenario::FalseStartWords) {
+      // Fake header with valid length and ID, so parser waits for
+      // the whole "packet" before the crc check fails.
+      WrappedPacket fake;
+      fillNextPacket(fake, seq);
+      fake.crc = rand32();
+      pos += mymemcpy(stream + pos, &fake, wrapperLength + minPacketLength);
+    }
+
+    if (damage && scenario == Scenario::BitFlips) {
+      uint32_t bit = rand32() % (len * 8);
+      raw[bit / 8] ^= 1 << (bit % 8);
+    }
+
+    if (damage && scenario == Scenario::DroppedBytes) {
+      // Remove 1 to 8 bytes from somewhere in the packet
+      uint32_t drop = 1 + rand32() % 8;
+      uint32_t at = rand32() % (len - drop);
+      memmove(raw + at, raw + at + drop, len - at - drop);
+      len -= drop;
+    }
+
+    if (damage && scenario == Scenario::Truncated) {
+      len = rand32() % len;
+    }
+
+    pos += mymemcpy(stream + pos, raw, len);
+  }
+
+  // Pad remainder with garbage
+  while (pos < sizeof(stream)) {
+    stream[pos++] = rand32();
+  }
+  return seq - 1;
+}
+
+// Largest and smallest chunks fed to the parser in scenarios
+const uint32_t minChunk = 1;
+const uint32_t maxChunk = 4096;
+
+/*
+ * Feeds the entire stream to a ring parser in random-sized chunks.
+ * Chunk sizes are the same on every pass.
+ * Returns slowest single call to extractPackets() in nanoseconds.
+ */
+uint64_t parseStreamRandomChunks(PacketParser& parser)
+{
+  static StaticParserRing<maxChunk + maxWrappedPacketLength> ring;
+  ring.consume(ring.len); // Discard leftovers from previous pass
+  parser.lastSeqNum = 0;
+
+  uint32_t chunkSeed = 1;
+  uint64_t worstNs = 0;
+
+  uint32_t pos = 0;
+  while (pos < sizeof(stream)) {
+    chunkSeed = chunkSeed * 1103515245 + 12345;
+    uint32_t chunk = min<uint32_t>(minChunk + (chunkSeed >> 8) % (maxChunk - minChunk + 1), sizeof(stream) - pos);
+
+    uint32_t copied = 0;
+    while (copied < chunk) {
+      uint32_t n = min(chunk - copied, ring.writeSpace());
+      memcpy(ring.writePtr(), stream + pos + copied, n);
+      ring.commitWrite(n);
+      copied += n;
+    }
+    pos += chunk;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    parser.extractPackets(ring);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    uint64_t ns = (end.tv_sec - start.tv_sec) * 1000000000ull + (end.tv_nsec - start.tv_nsec);
+    worstNs = max(worstNs, ns);
+  }
+  return worstNs;
+}
+
+// Prints a table of parser performance for each scenario
+void reportScenarios()
+{
+  println("extractPackets() with %u to %u byte chunks, 1 in %u packets damaged", minChunk, maxChunk, damageInterval);
+  println("%12s%10s%12s%12s%12s%12s%12s",
+          "scenario",
+          "MB/s",
+          "packets/s",
+          "sent/pass",
+          "good/pass",
+          "errors/pass",
+          "worst us");
+
+  for (uint32_t i = 0; i < static_cast<uint32_t>(Scenario::NumScenarios); i++) {
+    Scenario scenario = static_cast<Scenario>(i);
+    uint32_t sent = fillScenario(scenario);
+
+    CountingProcessor counter;
+    PacketParser parser(counter);
+
+    uint64_t bytes = 0;
+    uint64_t elapsed;
+    uint32_t passes = 0;
+    uint64_t worstNs = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    do {
+      worstNs = max(worstNs, parseStreamRandomChunks(parser));
+      bytes += sizeof(stream);
+      passes++;
+    } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+    println("%12s%10.1f%12.0f%12u%12lu%12lu%12.1f",
+            scenarioToString(scenario),
+            (double)bytes / elapsed,
+            counter.packets * 1E6 / elapsed,
+            sent,
+            counter.packets / passes,
+            counter.errors / passes,
+            worstNs / 1E3);
+  }
+}
+
+// Prevents compiler from optimizing-away unused results
+volatile uint32_t sink;
+
+// Returns throughput in MB/s of scanning entire stream with func
+template<typename TFunc>
+double measureScan(TFunc func)
+{
+  uint64_t bytes = 0;
+  uint64_t elapsed;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  do {
+    sink = func(stream, 0, sizeof(stream) - 3);
+    bytes += sizeof(stream);
+  } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+  return (double)bytes / elapsed; // bytes per us is MB/s
+}
+
+int main()
+{
+  println("Start word scan over pure garbage in MB/s");
+  fillStream(100);
+  println("%10s%10s", "bytewise", "fast");
+  println("%10.1f%10.1f", measureScan(findStartWordBytewise), measureScan(findStartWord));
+  println();
+
+  println("extractPackets() with %u byte chunks", chunkSize);
+  println("%10s%10s%10s%12s%12s", "garbage %", "MB/s", "ring MB/s", "packets/s", "errors/s");
+
+  for (auto density : garbageDensities) {
+    uint32_t expectedPackets = fillStream(density);
+    printf("%10u", density);
+
+    for (auto parseFunc : parseFuncs) {
+      CountingProcessor counter;
+      PacketParser parser(counter);
+
+      uint64_t bytes = 0;
+      uint64_t elapsed;
+      uint32_t passes = 0;
+
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      do {
+        parseFunc(parser);
+        bytes += sizeof(stream);
+        passes++;
+      } while ((elapsed = usSince(start)) < usPerMeasurement);
+
+      if (counter.packets != (uint64_t)expectedPackets * passes) {
+        println();
+        println("Expected %u packets per pass, got %lu", expectedPackets, counter.packets / passes);
+        return 1;
+      }
+
+      printf("%10.1f", (double)bytes / elapsed);
+
+      // Packet and error rates are similar for both, so just show ring version
+      if (parseFunc == parseStreamRing) {
+        println("%12.0f%12.0f", counter.packets * 1E6 / elapsed, counter.errors * 1E6 / elapsed);
+      }
+    }
+  }
+  println();
+
+  reportScenarios();
+
+  return 0;
+}
@@ -139,11 +139,18 @@ public:
 // #define DEFAULT_SERIAL_PORT "/dev/ttyUSB0"
 // 115200 baud is 11520 bytes per second (10 bits per byte with start and stop bit)
 #define DEFAULT_BYTE_RATE "11520"
+// Capacity of slowest link in loopback path, for reporting utilization.
+// Same as default byterate.
+#define DEFAULT_LINE_RATE "11520"
+// Full size dummy payload
+#define DEFAULT_PAYLOAD "64"
 
 // Available options
 static struct argp_option options[] = { //
   { "device", 'd', "DEVICE", 0, "Serial port to use. Default: " DEFAULT_SERIAL_PORT },
   { "byterate", 'b', "BYTERATE", 0, "Bytes per second. Default: " DEFAULT_BYTE_RATE },
+  { "payload", 'p', "PAYLOAD", 0, "Dummy payload bytes per packet, 0 to 64. Default: " DEFAULT_PAYLOAD },
+  { "linerate", 'l', "LINERATE", 0, "Line capacity in bytes per second, for reporting utilization. Default: " DEFAULT_LINE_RATE },
   { 0 }
 };
 
@@ -155,6 +162,8 @@ struct arguments
 {
   char* device;
   char* byterate;
+  char* payload;
+  char* linerate;
 };
 
 // How to parse a single option or argument
@@ -171,6 +180,14 @@ static error_t parse_arg(int key, char* arg, struct argp_state* state)
       arguments->byterate = arg;
       break;
 
+    case 'p': //
+      arguments->payload = arg;
+      break;
+
+    case 'l': //
+      arguments->linerate = arg;
+      break;
+
     case ARGP_KEY_ARG:
       // Unexpected additional arguments
       argp_usage(state);
@@ -192,12 +209,19 @@ int main(int argc, char** argv)
   // Default argument values
   arguments.device = (char*)DEFAULT_SERIAL_PORT;
   arguments.byterate = (char*)DEFAULT_BYTE_RATE;
+  arguments.payload = (char*)DEFAULT_PAYLOAD;
+  arguments.linerate = (char*)DEFAULT_LINE_RATE;
 
   // Parse program arguments
   argp_parse(&argp, argc, argv, 0, 0, &arguments);
 
   int bytesPerSecond = atoi(arguments.byterate);
-  println("Launching on %s with byterate %d", arguments.device, bytesPerSecond);
+  int lineRate = atoi(arguments.linerate);
+  uint32_t payloadLen = atoi(arguments.payload);
+  if (payloadLen > sizeof(DummyPacket::payload)) {
+    payloadLen = sizeof(DummyPacket::payload);
+  }
+  println("Launching on %s with byterate %d and %u byte payload", arguments.device, bytesPerSecond, payloadLen);
 
   uint8_t dummyData[100];
   static_assert(sizeof(DummyPacket::payload) <= sizeof(dummyData));
@@ -215,8 +239,7 @@ int main(int argc, char** argv)
   PacketProcesser processer;
   PacketParser parser(processer);
 
-  char buf[10000]; // for content we get back from the device
-  size_t len = 0;
+  StaticParserRing<10000> ring; // for content we get back from the device
 
   const int reportingHz = 10;
   const uint64_t usBetweenReports = 1E6 / reportingHz;
@@ -236,7 +259,7 @@ int main(int argc, char** argv)
   struct pollfd fds[] = { { fd : serialFileno, events : POLLIN } };
 
   // Calculate delays based on byterate
-  const uint32_t pktOutSize = wrappedPacketSizeFromID(PacketID::DummyPacket);
+  const uint32_t pktOutSize = wrapperLength + minPacketSizeFromID(PacketID::DummyPacket) + payloadLen;
   // delay times are rounded down, so data rate may be slightly higher
   uint64_t usBetweenPackets = 1E6 * pktOutSize / bytesPerSecond;
 
@@ -256,7 +279,7 @@ int main(int argc, char** argv)
         fds[0].revents &= ~POLLIN;
 
         // Attempt to fill buffer
-        ssize_t bytesRead = read(serialFileno, buf + len, sizeof(buf) - len);
+        ssize_t bytesRead = read(serialFileno, ring.writePtr(), ring.writeSpace());
 
         if (bytesRead == -1) {
           perror("Error reading from serial");
@@ -266,8 +289,8 @@ int main(int argc, char** argv)
         // println("read %ld bytes", bytesRead);
 
         // Attempt to parse packets
-        len += bytesRead;
-        len = parser.extractPackets(buf, len);
+        ring.commitWrite(bytesRead);
+        parser.extractPackets(ring);
       }
     } // end of poll check
 
@@ -279,7 +302,7 @@ int main(int argc, char** argv)
       // Not retrying for partial writes
 
       // copy in a chunk of dummy data
-      memcpy(dummyPkt.payload, dummyData + (dummyPkt.outId % (1 + sizeof(dummyData) - sizeof(dummyPkt.payload))), sizeof(dummyPkt.payload));
+      setDummyPayload(dummyWrap.packet, dummyData + (dummyPkt.outId % (1 + sizeof(dummyData) - sizeof(dummyPkt.payload))), payloadLen);
 
       if (writeWrappedReport(serialFileno, setPacketWrapper(dummyWrap))) {
         outPktCount++;
@@ -310,13 +333,14 @@ int main(int argc, char** argv)
       uint32_t inBpsTotal = processer.inPktCount * pktOutSize * 1E6 / t;
       uint32_t inBpsInterval = (processer.inPktCount - lastInPktCount) * pktOutSize * 1E6 / usBetweenReports;
       lastInPktCount = processer.inPktCount;
-      println("Got %d packets (last id %d). Dropped %d. Pending %d. Bps total %d, in interval %d", //
+      println("Got %d packets (last id %d). Dropped %d. Pending %d. Bps total %d, in interval %d. Line utilization %.1f%%", //
               processer.inPktCount,
               processer.lastInId,
               processer.lastInId + 1 - processer.inPktCount, // many ways to calculate drops
               outPktCount - 1 - processer.lastInId,
               inBpsTotal,
-              inBpsInterval);
+              inBpsInterval,
+              100.0 * inBpsTotal / lineRate);
 
       nextReportEvent += usBetweenReports;
     }
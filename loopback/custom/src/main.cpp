@@ -25,6 +25,7 @@
 #include "usb_device.h"
 // Above includes are for initialization.
 
+#include "crc_engine.h"
 #include "itm_logger_task.h" // dedicated logging task
 #include "itm_logging.h"     // ITM prints
 #include "no_new.h"          // Traps unwanted usage of new or delete
@@ -32,6 +33,7 @@
 #include "profiling.h" // include to enable rtos task profiling
 #include "task_utilities.h"
 #include "throughput_tasks.h"
+#include "uart_reactor.h"
 #include "uart_tasks.h"
 #include "usb_task.h"
 
@@ -42,6 +44,7 @@
 #define TEST_USB_PACKET_PARSING
 //#define TEST_USB_SINGLE_UART_LOOPBACK
 //#define TEST_USB_ALL_UART_LOOPBACK
+//#define TEST_STREAM_BUFFER_THROUGHPUT
 
 // These functions are defined in C files.
 // This block lets us use those functions here.
@@ -67,6 +70,8 @@ int main(void)
   MX_UART7_Init();
   MX_UART9_Init();
   MX_TIM11_Init();
+  MX_CRC_Init(); // for CrcEngine
+  initCrcEngine();
 
   itmSendStringln("Starting...");
 
@@ -88,27 +93,32 @@ int main(void)
   // This assumes all UARTs are hardwired as loopback, but it's also okay to hardwire
   // different UARTs to each other.
 
-  static UartTasks uart4Tasks("uart4", uartInfo4, utilities);
+  // Coalesce uart4 rx wakeups, for comparing rxWakeupsPerSec against the others.
+  // Reader wakes once 64 bytes are waiting, or 2 ms after the first.
+  static UartRxCoalescing uart4Coalescing;
+  uart4Coalescing.minBytes = 64;
+  uart4Coalescing.maxDelayUs = 2000;
+  static StaticUartTasks<> uart4Tasks("uart4", uartInfo4, utilities, NULL, LinkFraming::Raw, uart4Coalescing);
   static Producer producer4("producer4", 4, uart4Tasks, utilities);
   static Consumer consumer4("consumer4", uart4Tasks, utilities);
 
-  static UartTasks uart5Tasks("uart5", uartInfo5, utilities);
+  static StaticUartTasks<> uart5Tasks("uart5", uartInfo5, utilities);
   static Producer producer5("producer5", 5, uart5Tasks, utilities);
   static Consumer consumer5("consumer5", uart5Tasks, utilities);
 
-  static UartTasks uart7Tasks("uart7", uartInfo7, utilities);
+  static StaticUartTasks<> uart7Tasks("uart7", uartInfo7, utilities);
   static Producer producer7("producer7", 7, uart7Tasks, utilities);
   static Consumer consumer7("consumer7", uart7Tasks, utilities);
 
   /*
   // Cannot enable both uart 5 and uart 8.
   // uart 5 rx and uart 8 tx conflict on dma1 stream 0
-  static UartTasks uart8Tasks("uart8", uartInfo8, utilities);
+  static StaticUartTasks<> uart8Tasks("uart8", uartInfo8, utilities);
   static Producer producer8("producer8", 8, uart8Tasks, utilities);
   static Consumer consumer8("consumer8", uart8Tasks, utilities);
   */
 
-  static UartTasks uart9Tasks("uart9", uartInfo9, utilities);
+  static StaticUartTasks<> uart9Tasks("uart9", uartInfo9, utilities);
   static Producer producer9("producer9", 9, uart9Tasks, utilities);
   static Consumer consumer9("consumer9", uart9Tasks, utilities);
 
@@ -138,8 +148,10 @@ int main(void)
   // with the appropriate fields modified.
 
   static UsbTask usbTask(utilities);
-  static PacketIntake packetIntake("intake", usbTask, utilities);
-  static PacketOutput packetOutput("output", usbTask, utilities);
+  // Packets are passed between tasks by handles into this pool
+  static StaticPacketPool<24> packetPool;
+  static PacketIntake packetIntake("intake", usbTask, packetPool, utilities);
+  static PacketOutput packetOutput("output", usbTask, packetPool, utilities);
   static Coupling packetLoopback("coupling", packetIntake, packetOutput, utilities);
 
   // Allow watchdog to note timeouts via PacketOutput
@@ -151,7 +163,7 @@ int main(void)
   // This assumes UART 5 is hardwired to itself
 
   static UsbTask usbTask(utilities);
-  static UartTasks uart5Tasks("uart5", uartInfo5, utilities);
+  static StaticUartTasks<> uart5Tasks("uart5", uartInfo5, utilities);
   static Coupling c1("usbToUart5", usbTask, uart5Tasks, utilities);
   static Coupling c2("uart5ToUsb", uart5Tasks, usbTask, utilities);
 
@@ -163,24 +175,58 @@ int main(void)
   // - uart7 connected to uart9.
   // - uart4 and and uart5 are connected to themselves.
 
-  // At theoretical maximum of 11.52 KBps (@ 115200 baud with start and stop bits),
-  // consumes less than 8% of available CPU across 15 tasks.
+  // With per-UART tx tasks, at theoretical maximum of 11.52 KBps
+  // (@ 115200 baud with start and stop bits), consumes less than 8%
+  // of available CPU across 15 tasks. Not re-measured with the reactor.
+
+  // With a UartReactor, all UART tx is driven by one task,
+  // instead of a tx task per UART.
+  // Comment out this define to give each UART its own tx task instead.
+#define USE_UART_REACTOR
 
   static UsbTask usbTask(utilities);
-  static UartTasks uart7Tasks("uart7", uartInfo7, utilities);
-  static UartTasks uart9Tasks("uart9", uartInfo9, utilities);
-  static UartTasks uart5Tasks("uart5", uartInfo5, utilities);
-  static UartTasks uart4Tasks("uart4", uartInfo4, utilities);
+#ifdef USE_UART_REACTOR
+  static UartReactor uartReactor("uartReactor", utilities);
+  static StaticUartPort<> uart7Port("uart7", uartInfo7, utilities);
+  static StaticUartPort<> uart9Port("uart9", uartInfo9, utilities);
+  static StaticUartPort<> uart5Port("uart5", uartInfo5, utilities);
+  static StaticUartPort<> uart4Port("uart4", uartInfo4, utilities);
+  uartReactor.add(uart7Port);
+  uartReactor.add(uart9Port);
+  uartReactor.add(uart5Port);
+  uartReactor.add(uart4Port);
+#else
+  static StaticUartTasks<> uart7Port("uart7", uartInfo7, utilities);
+  static StaticUartTasks<> uart9Port("uart9", uartInfo9, utilities);
+  static StaticUartTasks<> uart5Port("uart5", uartInfo5, utilities);
+  static StaticUartTasks<> uart4Port("uart4", uartInfo4, utilities);
+#endif
 
-  static Coupling c1("usbToUart7", usbTask, uart7Tasks, utilities);
+  static Coupling c1("usbToUart7", usbTask, uart7Port, utilities);
   // uart7 tx wired to uart9 rx
-  static Coupling c2("uart9ToUart4", uart9Tasks, uart4Tasks, utilities);
+  static Coupling c2("uart9ToUart4", uart9Port, uart4Port, utilities);
   // uart4 wired to itself
-  static Coupling c3("uart4ToUart5", uart4Tasks, uart5Tasks, utilities);
+  static Coupling c3("uart4ToUart5", uart4Port, uart5Port, utilities);
   // uart5 wired to itself
-  static Coupling c4("uart5ToUart9", uart5Tasks, uart9Tasks, utilities);
+  static Coupling c4("uart5ToUart9", uart5Port, uart9Port, utilities);
   // uart9 tx wired to uart7 rx
-  static Coupling c5("uart7ToUsb", uart7Tasks, usbTask, utilities);
+  static Coupling c5("uart7ToUsb", uart7Port, usbTask, utilities);
+
+#elif defined TEST_STREAM_BUFFER_THROUGHPUT
+
+  // Compares task-to-task throughput of the FreeRTOS stream buffer
+  // against the lock-free SPSC ring. Consumers log KB/s to ITM.
+  // Only one pair runs at a time, so they don't share the CPU.
+  // Comment out this define to benchmark StaticStreamBuffer instead.
+#define BENCH_SPSC_STREAM_BUFFER
+
+#ifdef BENCH_SPSC_STREAM_BUFFER
+  static SpscStreamBuffer<1024> streamBuf;
+#else
+  static StaticStreamBuffer<1024> streamBuf;
+#endif
+  static StreamProducer streamProducer("streamProducer", streamBuf, utilities);
+  static StreamConsumer streamConsumer("streamConsumer", streamBuf, utilities);
 #endif
 
   /* Start scheduler */
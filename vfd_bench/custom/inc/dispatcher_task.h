@@ -1,5 +1,6 @@
 /*
  * Routes incoming packets to various tasks.
+ * Packets are passed by pool handle, rather than copied.
  */
 
 #pragma once
@@ -35,6 +36,4 @@ private:
   TaskUtilities util;
 
   StaticTask<DispatcherTask> task;
-
-  Packet packet;
 };
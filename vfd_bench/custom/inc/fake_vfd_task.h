@@ -18,7 +18,7 @@ class FakeVfdTask
 {
 public:
   FakeVfdTask(const char* name,                       // task name
-              UartTasks& uart,                        // where to receive and send modbus data
+              UartPort& uart,                         // where to receive and send modbus data
               TaskUtilitiesArg& utilArg,              // common utilities
               UBaseType_t priority = osPriorityNormal // task priority
   );
@@ -29,7 +29,7 @@ public:
 private:
   static void funcWrapper(FakeVfdTask* p) { p->func(); }
 
-  UartTasks& uart;
+  UartPort& uart;
 
   TaskUtilities util;
 
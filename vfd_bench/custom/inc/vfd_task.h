@@ -1,20 +1,22 @@
 /*
  * Manages communications with GS3 VFD.
  * https://cdn.automationdirect.com/static/manuals/gs3m/gs3m.pdf
- * Receives packet commands over Writable interface.
+ * Receives packet commands over PacketWritable interface.
  * Sends results to provided target.
  */
 
 #pragma once
 
 #include "modbus_driver.h"
+#include "packet_pool.h"
 
-class VfdTask : public Writable
+class VfdTask : public PacketWritable
 {
 public:
   VfdTask(const char* name,                       // task name
-          UartTasks& uart,                        // where to send and receive modbus data
-          Writable& target,                       // where to send resulting packets
+          UartPort& uart,                         // where to send and receive modbus data
+          PacketWritable& target,                 // where to send resulting packets
+          PacketPool& pool,                       // where to store commands and results
           TaskUtilitiesArg& utilArg,              // common utilities
           UBaseType_t priority = osPriorityNormal // task priority
   );
@@ -23,26 +25,31 @@ public:
   void func();
 
   // Required by Writable interface.
-  // Describes how to give command packets to this object.
+  // Describes how to give copies of command packets to this object.
   size_t write(const void* buf, size_t len, TickType_t ticks);
 
+  // Required by PacketWritable interface.
+  // Describes how to give command packets to this object without copying.
+  bool writeHandle(PacketHandle handle, TickType_t ticks);
+
 private:
   static void funcWrapper(VfdTask* p) { p->func(); }
 
   // Could follow the interfaces approach for uart too, but more involved,
   // or requires splitting into two separate args for read/write.
   // https://stackoverflow.com/questions/33427561/composing-interfaces-in-c
-  UartTasks& uart;
+  UartPort& uart;
 
-  Writable& target;
-  Packet packet; // for receiving and reporting
+  PacketWritable& target;
+  PacketPool& pool;
+  Packet packet; // for modbus driver error reports
 
   TaskUtilities util;
 
   StaticTask<VfdTask> task;
 
   // Where to stash incoming command packets.
-  StaticMessageBuffer<sizeof(Packet) * 12> msgbuf;
+  StaticQueue<PacketHandle, 12> commands;
 
   ModbusDriver bus;
 };
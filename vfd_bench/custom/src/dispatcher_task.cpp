@@ -27,18 +27,18 @@ void DispatcherTask::func()
     util.watchdogKick();
 
     // Get next available packet
-    util.read(packetIntake, &packet, sizeof(packet));
+    PacketHandle handle = util.readHandle(packetIntake);
 
     // Todo - more error handling. Double-check lengths, etc.
 
     // Route vfd commands to vfdTask.
     // All other packets go straight to output.
-    switch (packet.id) {
+    switch (handle->packet.id) {
       case PacketID::VfdSetFrequency: //
-        util.write(vfdTask, &packet, packet.length);
+        util.writeHandle(vfdTask, handle);
         break;
       default: //
-        util.write(packetOutput, &packet, packet.length);
+        util.writeHandle(packetOutput, handle);
         break;
     }
   }
@@ -9,7 +9,7 @@
 
 FakeVfdTask::FakeVfdTask( //
   const char* name,
-  UartTasks& uart,
+  UartPort& uart,
   TaskUtilitiesArg& utilArg,
   UBaseType_t priority)
   : uart{ uart }
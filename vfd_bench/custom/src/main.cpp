@@ -25,18 +25,30 @@
 #include "usb_device.h"
 // Above includes are for initialization.
 
+#include "crc_engine.h"
 #include "dispatcher_task.h"
 #include "fake_vfd_task.h"
 #include "itm_logger_task.h" // dedicated logging task
 #include "no_new.h"          // Traps unwanted usage of new or delete
 #include "packet_flow_tasks.h"
 #include "profiling.h" // include to enable rtos task profiling
+#include "stm32f4xx_ll_bus.h"
+#include "stm32f4xx_ll_rng.h"
 #include "usb_task.h"
 #include "vfd_task.h"
 
 // Uncomment the following line to run a simulated VFD modbus server
 #define USE_FAKE_VFD
 
+// Uncomment the following line for reliable delivery over USB.
+// Host apps must also enable this, such as with `commander --reliable`.
+// #define USE_ARQ
+
+// Uncomment the following line to skip log formatting on the target,
+// and send logs to the host as LogMessage packets over USB.
+// Decode these with host_apps/binlog.
+// #define USE_BINARY_LOG_PACKETS
+
 // These functions are defined in C files.
 // This block lets us use those functions here.
 extern "C"
@@ -44,6 +56,20 @@ extern "C"
   void SystemClock_Config(void);
 }
 
+#ifdef USE_ARQ
+// Reads the hardware RNG. Its 48 MHz clock is shared with USB.
+static uint32_t hardwareRandom()
+{
+  LL_AHB2_GRP1_EnableClock(LL_AHB2_GRP1_PERIPH_RNG);
+  LL_RNG_Enable(RNG);
+  while (!LL_RNG_IsActiveFlag_DRDY(RNG)) {
+  }
+  uint32_t value = LL_RNG_ReadRandData32(RNG);
+  LL_RNG_Disable(RNG);
+  return value;
+}
+#endif
+
 // Application entry point
 int main(void)
 {
@@ -62,6 +88,8 @@ int main(void)
   MX_UART7_Init();
   MX_UART9_Init();
   MX_TIM11_Init();
+  MX_CRC_Init(); // for CrcEngine
+  initCrcEngine();
 
   itmSendStringln("Starting...");
 
@@ -76,21 +104,40 @@ int main(void)
   static TaskUtilitiesArg utilities(logger, watchdog);
 
   static UsbTask usbTask(utilities);
-  static PacketIntake packetIntake("intake", usbTask, utilities);
-  static PacketOutput packetOutput("output", usbTask, utilities);
+  // Packets are passed between tasks by handles into this pool
+  static StaticPacketPool<24> packetPool;
+  static PacketIntake packetIntake("intake", usbTask, packetPool, utilities);
+  static PacketOutput packetOutput("output", usbTask, packetPool, utilities);
+  // Status packets are small and bursty, so bundle them when several are waiting
+  packetOutput.aggregatePackets = true;
 
   // Allow watchdog to note timeouts via PacketOutput
   watchdog.packetOutput = &packetOutput;
 
+#ifdef USE_BINARY_LOG_PACKETS
+  logger.binaryLog = true;
+  logger.forwardTo(packetOutput);
+#endif
+
+#ifdef USE_ARQ
+  // Random start marks each boot as a new session to the host
+  static ArqSender arqSender(hardwareRandom());
+  static ArqReceiver arqReceiver;
+  packetOutput.arq = &arqSender;
+  packetIntake.arq = &arqReceiver;
+  packetIntake.arqOutput = &packetOutput;
+#endif
+
   // Modbus client running on uart port 8
   static HalfDuplexCallbacks uart8halfDuplex(GPIOE, LL_GPIO_PIN_14);
-  static UartTasks uart8Tasks("uart8", uartInfo8, utilities, &uart8halfDuplex);
-  static VfdTask vfdTask("vfdTask", uart8Tasks, packetOutput, utilities);
+  // Modbus packets are small and infrequent, so this link gets minimum size buffers
+  static StaticUartTasks<uartMinBufSize, uartMinBufSize> uart8Tasks("uart8", uartInfo8, utilities, &uart8halfDuplex);
+  static VfdTask vfdTask("vfdTask", uart8Tasks, packetOutput, packetPool, utilities);
 
 #ifdef USE_FAKE_VFD
   // Run a simulated VFD modbus server on uart port 9.
   // Must link uart ports 8 and 9 with loopback cable.
-  static UartTasks uart9Tasks("uart9", uartInfo9, utilities);
+  static StaticUartTasks<uartMinBufSize, uartMinBufSize> uart9Tasks("uart9", uartInfo9, utilities);
   static FakeVfdTask fakeVfd("fakeVfd", uart9Tasks, utilities);
 #endif
 
@@ -11,12 +11,14 @@
 
 VfdTask::VfdTask( //
   const char* name,
-  UartTasks& uart,
-  Writable& target,
+  UartPort& uart,
+  PacketWritable& target,
+  PacketPool& pool,
   TaskUtilitiesArg& utilArg,
   UBaseType_t priority)
   : uart{ uart }
   , target{ target }
+  , pool{ pool }
   , util{ utilArg }
   , task{ name, funcWrapper, this, priority }
   , bus{ uart, responseDelayMs, target, packet, util }
@@ -47,11 +49,13 @@ void VfdTask::func()
     util.watchdogKick();
 
     // Collect all incoming host commands before deciding what modbus commands to send
-    while (msgbuf.read(&packet, sizeof(packet), 0)) {
-      switch (packet.id) {
+    PacketHandle handle;
+    while (xQueueReceive(commands.handle, &handle, 0) == pdPASS) {
+      const Packet& command = handle->packet;
+      switch (command.id) {
         case PacketID::VfdSetFrequency: {
-          uint8_t node = packet.body.vfdSetFrequency.node;
-          uint16_t freq = packet.body.vfdSetFrequency.frequency;
+          uint8_t node = command.body.vfdSetFrequency.node;
+          uint16_t freq = command.body.vfdSetFrequency.frequency;
           util.logln( //
             "%s got command to set vfd %u frequency to %u.%u Hz",
             pcTaskGetName(task.handle),
@@ -74,10 +78,11 @@ void VfdTask::func()
           util.logln( //
             "%s doesn't know what to do with packet id: %s",
             pcTaskGetName(task.handle),
-            packetIdToString(packet.id));
+            packetIdToString(command.id));
           critical();
           break;
       }
+      pool.release(handle);
     }
 
     // For each address in round-robbin fashion,
@@ -143,13 +148,18 @@ void VfdTask::func()
             case statusRegAddress:
               // Response size is already verified by modbus driver.
 
-              // Form packet for reporting
-              setPacketIdAndLength(packet, PacketID::VfdStatus);
-              packet.body.vfdStatus.nodeAddress = bus.inPkt->nodeAddress;
-              memcpy(&packet.body.vfdStatus.payload, bus.inPkt->readMultipleRegistersResponse.payload, sizeof(VfdStatus::payload));
+              // Form packet for reporting directly in pool
+              {
+                PacketHandle status = util.alloc(pool);
+                Packet& report = status->packet;
+                initializePacket(report, PacketID::VfdStatus);
+                report.origin = PacketOrigin::TargetToHost;
+                report.body.vfdStatus.nodeAddress = bus.inPkt->nodeAddress;
+                memcpy(&report.body.vfdStatus.payload, bus.inPkt->readMultipleRegistersResponse.payload, sizeof(VfdStatus::payload));
 
-              // Report result of modbus request
-              util.write(target, &packet, packet.length);
+                // Report result of modbus request
+                util.writeHandle(target, status);
+              }
 
               break;
 
@@ -214,7 +224,27 @@ void VfdTask::func()
   }
 }
 
+// Copies command into pool, then queues it like writeHandle()
 size_t VfdTask::write(const void* buf, size_t len, TickType_t ticks)
 {
-  return msgbuf.write(buf, len, ticks);
+  if (len > sizeof(Packet)) {
+    critical();
+  }
+
+  PacketHandle handle = pool.alloc(ticks);
+  if (!handle) {
+    return 0;
+  }
+  memcpy(&handle->packet, buf, len);
+
+  if (!writeHandle(handle, ticks)) {
+    pool.release(handle);
+    return 0;
+  }
+  return len;
+}
+
+bool VfdTask::writeHandle(PacketHandle handle, TickType_t ticks)
+{
+  return xQueueSendToBack(commands.handle, &handle, ticks) == pdPASS;
 }